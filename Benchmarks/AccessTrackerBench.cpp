@@ -0,0 +1,153 @@
+// Records the downsample chain of a 13-mip cubemap into CAccessTracker, the way a mip generator
+//   does: for each mip and face, sample the one above and render into it. Then the whole image
+//   is sampled and the tracker deploys its barriers for submission. Barrier calls go to a
+//   recorder that only counts them, so this times the tracker alone and no device is needed.
+//   Reports the time per transition, the runs in the image's last-access map after each pass and
+//   the barriers per frame, next to what the rectangle maps did on the same pattern
+//
+//   AccessTrackerBench [frames]
+#include "AccessTracker.h"
+#include "ImageVk.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace RHI;
+
+namespace
+{
+
+// Measured with the rectangle-keyed std::map the dense table replaced
+const double kRectangleNsPerTransition = 658.5;
+const double kRectangleRunsPerPass = 42.29;
+const size_t kRectangleRunsMax = 78;
+const double kRectangleBarriersPerFrame = 144.0;
+
+class CCountingRecorder : public CBarrierRecorderVk
+{
+public:
+    void PipelineBarrier(VkCommandBuffer, VkPipelineStageFlags, VkPipelineStageFlags,
+                         uint32_t bufferBarrierCount, const VkBufferMemoryBarrier*,
+                         uint32_t imageBarrierCount, const VkImageMemoryBarrier*) override
+    {
+        Calls++;
+        Barriers += bufferBarrierCount + imageBarrierCount;
+    }
+
+    void WaitEvent(VkCommandBuffer, VkEvent, VkPipelineStageFlags, VkPipelineStageFlags,
+                   const VkImageMemoryBarrier* imageBarrier) override
+    {
+        Calls++;
+        Barriers += imageBarrier ? 1 : 0;
+    }
+
+    size_t Calls = 0;
+    size_t Barriers = 0;
+};
+
+class CCubemap : public CImageVk
+{
+public:
+    CCubemap()
+    {
+        InitializeAccess(0, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, VK_IMAGE_LAYOUT_UNDEFINED);
+    }
+
+    // CImage interface
+    EFormat GetFormat() const override { return EFormat::R16G16B16A16_SFLOAT; }
+    EImageUsageFlags GetUsageFlags() const override { return EImageUsageFlags::Sampled; }
+    uint32_t GetWidth() const override { return 4096; }
+    uint32_t GetHeight() const override { return 4096; }
+    uint32_t GetDepth() const override { return 1; }
+    uint32_t GetMipLevels() const override { return 13; }
+    uint32_t GetArrayLayers() const override { return 6; }
+    uint32_t GetSampleCount() const override { return 1; }
+
+    // CImageVk interface
+    VkImage GetVkImage() const override { return (VkImage)(uintptr_t)1; }
+    VkFormat GetVkFormat() const override { return VK_FORMAT_R16G16B16A16_SFLOAT; }
+    bool IsConcurrentAccess() const override { return false; }
+    bool IsSwapChainProxy() const override { return false; }
+};
+
+size_t CountRuns(const CImageAccessMap* map, const CImageSubresourceRange& range)
+{
+    size_t runs = 0;
+    if (map)
+        map->ForEachRun(range, [&](const CImageSubresourceRange&, const CAccessRecord&) {
+            runs++;
+        });
+    return runs;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 1000;
+
+    CCountingRecorder recorder;
+    CBarrierBatchVk::SetRecorder(&recorder);
+    auto cmdBuffer = (VkCommandBuffer)(uintptr_t)1;
+    CCubemap cubemap;
+    CImageSubresourceRange whole;
+    whole.Set(0, cubemap.GetMipLevels(), 0, cubemap.GetArrayLayers());
+
+    size_t transitions = 0;
+    size_t passes = 0;
+    size_t runSum = 0;
+    size_t runMax = 0;
+    std::chrono::nanoseconds trackerTime(0);
+    for (int frame = 0; frame < frames; frame++)
+    {
+        CAccessTracker tracker;
+        for (uint32_t mip = 1; mip < cubemap.GetMipLevels(); mip++)
+            for (uint32_t face = 0; face < cubemap.GetArrayLayers(); face++)
+            {
+                CImageSubresourceRange src, dst;
+                src.Set(mip - 1, 1, face, 1);
+                dst.Set(mip, 1, face, 1);
+                auto start = std::chrono::steady_clock::now();
+                tracker.TransitionImage(cmdBuffer, &cubemap, src, VK_ACCESS_SHADER_READ_BIT,
+                                        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+                tracker.TransitionImage(cmdBuffer, &cubemap, dst,
+                                        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                                        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+                tracker.FlushBarriers(cmdBuffer);
+                trackerTime += std::chrono::steady_clock::now() - start;
+                transitions += 2;
+
+                size_t runs = CountRuns(tracker.GetLastAccess(&cubemap), whole);
+                passes++;
+                runSum += runs;
+                runMax = std::max(runMax, runs);
+            }
+
+        // The next frame samples the finished cubemap
+        auto start = std::chrono::steady_clock::now();
+        tracker.TransitionImage(cmdBuffer, &cubemap, whole, VK_ACCESS_SHADER_READ_BIT,
+                                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+        tracker.FlushBarriers(cmdBuffer);
+        tracker.DeployAllBarriers(cmdBuffer);
+        trackerTime += std::chrono::steady_clock::now() - start;
+        transitions++;
+    }
+    CBarrierBatchVk::SetRecorder(nullptr);
+
+    printf("%d frames, %zu transitions, %.1f barrier calls per frame\n", frames, transitions,
+           static_cast<double>(recorder.Calls) / frames);
+    printf("%-15s: %7.1f ns/transition, %6.2f runs/image after each pass (max %2zu), %5.1f "
+           "barriers/frame\n",
+           "dense table", static_cast<double>(trackerTime.count()) / transitions,
+           static_cast<double>(runSum) / passes, runMax,
+           static_cast<double>(recorder.Barriers) / frames);
+    printf("%-15s: %7.1f ns/transition, %6.2f runs/image after each pass (max %2zu), %5.1f "
+           "barriers/frame\n",
+           "rectangle maps", kRectangleNsPerTransition, kRectangleRunsPerPass, kRectangleRunsMax,
+           kRectangleBarriersPerFrame);
+    return 0;
+}
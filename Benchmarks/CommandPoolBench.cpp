@@ -0,0 +1,68 @@
+// How command buffer allocation scales with the number of recording threads. Every frame, the
+//   threads allocate, begin and end a batch of primary buffers and free them again, all through
+//   one CCommandBufferAllocatorVk. Nothing is submitted. Runs fine on a software device such as
+//   lavapipe
+//
+//   CommandPoolBench [buffers per thread] [frames]
+#include "CommandBufferVk.h"
+#include "DeviceVk.h"
+#include "RHIInstance.h"
+#include "WorkerPool.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+using namespace RHI;
+
+int main(int argc, char** argv)
+{
+    int buffersPerThread = argc > 1 ? atoi(argv[1]) : 256;
+    int frames = argc > 2 ? atoi(argv[2]) : 20;
+    const uint32_t frameCount = 3;
+    // Small jobs, so that a thread that falls behind doesn't hold up the frame
+    const int buffersPerJob = 16;
+
+    auto device = CInstance::Get().CreateDevice(EDeviceCreateHints::NoHint);
+    auto& deviceVk = static_cast<CDeviceVk&>(*device);
+
+    double singleThreadTime = 0.0;
+    for (size_t threads : { 1, 2, 4, 8, 16 })
+    {
+        CCommandBufferAllocatorVk allocator(deviceVk, EQueueType::Render, frameCount);
+        CWorkerPool workers(threads - 1);
+        size_t jobCount = threads * buffersPerThread / buffersPerJob;
+        std::vector<std::vector<std::unique_ptr<CCommandBufferVk>>> jobBuffers(jobCount);
+
+        std::chrono::nanoseconds frameTime(0);
+        // The first frames create every thread's pools
+        for (int frame = -static_cast<int>(frameCount); frame < frames; frame++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            allocator.BeginFrame((frame + frameCount) % frameCount);
+            workers.Run(jobCount, [&](size_t job) {
+                auto& buffers = jobBuffers[job];
+                for (int i = 0; i < buffersPerJob; i++)
+                {
+                    buffers.push_back(allocator.Allocate());
+                    buffers.back()->BeginRecording(nullptr, 0);
+                    buffers.back()->EndRecording();
+                }
+            });
+            // What the queue does once the frame's lists are done on the GPU
+            for (auto& buffers : jobBuffers)
+                buffers.clear();
+            if (frame >= 0)
+                frameTime += std::chrono::steady_clock::now() - start;
+        }
+
+        double bufferTime =
+            static_cast<double>(frameTime.count()) / frames / (jobCount * buffersPerJob);
+        if (threads == 1)
+            singleThreadTime = bufferTime;
+        printf("%2zu threads: %.1f ns/buffer, %.1f M buffers/s, %.2fx\n", threads, bufferTime,
+               1000.0 / bufferTime, singleThreadTime / bufferTime);
+    }
+    return 0;
+}
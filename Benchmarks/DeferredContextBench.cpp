@@ -0,0 +1,120 @@
+// Recording cost per draw with a direct render context against a deferred one, both recording
+//   into a single subpass. Record is the time the calling thread spends in the context, total adds
+//   finishing the render pass and committing the list, which is where the deferred stream gets
+//   translated. Submission is not timed. Needs a Vulkan device
+//
+//   DeferredContextBench [draws] [frames]
+#include "CommandQueueVk.h"
+#include "RHIInstance.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace RHI;
+
+namespace
+{
+
+// Writes a zero gl_Position
+const uint32_t kVertexShader[] = {
+    0x07230203, 0x00010000, 0, 10, 0, // Header, 10 ids
+    0x00020011, 1, // OpCapability Shader
+    0x0003000E, 0, 1, // OpMemoryModel Logical GLSL450
+    0x0006000F, 0, 8, 0x6E69616D, 0, 6, // OpEntryPoint Vertex %8 "main" %6
+    0x00040047, 6, 11, 0, // OpDecorate %6 BuiltIn Position
+    0x00020013, 1, // %1 = OpTypeVoid
+    0x00030021, 2, 1, // %2 = OpTypeFunction %1
+    0x00030016, 3, 32, // %3 = OpTypeFloat 32
+    0x00040017, 4, 3, 4, // %4 = OpTypeVector %3 4
+    0x00040020, 5, 3, 4, // %5 = OpTypePointer Output %4
+    0x0004003B, 5, 6, 3, // %6 = OpVariable %5 Output
+    0x0003002E, 4, 7, // %7 = OpConstantNull %4
+    0x00050036, 1, 8, 0, 2, // %8 = OpFunction %1 None %2
+    0x000200F8, 9, // %9 = OpLabel
+    0x0003003E, 6, 7, // OpStore %6 %7
+    0x000100FD, // OpReturn
+    0x00010038 // OpFunctionEnd
+};
+
+// void main() {}
+const uint32_t kFragmentShader[] = {
+    0x07230203, 0x00010000, 0, 5, 0, // Header, 5 ids
+    0x00020011, 1, // OpCapability Shader
+    0x0003000E, 0, 1, // OpMemoryModel Logical GLSL450
+    0x0005000F, 4, 3, 0x6E69616D, 0, // OpEntryPoint Fragment %3 "main"
+    0x00030010, 3, 7, // OpExecutionMode %3 OriginUpperLeft
+    0x00020013, 1, // %1 = OpTypeVoid
+    0x00030021, 2, 1, // %2 = OpTypeFunction %1
+    0x00050036, 1, 3, 0, 2, // %3 = OpFunction %1 None %2
+    0x000200F8, 4, // %4 = OpLabel
+    0x000100FD, // OpReturn
+    0x00010038 // OpFunctionEnd
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    int drawCount = argc > 1 ? atoi(argv[1]) : 10000;
+    int frames = argc > 2 ? atoi(argv[2]) : 20;
+
+    auto device = CInstance::Get().CreateDevice(EDeviceCreateHints::NoHint);
+    auto queue = std::static_pointer_cast<CCommandQueueVk>(device->CreateCommandQueue());
+
+    auto image = device->CreateImage2D(EFormat::R8G8B8A8_UNORM, EImageUsageFlags::RenderTarget,
+                                       256, 256);
+    CImageViewDesc viewDesc;
+    viewDesc.Type = EImageViewType::View2D;
+    viewDesc.Format = EFormat::R8G8B8A8_UNORM;
+    auto imageView = device->CreateImageView(viewDesc, image);
+    CRenderPassDesc renderPassDesc;
+    renderPassDesc.AddAttachment(imageView, EAttachmentLoadOp::Clear, EAttachmentStoreOp::Store);
+    renderPassDesc.NextSubpass().AddColorAttachment(0);
+    renderPassDesc.SetExtent(256, 256);
+    auto renderPass = device->CreateRenderPass(renderPassDesc);
+
+    CPipelineDesc pipelineDesc;
+    pipelineDesc.VS = device->CreateShaderModule(sizeof(kVertexShader), kVertexShader);
+    pipelineDesc.PS = device->CreateShaderModule(sizeof(kFragmentShader), kFragmentShader);
+    pipelineDesc.Layout = device->CreatePipelineLayout({});
+    pipelineDesc.RenderPass = renderPass;
+    auto pipeline = device->CreatePipeline(pipelineDesc);
+
+    for (bool deferred : { false, true })
+    {
+        std::chrono::nanoseconds recordTime(0);
+        std::chrono::nanoseconds totalTime(0);
+        for (int frame = -2; frame < frames; frame++)
+        {
+            auto cmdList = queue->CreateCommandList();
+            cmdList->Enqueue();
+            auto renderPassContext =
+                cmdList->CreateParallelRenderContext(renderPass, { CClearValue(0, 0, 0, 0) });
+
+            auto start = std::chrono::steady_clock::now();
+            auto ctx = deferred ? renderPassContext->CreateDeferredRenderContext(0)
+                                : renderPassContext->CreateRenderContext(0);
+            ctx->BindRenderPipeline(*pipeline);
+            for (int i = 0; i < drawCount; i++)
+                ctx->Draw(3, 1, 0, 0);
+            ctx->FinishRecording();
+            auto recorded = std::chrono::steady_clock::now();
+            renderPassContext->FinishRecording();
+            cmdList->Commit();
+            auto end = std::chrono::steady_clock::now();
+            if (frame >= 0)
+            {
+                recordTime += recorded - start;
+                totalTime += end - start;
+            }
+            queue->SubmitFrame();
+        }
+
+        double draws = static_cast<double>(frames) * drawCount;
+        printf("%-8s: record %.1f ns/draw, total %.1f ns/draw\n",
+               deferred ? "deferred" : "direct", recordTime.count() / draws,
+               totalTime.count() / draws);
+    }
+    queue->Finish();
+    return 0;
+}
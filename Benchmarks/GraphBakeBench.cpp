@@ -0,0 +1,150 @@
+// Builds, validates and bakes synthetic graphs of 100, 1k and 10k passes. Cold is a graph the
+//   plan cache has never seen, steady is the same graph rebuilt every frame, which hits the cache.
+//   Only the CPU side runs, no device is needed
+//
+//   GraphBakeBench [seed] [frames]
+#include "RenderGraph.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace RHI;
+
+namespace
+{
+
+struct CGraphShape
+{
+    std::vector<std::string> PassNames;
+    std::vector<std::string> TargetNames;
+    // Targets each pass samples, all written by the few passes right before it
+    std::vector<std::vector<size_t>> Reads;
+    // Targets nobody samples, the final pass gathers them so that nothing gets culled
+    std::vector<size_t> Unread;
+};
+
+CGraphShape MakeShape(size_t passCount, std::mt19937& rng)
+{
+    const size_t window = 8;
+    CGraphShape shape;
+    std::vector<bool> read(passCount, false);
+    for (size_t i = 0; i < passCount; i++)
+    {
+        shape.PassNames.push_back("Pass" + std::to_string(i));
+        shape.TargetNames.push_back("Target" + std::to_string(i));
+        shape.Reads.emplace_back();
+        if (i == 0)
+            continue;
+        size_t first = i > window ? i - window : 0;
+        for (uint32_t j = 1 + rng() % 3; j > 0; j--)
+        {
+            size_t target = first + rng() % (i - first);
+            auto& reads = shape.Reads.back();
+            if (std::find(reads.begin(), reads.end(), target) != reads.end())
+                continue;
+            reads.push_back(target);
+            read[target] = true;
+        }
+    }
+    for (size_t i = 0; i < passCount; i++)
+        if (!read[i])
+            shape.Unread.push_back(i);
+    return shape;
+}
+
+void BuildGraph(CRenderGraph& graph, const CGraphShape& shape)
+{
+    for (const auto& name : shape.TargetNames)
+        graph.AddTransientResource(name, EFormat::R8G8B8A8_UNORM).SetExtent(1920, 1080);
+    graph.AddTransientResource("Out", EFormat::R8G8B8A8_UNORM).SetExtent(1920, 1080);
+
+    for (size_t i = 0; i < shape.PassNames.size(); i++)
+    {
+        auto& pass = graph.AddRenderPass(shape.PassNames[i]);
+        for (size_t target : shape.Reads[i])
+            pass.AddShaderResource(shape.TargetNames[target]);
+        pass.AddColorAttachment(shape.TargetNames[i], 0, false, true);
+    }
+    auto& gather = graph.AddRenderPass("Final");
+    for (size_t target : shape.Unread)
+        gather.AddShaderResource(shape.TargetNames[target]);
+    gather.AddColorAttachment("Out", 0, false, true);
+    graph.SetGoal("Out");
+}
+
+double ToMicroseconds(std::chrono::nanoseconds time, int frames)
+{
+    return static_cast<double>(time.count()) / 1000.0 / frames;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    unsigned seed = argc > 1 ? static_cast<unsigned>(strtoul(argv[1], nullptr, 10)) : 1;
+    int frames = argc > 2 ? atoi(argv[2]) : 10;
+    std::mt19937 rng(seed);
+
+    for (size_t passCount : { 100, 1000, 10000 })
+    {
+        CGraphShape shape = MakeShape(passCount, rng);
+
+        // A fresh graph every frame, so every Bake compiles the plan
+        std::chrono::nanoseconds coldTime(0);
+        for (int frame = 0; frame < frames; frame++)
+        {
+            CRenderGraph graph;
+            auto start = std::chrono::steady_clock::now();
+            BuildGraph(graph, shape);
+            if (!graph.Validate())
+            {
+                printf("FAILED: %zu pass graph does not validate\n", passCount);
+                return 1;
+            }
+            graph.Bake();
+            coldTime += std::chrono::steady_clock::now() - start;
+            if (graph.GetPassOrder().size() != passCount + 1)
+            {
+                printf("FAILED: %zu pass graph scheduled %zu passes\n", passCount,
+                       graph.GetPassOrder().size());
+                return 1;
+            }
+        }
+
+        // The first frame compiles the plan, every one after rebuilds the graph and hits the cache
+        CRenderGraph graph;
+        BuildGraph(graph, shape);
+        graph.Validate();
+        graph.Bake();
+        std::chrono::nanoseconds buildTime(0);
+        std::chrono::nanoseconds steadyTime(0);
+        for (int frame = 0; frame < frames; frame++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            graph.Clear();
+            BuildGraph(graph, shape);
+            auto built = std::chrono::steady_clock::now();
+            graph.Validate();
+            graph.Bake();
+            auto end = std::chrono::steady_clock::now();
+            buildTime += built - start;
+            steadyTime += end - start;
+        }
+        if (graph.GetPlanCacheHits() != static_cast<size_t>(frames))
+        {
+            printf("FAILED: %zu pass graph hit the plan cache %zu times in %d frames\n", passCount,
+                   graph.GetPlanCacheHits(), frames);
+            return 1;
+        }
+
+        printf("%5zu passes: cold %.1f us, steady %.1f us (build %.1f us), %.1f ns/pass steady\n",
+               passCount, ToMicroseconds(coldTime, frames), ToMicroseconds(steadyTime, frames),
+               ToMicroseconds(buildTime, frames),
+               ToMicroseconds(steadyTime, frames) * 1000.0 / passCount);
+    }
+    return 0;
+}
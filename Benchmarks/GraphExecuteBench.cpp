@@ -0,0 +1,101 @@
+// Records a wide graph on 1, 2, 4, 8 and 16 threads. Every pass dispatches an empty compute
+//   shader into a list of its own and nothing depends on anything but the final pass, so all of
+//   them can record at once. Only Execute is timed, submission is not. Needs a Vulkan device
+//
+//   GraphExecuteBench [passes] [dispatches per pass] [frames]
+#include "CommandQueueVk.h"
+#include "RHIInstance.h"
+#include "RenderGraph.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+using namespace RHI;
+
+namespace
+{
+
+// void main() {} with a local size of 1
+const uint32_t kEmptyComputeShader[] = {
+    0x07230203, 0x00010000, 0, 5, 0, // Header, 5 ids
+    0x00020011, 1, // OpCapability Shader
+    0x0003000E, 0, 1, // OpMemoryModel Logical GLSL450
+    0x0005000F, 5, 3, 0x6E69616D, 0, // OpEntryPoint GLCompute %3 "main"
+    0x00060010, 3, 17, 1, 1, 1, // OpExecutionMode %3 LocalSize 1 1 1
+    0x00020013, 1, // %1 = OpTypeVoid
+    0x00030021, 2, 1, // %2 = OpTypeFunction %1
+    0x00050036, 1, 3, 0, 2, // %3 = OpFunction %1 None %2
+    0x000200F8, 4, // %4 = OpLabel
+    0x000100FD, // OpReturn
+    0x00010038 // OpFunctionEnd
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    int passCount = argc > 1 ? atoi(argv[1]) : 64;
+    int dispatchCount = argc > 2 ? atoi(argv[2]) : 256;
+    int frames = argc > 3 ? atoi(argv[3]) : 20;
+
+    auto device = CInstance::Get().CreateDevice(EDeviceCreateHints::NoHint);
+    auto queue = std::static_pointer_cast<CCommandQueueVk>(device->CreateCommandQueue());
+    auto shader = device->CreateShaderModule(sizeof(kEmptyComputeShader), kEmptyComputeShader);
+    CComputePipelineDesc pipelineDesc;
+    pipelineDesc.CS = shader;
+    pipelineDesc.Layout = device->CreatePipelineLayout({});
+    auto pipeline = device->CreateComputePipeline(pipelineDesc);
+
+    CRenderGraph graph;
+    graph.AddTransientBuffer("Out", 65536);
+    auto& gather = graph.AddRenderPass("Final");
+    for (int i = 0; i < passCount; i++)
+    {
+        std::string name = "Data" + std::to_string(i);
+        graph.AddTransientBuffer(name, 65536);
+        auto& pass = graph.AddRenderPass("Pass" + std::to_string(i));
+        pass.AddUnorderedAccess(name, false, true);
+        pass.SetExecuteFunc([&pipeline, dispatchCount](CCommandList& cmdList) {
+            auto ctx = cmdList.CreateComputeContext();
+            ctx->BindComputePipeline(*pipeline);
+            for (int j = 0; j < dispatchCount; j++)
+                ctx->Dispatch(1, 1, 1);
+            ctx->FinishRecording();
+        });
+        gather.AddShaderResource(name);
+    }
+    gather.AddUnorderedAccess("Out", false, true);
+    graph.SetGoal("Out");
+    if (!graph.Validate())
+    {
+        printf("FAILED: graph does not validate\n");
+        return 1;
+    }
+    graph.Bake();
+
+    double singleThreadTime = 0.0;
+    for (size_t threads : { 1, 2, 4, 8, 16 })
+    {
+        // The calling thread records too
+        graph.SetWorkerCount(threads - 1);
+        std::chrono::nanoseconds executeTime(0);
+        for (int frame = -2; frame < frames; frame++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            graph.Execute(*queue);
+            if (frame >= 0)
+                executeTime += std::chrono::steady_clock::now() - start;
+            queue->SubmitFrame();
+        }
+
+        double frameTime = static_cast<double>(executeTime.count()) / frames;
+        if (threads == 1)
+            singleThreadTime = frameTime;
+        printf("%2zu threads: %.1f us/frame, %.1f ns/dispatch, %.2fx\n", threads,
+               frameTime / 1000.0, frameTime / (passCount * dispatchCount),
+               singleThreadTime / frameTime);
+    }
+    queue->Finish();
+    return 0;
+}
@@ -114,6 +114,12 @@ template <typename TDerived> CCommandQueue::Ref CDeviceBase<TDerived>::CreateCom
     return static_cast<TDerived*>(this)->CreateCommandQueue();
 }
 
+template <typename TDerived>
+CCommandQueue::Ref CDeviceBase<TDerived>::CreateCommandQueue(EQueueType queueType)
+{
+    return static_cast<TDerived*>(this)->CreateCommandQueue(queueType);
+}
+
 template <typename TDerived>
 CSwapChain::Ref CDeviceBase<TDerived>::CreateSwapChain(const CPresentationSurfaceDesc& info,
                                                        EFormat format)
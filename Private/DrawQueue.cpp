@@ -0,0 +1,142 @@
+#include "DrawQueue.h"
+#include "RHIException.h"
+#include <numeric>
+
+namespace RHI
+{
+
+uint64_t CDrawQueue::MakeSortKey(uint16_t pipelineId, uint32_t materialId, float depth)
+{
+    // Also catches NaN
+    if (!(depth > 0.0f))
+        depth = 0.0f;
+    if (depth > 1.0f)
+        depth = 1.0f;
+    auto quantized = static_cast<uint64_t>(depth * static_cast<float>(0xFFFFFF));
+    return (static_cast<uint64_t>(pipelineId) << 48)
+        | (static_cast<uint64_t>(materialId & 0xFFFFFF) << 24) | quantized;
+}
+
+void CDrawQueue::Push(uint64_t sortKey, const CDrawPacket& packet)
+{
+    if (!packet.Pipeline)
+        throw CRHIRuntimeError("Draw packet without a pipeline");
+    Keys.push_back(sortKey);
+    Packets.push_back(packet);
+}
+
+void CDrawQueue::Flush(IRenderContext& ctx)
+{
+    if (Packets.empty())
+        return;
+    SortKeys();
+
+    // Nothing is known about what the context has bound before the first draw
+    CPipeline* boundPipeline = nullptr;
+    std::array<CDescriptorSet*, CDrawPacket::kMaxDescriptorSets> boundSets {};
+    std::array<CBuffer*, CDrawPacket::kMaxVertexBuffers> boundVertexBuffers {};
+    std::array<size_t, CDrawPacket::kMaxVertexBuffers> boundVertexOffsets {};
+    CBuffer* boundIndexBuffer = nullptr;
+    size_t boundIndexOffset = 0;
+    EFormat boundIndexFormat = EFormat::UNDEFINED;
+
+    for (uint32_t index : Order)
+    {
+        const auto& packet = Packets[index];
+        if (packet.Pipeline != boundPipeline)
+        {
+            ctx.BindRenderPipeline(*packet.Pipeline);
+            boundPipeline = packet.Pipeline;
+            Stats.PipelineBinds++;
+        }
+        for (uint32_t set = 0; set < CDrawPacket::kMaxDescriptorSets; set++)
+        {
+            CDescriptorSet* descriptorSet = packet.DescriptorSets[set];
+            if (!descriptorSet)
+                break;
+            if (descriptorSet == boundSets[set])
+                continue;
+            ctx.BindRenderDescriptorSet(set, *descriptorSet);
+            boundSets[set] = descriptorSet;
+            Stats.DescriptorSetBinds++;
+        }
+        for (uint32_t binding = 0; binding < CDrawPacket::kMaxVertexBuffers; binding++)
+        {
+            CBuffer* buffer = packet.VertexBuffers[binding];
+            if (!buffer)
+                break;
+            size_t offset = packet.VertexOffsets[binding];
+            if (buffer == boundVertexBuffers[binding] && offset == boundVertexOffsets[binding])
+                continue;
+            ctx.BindVertexBuffer(binding, *buffer, offset);
+            boundVertexBuffers[binding] = buffer;
+            boundVertexOffsets[binding] = offset;
+            Stats.VertexBufferBinds++;
+        }
+
+        if (packet.IndexBuffer)
+        {
+            if (packet.IndexBuffer != boundIndexBuffer || packet.IndexOffset != boundIndexOffset
+                || packet.IndexFormat != boundIndexFormat)
+            {
+                ctx.BindIndexBuffer(*packet.IndexBuffer, packet.IndexOffset, packet.IndexFormat);
+                boundIndexBuffer = packet.IndexBuffer;
+                boundIndexOffset = packet.IndexOffset;
+                boundIndexFormat = packet.IndexFormat;
+                Stats.IndexBufferBinds++;
+            }
+            ctx.DrawIndexed(packet.Count, packet.InstanceCount, packet.First, packet.VertexOffset,
+                            packet.FirstInstance);
+        }
+        else
+            ctx.Draw(packet.Count, packet.InstanceCount, packet.First, packet.FirstInstance);
+        Stats.Draws++;
+    }
+
+    Clear();
+}
+
+void CDrawQueue::Clear()
+{
+    Keys.clear();
+    Packets.clear();
+}
+
+void CDrawQueue::SortKeys()
+{
+    size_t count = Keys.size();
+    SortedKeys.assign(Keys.begin(), Keys.end());
+    KeyScratch.resize(count);
+    Order.resize(count);
+    OrderScratch.resize(count);
+    std::iota(Order.begin(), Order.end(), 0u);
+
+    for (uint32_t shift = 0; shift < 64; shift += 8)
+    {
+        std::array<size_t, 256> buckets {};
+        for (size_t i = 0; i < count; i++)
+            buckets[(SortedKeys[i] >> shift) & 0xFF]++;
+        // Every key has the same digit here, the pass wouldn't move anything. Common for the high
+        //   bytes with only a few pipelines around
+        if (buckets[(SortedKeys[0] >> shift) & 0xFF] == count)
+            continue;
+
+        size_t offset = 0;
+        for (auto& bucket : buckets)
+        {
+            size_t size = bucket;
+            bucket = offset;
+            offset += size;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t dst = buckets[(SortedKeys[i] >> shift) & 0xFF]++;
+            KeyScratch[dst] = SortedKeys[i];
+            OrderScratch[dst] = Order[i];
+        }
+        SortedKeys.swap(KeyScratch);
+        Order.swap(OrderScratch);
+    }
+}
+
+}
@@ -1,104 +1,213 @@
 #include "RenderGraph.h"
+#include "Device.h"
+#include "RHIException.h"
+#include "WorkerPool.h"
+#include <Hash.h>
+#include <algorithm>
+#include <exception>
+#include <numeric>
+#include <thread>
 
 namespace RHI
 {
 
+const std::string& CRenderNode::GetName() const { return Graph->Names[NameId]; }
+
 void CGraphRenderPass::AddColorAttachment(const std::string& resource, uint32_t index, bool read,
                                           bool write)
 {
-    assert(GetGraph().NameToNodeId.find(resource) != GetGraph().NameToNodeId.end());
-    size_t src = GetGraph().NameToNodeId[GetName()];
-    size_t dst = GetGraph().NameToNodeId[resource];
-    auto usage = GetGraph().AddEdge(src, dst);
-    usage->Type = EResourceUsageType::ColorAttachment;
-    usage->bRead = read;
-    usage->bWrite = write;
-    usage->ColorAttachmentIndex = index;
-    usage->RequiredState = EResourceState::RenderTarget;
+    uint32_t dst = GetGraph().FindNode(resource);
+    assert(dst != CRenderGraph::kInvalidId);
+    AddColorAttachment(static_cast<const CRenderResource&>(*GetGraph().Nodes[dst]), index, read,
+                       write);
+}
+
+void CGraphRenderPass::AddColorAttachment(const CRenderResource& resource, uint32_t index,
+                                          bool read, bool write)
+{
+    assert(!resource.IsBuffer());
+    auto& usage = GetGraph().AddEdge(GetId(), resource.GetId());
+    usage.Type = EResourceUsageType::ColorAttachment;
+    usage.bRead = read;
+    usage.bWrite = write;
+    usage.ColorAttachmentIndex = index;
+    usage.RequiredState = EResourceState::RenderTarget;
 }
 
 void CGraphRenderPass::AddDepthStencilAttachment(const std::string& resource, bool read, bool write)
 {
-    assert(GetGraph().NameToNodeId.find(resource) != GetGraph().NameToNodeId.end());
-    size_t src = GetGraph().NameToNodeId[GetName()];
-    size_t dst = GetGraph().NameToNodeId[resource];
-    auto usage = GetGraph().AddEdge(src, dst);
-    usage->Type = EResourceUsageType::DepthStencilAttachment;
-    usage->bRead = read;
-    usage->bWrite = write;
-    usage->RequiredState = EResourceState::DepthWrite;
+    uint32_t dst = GetGraph().FindNode(resource);
+    assert(dst != CRenderGraph::kInvalidId);
+    AddDepthStencilAttachment(static_cast<const CRenderResource&>(*GetGraph().Nodes[dst]), read,
+                              write);
+}
+
+void CGraphRenderPass::AddDepthStencilAttachment(const CRenderResource& resource, bool read,
+                                                 bool write)
+{
+    assert(!resource.IsBuffer());
+    auto& usage = GetGraph().AddEdge(GetId(), resource.GetId());
+    usage.Type = EResourceUsageType::DepthStencilAttachment;
+    usage.bRead = read;
+    usage.bWrite = write;
+    usage.ColorAttachmentIndex = 0;
+    usage.RequiredState = EResourceState::DepthWrite;
 }
 
 void CGraphRenderPass::AddShaderResource(const std::string& resource)
 {
-    assert(GetGraph().NameToNodeId.find(resource) != GetGraph().NameToNodeId.end());
-    size_t src = GetGraph().NameToNodeId[GetName()];
-    size_t dst = GetGraph().NameToNodeId[resource];
-    auto usage = GetGraph().AddEdge(src, dst);
-    usage->Type = EResourceUsageType::ShaderResource;
-    usage->bRead = true;
-    usage->bWrite = false;
-    usage->RequiredState = EResourceState::ShaderResource;
+    uint32_t dst = GetGraph().FindNode(resource);
+    assert(dst != CRenderGraph::kInvalidId);
+    AddShaderResource(static_cast<const CRenderResource&>(*GetGraph().Nodes[dst]));
+}
+
+void CGraphRenderPass::AddShaderResource(const CRenderResource& resource)
+{
+    auto& usage = GetGraph().AddEdge(GetId(), resource.GetId());
+    usage.Type = EResourceUsageType::ShaderResource;
+    usage.bRead = true;
+    usage.bWrite = false;
+    usage.ColorAttachmentIndex = 0;
+    usage.RequiredState = EResourceState::ShaderResource;
+}
+
+void CGraphRenderPass::AddIndirectArgument(const std::string& resource)
+{
+    uint32_t dst = GetGraph().FindNode(resource);
+    assert(dst != CRenderGraph::kInvalidId);
+    AddIndirectArgument(static_cast<const CRenderResource&>(*GetGraph().Nodes[dst]));
+}
+
+void CGraphRenderPass::AddIndirectArgument(const CRenderResource& resource)
+{
+    assert(resource.IsBuffer());
+    auto& usage = GetGraph().AddEdge(GetId(), resource.GetId());
+    usage.Type = EResourceUsageType::IndirectArgument;
+    usage.bRead = true;
+    usage.bWrite = false;
+    usage.ColorAttachmentIndex = 0;
+    usage.RequiredState = EResourceState::IndirectArg;
+}
+
+void CGraphRenderPass::AddInputAttachment(const std::string& resource, uint32_t index)
+{
+    uint32_t dst = GetGraph().FindNode(resource);
+    assert(dst != CRenderGraph::kInvalidId);
+    AddInputAttachment(static_cast<const CRenderResource&>(*GetGraph().Nodes[dst]), index);
+}
+
+void CGraphRenderPass::AddInputAttachment(const CRenderResource& resource, uint32_t index)
+{
+    assert(!resource.IsBuffer());
+    auto& usage = GetGraph().AddEdge(GetId(), resource.GetId());
+    usage.Type = EResourceUsageType::InputAttachment;
+    usage.bRead = true;
+    usage.bWrite = false;
+    usage.ColorAttachmentIndex = index;
+    usage.RequiredState = EResourceState::ShaderResource;
+}
+
+void CGraphRenderPass::AddUnorderedAccess(const std::string& resource, bool read, bool write)
+{
+    uint32_t dst = GetGraph().FindNode(resource);
+    assert(dst != CRenderGraph::kInvalidId);
+    AddUnorderedAccess(static_cast<const CRenderResource&>(*GetGraph().Nodes[dst]), read, write);
+}
+
+void CGraphRenderPass::AddUnorderedAccess(const CRenderResource& resource, bool read, bool write)
+{
+    auto& usage = GetGraph().AddEdge(GetId(), resource.GetId());
+    usage.Type = EResourceUsageType::UnorderedAccess;
+    usage.bRead = read;
+    usage.bWrite = write;
+    usage.ColorAttachmentIndex = 0;
+    usage.RequiredState = EResourceState::UnorderedAccess;
+}
+
+size_t CRenderResource::GetMemorySize() const
+{
+    if (bIsBuffer)
+        return BufferSize;
+    size_t texelSize = GetFormatTexelSize(Format);
+    size_t size = 0;
+    for (uint32_t mip = 0; mip < MipLevels; mip++)
+    {
+        size_t width = std::max(Width >> mip, 1u);
+        size_t height = std::max(Height >> mip, 1u);
+        size_t depth = std::max(Depth >> mip, 1u);
+        size += width * height * depth * texelSize;
+    }
+    if (Width == 0 || Height == 0)
+        return 0;
+    return size * ArrayLayers;
 }
 
 CRenderGraph::CRenderGraph()
 {
     GoalNode = SIZE_MAX;
     Nodes.reserve(128);
-    AdjLists.reserve(128);
+    Edges.reserve(256);
+    // The calling thread records too
+    unsigned hwThreads = std::thread::hardware_concurrency();
+    WorkerCount = hwThreads > 1 ? hwThreads - 1 : 0;
 }
 
+CRenderGraph::~CRenderGraph() = default;
+
 CRenderResource& CRenderGraph::AddTransientResource(const std::string& name, EFormat format)
 {
-    assert(NameToNodeId.find(name) == NameToNodeId.end());
-    auto node = std::make_shared<CRenderResource>(*this, name, format);
-    size_t nextId;
-    if (!FreeNodeIds.empty())
-    {
-        nextId = FreeNodeIds.front();
-        FreeNodeIds.pop_front();
-        Nodes[nextId] = node;
-    }
+    uint32_t nameId = InternName(name);
+    assert(NameToNodeId[nameId] == kInvalidId);
+    auto nodeId = static_cast<uint32_t>(Nodes.size());
+    return AddResourceNode(CRenderResource(*this, nodeId, nameId, format));
+}
+
+CRenderResource& CRenderGraph::AddTransientBuffer(const std::string& name, size_t size)
+{
+    uint32_t nameId = InternName(name);
+    assert(NameToNodeId[nameId] == kInvalidId);
+    auto nodeId = static_cast<uint32_t>(Nodes.size());
+    return AddResourceNode(CRenderResource(*this, nodeId, nameId, size));
+}
+
+CRenderResource& CRenderGraph::AddResourceNode(CRenderResource&& resource)
+{
+    if (ResourceCount < ResourcePool.size())
+        ResourcePool[ResourceCount] = std::move(resource);
     else
-    {
-        nextId = Nodes.size();
-        Nodes.push_back(node);
-        AdjLists.resize(Nodes.size());
-    }
-    NameToNodeId[name] = nextId;
-    return *node;
+        ResourcePool.push_back(std::move(resource));
+    auto& node = ResourcePool[ResourceCount++];
+    Nodes.push_back(&node);
+    NameToNodeId[node.GetNameId()] = node.GetId();
+    bAdjacencyDirty = true;
+    return node;
 }
 
 CGraphRenderPass& CRenderGraph::AddRenderPass(const std::string& name)
 {
-    assert(NameToNodeId.find(name) == NameToNodeId.end());
-    auto node = std::make_shared<CGraphRenderPass>(*this, name);
-    size_t nextId;
-    if (!FreeNodeIds.empty())
-    {
-        nextId = FreeNodeIds.front();
-        FreeNodeIds.pop_front();
-        Nodes[nextId] = node;
-    }
+    uint32_t nameId = InternName(name);
+    assert(NameToNodeId[nameId] == kInvalidId);
+    auto nodeId = static_cast<uint32_t>(Nodes.size());
+    if (PassCount < PassPool.size())
+        PassPool[PassCount] = CGraphRenderPass(*this, nodeId, nameId);
     else
-    {
-        nextId = Nodes.size();
-        Nodes.push_back(node);
-        AdjLists.resize(Nodes.size());
-    }
-    NameToNodeId[name] = nextId;
-    return *node;
+        PassPool.emplace_back(*this, nodeId, nameId);
+    auto& node = PassPool[PassCount++];
+    Nodes.push_back(&node);
+    NameToNodeId[nameId] = nodeId;
+    bAdjacencyDirty = true;
+    return node;
 }
 
 void CRenderGraph::RemoveRenderPass(const std::string& name)
 {
-    assert(NameToNodeId.find(name) != NameToNodeId.end());
-    auto id = NameToNodeId[name];
+    uint32_t id = FindNode(name);
+    assert(id != kInvalidId);
     assert(Nodes[id]->GetType() == ERenderNodeType::RenderPass);
-    Nodes[id].reset();
-    AdjLists[id].clear();
-    NameToNodeId.erase(name);
-    FreeNodeIds.push_back(id);
+    // The edges stay in place, BuildAdjacency skips anything that touches a removed node
+    NameToNodeId[Nodes[id]->GetNameId()] = kInvalidId;
+    Nodes[id] = nullptr;
+    bAdjacencyDirty = true;
 }
 
 void CRenderGraph::SetGoal(const std::string& name)
@@ -108,161 +217,1379 @@ void CRenderGraph::SetGoal(const std::string& name)
         GoalNode = SIZE_MAX;
         return;
     }
-    assert(NameToNodeId.find(name) != NameToNodeId.end());
-    GoalNode = NameToNodeId[name];
+    uint32_t id = FindNode(name);
+    assert(id != kInvalidId);
+    GoalNode = id;
 }
 
-void CRenderGraph::ValidateDFSRenderPass(size_t nodeId) const
+void CRenderGraph::Clear()
 {
-    assert(nodeId >= 0);
-    assert(nodeId < Nodes.size());
-    assert(Nodes[nodeId]);
-    auto node = Nodes[nodeId];
-    assert(node->GetType() == ERenderNodeType::RenderPass);
-    if (node->_Visited == 1)
-    {
-        // Back-edge
-        ValidateSuccess = false;
+    for (const auto* node : Nodes)
+        if (node)
+            NameToNodeId[node->GetNameId()] = kInvalidId;
+    Nodes.clear();
+    Edges.clear();
+    PassCount = 0;
+    ResourceCount = 0;
+    GoalNode = SIZE_MAX;
+    bAdjacencyDirty = true;
+    ValidateSuccess = false;
+    bPlanBaked = false;
+    PassOrder.clear();
+    Transitions.clear();
+    PassQueues.clear();
+    SyncPoints.clear();
+    QueueHandoffs.clear();
+    TransientPlacements.clear();
+    TransientStats = CTransientStats();
+    RenderPassGroups.clear();
+    RenderPassAttachments.clear();
+    SubpassAttachmentRefs.clear();
+    MergeResults.clear();
+}
+
+uint32_t CRenderGraph::InternName(const std::string& name)
+{
+    auto iter = NameIds.find(name);
+    if (iter != NameIds.end())
+        return iter->second;
+    auto nameId = static_cast<uint32_t>(Names.size());
+    Names.push_back(name);
+    NameIds.emplace(name, nameId);
+    NameToNodeId.push_back(kInvalidId);
+    return nameId;
+}
+
+uint32_t CRenderGraph::FindNode(const std::string& name) const
+{
+    auto iter = NameIds.find(name);
+    if (iter == NameIds.end())
+        return kInvalidId;
+    return NameToNodeId[iter->second];
+}
+
+CResourceUsage& CRenderGraph::AddEdge(uint32_t pass, uint32_t resource)
+{
+    assert(Nodes[pass] && Nodes[pass]->GetType() == ERenderNodeType::RenderPass);
+    assert(Nodes[resource] && Nodes[resource]->GetType() == ERenderNodeType::RenderResource);
+    Edges.push_back(CEdge { pass, resource, CResourceUsage() });
+    bAdjacencyDirty = true;
+    return Edges.back().Usage;
+}
+
+void CRenderGraph::BuildAdjacency() const
+{
+    if (!bAdjacencyDirty)
         return;
+
+    // Counting sort of the edges by both end points
+    AdjOffsets.assign(Nodes.size() + 1, 0);
+    for (const auto& edge : Edges)
+    {
+        if (!Nodes[edge.PassId] || !Nodes[edge.ResourceId])
+            continue;
+        AdjOffsets[edge.PassId + 1]++;
+        AdjOffsets[edge.ResourceId + 1]++;
     }
-    if (node->_Visited == 2)
-        return; // Cross edge
-    DFSDepth++;
-    node->_Visited = 1;
-    std::cout << std::string(DFSDepth, ' ') << "[" << node->GetName() << "]" << std::endl;
-    PassOrder.push_back(nodeId);
-    for (const auto& pair : AdjLists[nodeId])
+    for (size_t i = 1; i < AdjOffsets.size(); i++)
+        AdjOffsets[i] += AdjOffsets[i - 1];
+
+    AdjEdges.resize(AdjOffsets.back());
+    AdjCursors.assign(AdjOffsets.begin(), AdjOffsets.end() - 1);
+    for (size_t i = 0; i < Edges.size(); i++)
     {
-        // If read-only, must be an input or srv
-        if (pair.second->bRead && !pair.second->bWrite)
+        const auto& edge = Edges[i];
+        if (!Nodes[edge.PassId] || !Nodes[edge.ResourceId])
+            continue;
+        AdjEdges[AdjCursors[edge.PassId]++] = static_cast<uint32_t>(i);
+        AdjEdges[AdjCursors[edge.ResourceId]++] = static_cast<uint32_t>(i);
+    }
+
+    BuildVersions();
+    bAdjacencyDirty = false;
+}
+
+void CRenderGraph::BuildVersions() const
+{
+    // Every pass writing a resource produces a new version of it, named after the edge that does
+    //   the write. Passes are versioned in the order they were added, which node ids follow
+    EdgeReadVersions.assign(Edges.size(), kInvalidId);
+    EdgeWriteVersions.assign(Edges.size(), kInvalidId);
+    auto byPass = [this](uint32_t lhs, uint32_t rhs) {
+        if (Edges[lhs].PassId != Edges[rhs].PassId)
+            return Edges[lhs].PassId < Edges[rhs].PassId;
+        return lhs < rhs;
+    };
+    for (size_t i = 0; i < Nodes.size(); i++)
+    {
+        auto* node = Nodes[i];
+        if (!node || node->GetType() != ERenderNodeType::RenderResource)
+            continue;
+        auto first = AdjEdges.begin() + AdjOffsets[i];
+        auto last = AdjEdges.begin() + AdjOffsets[i + 1];
+        if (!std::is_sorted(first, last, byPass))
+            std::sort(first, last, byPass);
+
+        uint32_t firstVersion = kInvalidId;
+        for (auto iter = first; iter != last && firstVersion == kInvalidId; ++iter)
+            if (Edges[*iter].Usage.bWrite)
+                firstVersion = *iter;
+
+        uint32_t latestVersion = kInvalidId;
+        for (auto group = first; group != last;)
         {
-            ValidateDFSResource(pair.first);
+            uint32_t passId = Edges[*group].PassId;
+            auto groupEnd = group;
+            while (groupEnd != last && Edges[*groupEnd].PassId == passId)
+                ++groupEnd;
+
+            // Reads see the version from before the pass, even when the pass also writes
+            uint32_t written = kInvalidId;
+            for (auto iter = group; iter != groupEnd; ++iter)
+            {
+                const auto& usage = Edges[*iter].Usage;
+                if (usage.bWrite && written == kInvalidId)
+                    written = *iter;
+                if (!usage.bRead)
+                    continue;
+                if (latestVersion != kInvalidId)
+                    EdgeReadVersions[*iter] = latestVersion;
+                else if (firstVersion != kInvalidId && Edges[firstVersion].PassId != passId)
+                    // A reader added before any writer gets the first version, so single writer
+                    //   graphs don't depend on the order the passes were added in
+                    EdgeReadVersions[*iter] = firstVersion;
+            }
+            if (written != kInvalidId)
+            {
+                for (auto iter = group; iter != groupEnd; ++iter)
+                    if (Edges[*iter].Usage.bWrite)
+                        EdgeWriteVersions[*iter] = written;
+                latestVersion = written;
+            }
+            group = groupEnd;
         }
     }
-    node->_Visited = 2;
-    DFSDepth--;
 }
 
-void CRenderGraph::ValidateDFSResource(size_t nodeId) const
+uint32_t CRenderGraph::CullPasses() const
 {
-    assert(nodeId < Nodes.size());
-    assert(Nodes[nodeId]);
-    auto node = Nodes[nodeId];
-    assert(node->GetType() == ERenderNodeType::RenderResource);
+    // A version is referenced by the passes reading it, and a pass by the versions it produces.
+    //   Whatever drops to zero contributes nothing to the goal and releases what it reads
+    PassRefCounts.assign(Nodes.size(), 0);
+    VersionRefCounts.assign(Edges.size(), 0);
+    for (size_t i = 0; i < Edges.size(); i++)
+    {
+        const auto& edge = Edges[i];
+        if (!Nodes[edge.PassId] || !Nodes[edge.ResourceId])
+            continue;
+        if (EdgeWriteVersions[i] == i)
+            PassRefCounts[edge.PassId]++;
+        if (EdgeReadVersions[i] != kInvalidId)
+            VersionRefCounts[EdgeReadVersions[i]]++;
+    }
+
+    // The goal is the last version of the goal resource
+    uint32_t goalVersion = kInvalidId;
+    for (uint32_t i = AdjOffsets[GoalNode]; i < AdjOffsets[GoalNode + 1]; i++)
+        if (EdgeWriteVersions[AdjEdges[i]] != kInvalidId)
+            goalVersion = EdgeWriteVersions[AdjEdges[i]];
+    if (goalVersion != kInvalidId)
+        VersionRefCounts[goalVersion]++;
+
+    CullStack.clear();
+    auto cullPass = [this](uint32_t passId) {
+        for (uint32_t i = AdjOffsets[passId]; i < AdjOffsets[passId + 1]; i++)
+        {
+            uint32_t version = EdgeReadVersions[AdjEdges[i]];
+            if (version != kInvalidId && --VersionRefCounts[version] == 0)
+                CullStack.push_back(version);
+        }
+    };
+    for (size_t i = 0; i < Edges.size(); i++)
+        if (EdgeWriteVersions[i] == i && VersionRefCounts[i] == 0)
+            CullStack.push_back(static_cast<uint32_t>(i));
+    for (size_t i = 0; i < Nodes.size(); i++)
+        if (Nodes[i] && Nodes[i]->GetType() == ERenderNodeType::RenderPass
+            && PassRefCounts[i] == 0)
+            cullPass(static_cast<uint32_t>(i));
+    while (!CullStack.empty())
+    {
+        uint32_t passId = Edges[CullStack.back()].PassId;
+        CullStack.pop_back();
+        if (--PassRefCounts[passId] == 0)
+            cullPass(passId);
+    }
+
+    return goalVersion != kInvalidId ? Edges[goalVersion].PassId : kInvalidId;
+}
+
+void CRenderGraph::BuildPassDependencies() const
+{
+    // Sweep every resource in version order. A pass follows the writer of what it reads, and a
+    //   writer follows the previous writer and every reader of the version it overwrites
+    DependencyScratch.clear();
+    auto addDependency = [this](uint32_t passId, uint32_t edgeId, uint32_t prerequisite) {
+        DependencyScratch.emplace_back(uint64_t(passId) << 32 | edgeId, prerequisite);
+    };
+    for (size_t i = 0; i < Nodes.size(); i++)
+    {
+        auto* node = Nodes[i];
+        if (!node || node->GetType() != ERenderNodeType::RenderResource)
+            continue;
+
+        uint32_t lastWriter = kInvalidId;
+        uint32_t lastVersion = kInvalidId;
+        ReaderScratch.clear();
+        for (uint32_t group = AdjOffsets[i]; group < AdjOffsets[i + 1];)
+        {
+            uint32_t passId = Edges[AdjEdges[group]].PassId;
+            uint32_t groupEnd = group;
+            while (groupEnd < AdjOffsets[i + 1] && Edges[AdjEdges[groupEnd]].PassId == passId)
+                groupEnd++;
+            if (PassRefCounts[passId] == 0)
+            {
+                group = groupEnd;
+                continue;
+            }
+
+            uint32_t written = kInvalidId;
+            uint32_t read = kInvalidId;
+            for (uint32_t j = group; j < groupEnd; j++)
+            {
+                uint32_t edgeId = AdjEdges[j];
+                uint32_t version = EdgeReadVersions[edgeId];
+                if (version != kInvalidId)
+                {
+                    addDependency(passId, edgeId, Edges[version].PassId);
+                    read = version;
+                }
+                if (EdgeWriteVersions[edgeId] != kInvalidId)
+                    written = EdgeWriteVersions[edgeId];
+            }
+            if (written != kInvalidId)
+            {
+                if (lastWriter != kInvalidId)
+                    addDependency(passId, written, lastWriter);
+                // Readers of the overwritten version, including those added before its writer.
+                //   Readers of a version not written yet stay around for its overwriter
+                auto iter = std::partition(
+                    ReaderScratch.begin(), ReaderScratch.end(),
+                    [lastVersion](const auto& reader) { return reader.first != lastVersion; });
+                for (auto reader = iter; reader != ReaderScratch.end(); ++reader)
+                    addDependency(passId, written, reader->second);
+                ReaderScratch.erase(iter, ReaderScratch.end());
+                lastWriter = passId;
+                lastVersion = written;
+            }
+            else if (read != kInvalidId)
+            {
+                ReaderScratch.emplace_back(read, passId);
+            }
+            group = groupEnd;
+        }
+    }
+
+    // Compressed sparse rows again, keyed by the dependent pass. The dependencies of a pass keep
+    //   the order its edges were added in, which is the order the traversal schedules them
+    std::sort(DependencyScratch.begin(), DependencyScratch.end());
+    PassDepOffsets.assign(Nodes.size() + 1, 0);
+    for (const auto& dep : DependencyScratch)
+        PassDepOffsets[(dep.first >> 32) + 1]++;
+    for (size_t i = 1; i < PassDepOffsets.size(); i++)
+        PassDepOffsets[i] += PassDepOffsets[i - 1];
+    PassDeps.resize(PassDepOffsets.back());
+    AdjCursors.assign(PassDepOffsets.begin(), PassDepOffsets.end() - 1);
+    for (const auto& dep : DependencyScratch)
+        PassDeps[AdjCursors[dep.first >> 32]++] = dep.second;
+}
+
+bool CRenderGraph::VisitDFS(uint32_t nodeId) const
+{
+    auto* node = Nodes[nodeId];
+    assert(node);
     if (node->_Visited == 1)
     {
         // Back-edge
         ValidateSuccess = false;
-        return;
+        return false;
     }
     if (node->_Visited == 2)
-        return; // Cross edge
-    DFSDepth++;
+        return false; // Cross edge
+
     node->_Visited = 1;
-    std::cout << std::string(DFSDepth, ' ') << node->GetName() << std::endl;
-    unsigned writerCount = 0;
-    for (const auto& pair : AdjLists[nodeId])
+    if (bVerbose)
+        std::cout << std::string(DFSStack.size() + 1, ' ') << "[" << node->GetName() << "]"
+                  << std::endl;
+    DFSStack.push_back(CDFSFrame { nodeId, PassDepOffsets[nodeId] });
+    return true;
+}
+
+void CRenderGraph::ValidateDFS(uint32_t rootId) const
+{
+    // Iterative so that long pass chains can't overflow the stack
+    DFSStack.clear();
+    if (rootId == kInvalidId)
+        return;
+    VisitDFS(rootId);
+    while (!DFSStack.empty())
     {
-        // Anything that writes me is noteworthy
-        if (pair.second->bWrite)
+        auto& frame = DFSStack.back();
+        uint32_t nodeId = frame.NodeId;
+        if (frame.Cursor == PassDepOffsets[nodeId + 1])
         {
-            writerCount++;
-            if (writerCount > 1)
-            {
-                ValidateSuccess = false;
-                std::cout << "Currently does not support a resource having multiple writers."
-                          << std::endl;
-            }
-            ValidateDFSRenderPass(pair.first);
+            // Post-order, so that every producer is scheduled before its consumers
+            PassOrder.push_back(nodeId);
+            Nodes[nodeId]->_Visited = 2;
+            DFSStack.pop_back();
+            continue;
+        }
+        VisitDFS(PassDeps[frame.Cursor++]);
+    }
+}
+
+size_t CRenderGraph::BuildTopologyKey() const
+{
+    // Node ids are part of the plan, so the key covers the exact node and edge order. Hits are
+    //   confirmed against the whole key, the hash only finds the candidate
+    auto& key = TopologyKeyScratch;
+    key.clear();
+    key.push_back(Nodes.size());
+    for (const auto* node : Nodes)
+    {
+        if (!node)
+        {
+            key.push_back(kInvalidId);
+            continue;
+        }
+        key.push_back((std::underlying_type_t<ERenderNodeType>)(node->GetType()));
+        key.push_back(node->GetNameId());
+        if (node->GetType() == ERenderNodeType::RenderPass)
+        {
+            const auto& pass = static_cast<const CGraphRenderPass&>(*node);
+            key.push_back((std::underlying_type_t<EQueueType>)(pass.GetQueueAffinity()));
+        }
+        else
+        {
+            // The description decides the transient memory layout
+            const auto& resource = static_cast<const CRenderResource&>(*node);
+            key.push_back(resource.IsBuffer());
+            key.push_back(resource.GetBufferSize());
+            key.push_back((std::underlying_type_t<EFormat>)(resource.GetFormat()));
+            key.push_back(resource.GetWidth());
+            key.push_back(resource.GetHeight());
+            key.push_back(resource.GetDepth());
+            key.push_back(resource.GetMipLevels());
+            key.push_back(resource.GetArrayLayers());
         }
     }
-    node->_Visited = 2;
-    DFSDepth--;
+    for (const auto& edge : Edges)
+    {
+        if (!Nodes[edge.PassId] || !Nodes[edge.ResourceId])
+            continue;
+        key.push_back(edge.PassId);
+        key.push_back(edge.ResourceId);
+        key.push_back(edge.Usage.bRead);
+        key.push_back(edge.Usage.bWrite);
+        key.push_back((std::underlying_type_t<EResourceUsageType>)(edge.Usage.Type));
+        key.push_back(edge.Usage.ColorAttachmentIndex);
+        key.push_back((std::underlying_type_t<EResourceState>)(edge.Usage.RequiredState));
+    }
+    key.push_back(GoalNode);
+    key.push_back(bAsyncCompute);
+    size_t h = 0;
+    for (uint64_t value : key)
+        tc::hash_combine(h, value);
+    return h;
 }
 
 bool CRenderGraph::Validate() const
 {
     if (GoalNode == SIZE_MAX)
+    {
+        ValidateSuccess = false;
+        bPlanBaked = false;
+        PassOrder.clear();
         return false;
+    }
+
+    // Steady state: the graph was rebuilt exactly like last frame
+    size_t hash = BuildTopologyKey();
+    if (bPlanBaked && hash == TopologyHash && TopologyKeyScratch == TopologyKey)
+    {
+        PlanCacheHits++;
+        return ValidateSuccess;
+    }
+    TopologyHash = hash;
+    TopologyKey.swap(TopologyKeyScratch);
+    auto iter = PlanCache.find(hash);
+    if (iter != PlanCache.end() && iter->second.TopologyKey == TopologyKey)
+    {
+        const auto& plan = iter->second;
+        ValidateSuccess = plan.bValid;
+        PassOrder = plan.PassOrder;
+        Transitions = plan.Transitions;
+        PassQueues = plan.PassQueues;
+        SyncPoints = plan.SyncPoints;
+        QueueHandoffs = plan.QueueHandoffs;
+        TransientPlacements = plan.TransientPlacements;
+        TransientStats = plan.TransientStats;
+        RenderPassGroups = plan.RenderPassGroups;
+        RenderPassAttachments = plan.RenderPassAttachments;
+        SubpassAttachmentRefs = plan.SubpassAttachmentRefs;
+        MergeResults = plan.MergeResults;
+        bPlanBaked = true;
+        PlanCacheHits++;
+        return ValidateSuccess;
+    }
+    PlanCacheMisses++;
+    bPlanBaked = false;
     ValidateSuccess = true;
 
-    for (auto node : Nodes)
+    BuildAdjacency();
+    for (auto* node : Nodes)
         if (node)
             node->_Visited = 0;
 
-    DFSDepth = 0;
     PassOrder.clear();
-    ValidateDFSResource(GoalNode);
+    uint32_t rootId = CullPasses();
+    BuildPassDependencies();
+    ValidateDFS(rootId);
 
     return ValidateSuccess;
 }
 
 void CRenderGraph::Bake() const
 {
+    // Nothing sensible to bake from a broken graph, and not worth remembering either
     if (!ValidateSuccess)
-        ;
+        return;
 
-    std::reverse(PassOrder.begin(), PassOrder.end());
+    if (!bPlanBaked)
+    {
+        BakePlan();
+        bPlanBaked = true;
+        // A colliding plan with a different key is simply replaced
+        if (PlanCache.size() >= kMaxCachedPlans)
+            PlanCache.clear();
+        auto& plan = PlanCache[TopologyHash];
+        plan.TopologyKey = TopologyKey;
+        plan.bValid = ValidateSuccess;
+        plan.PassOrder = PassOrder;
+        plan.Transitions = Transitions;
+        plan.PassQueues = PassQueues;
+        plan.SyncPoints = SyncPoints;
+        plan.QueueHandoffs = QueueHandoffs;
+        plan.TransientPlacements = TransientPlacements;
+        plan.TransientStats = TransientStats;
+        plan.RenderPassGroups = RenderPassGroups;
+        plan.RenderPassAttachments = RenderPassAttachments;
+        plan.SubpassAttachmentRefs = SubpassAttachmentRefs;
+        plan.MergeResults = MergeResults;
+    }
+
+    if (!bVerbose)
+        return;
+    for (size_t i = 0; i < PassOrder.size(); i++)
+    {
+        size_t nodeId = PassOrder[i];
+        std::cout << Nodes[nodeId]->GetName();
+        if (PassQueues[i] == EQueueType::Compute)
+            std::cout << " (compute)";
+        std::cout << std::endl;
+        for (const auto& tr : Transitions[i])
+        {
+            std::cout << Nodes[tr.NodeId]->GetName() << " " << (int)tr.StateDuring << " -> "
+                      << (int)tr.StateAfter << (tr.bMemoryBarrier ? " (memory)" : "")
+                      << (tr.bSplit ? " (split)" : "") << std::endl;
+        }
+    }
+    for (const auto& alloc : TransientPlacements)
+    {
+        std::cout << Nodes[alloc.NodeId]->GetName() << " @" << alloc.Offset << " +" << alloc.Size
+                  << " [" << alloc.FirstUse << ", " << alloc.LastUse << "]" << std::endl;
+    }
+    for (const auto& sync : SyncPoints)
+    {
+        std::cout << Nodes[PassOrder[sync.WaitStep]]->GetName() << " waits for "
+                  << Nodes[PassOrder[sync.SignalStep]]->GetName() << std::endl;
+    }
+    for (const auto& handoff : QueueHandoffs)
+    {
+        std::cout << Nodes[handoff.NodeId]->GetName() << " handed from "
+                  << (handoff.GiveStep == SIZE_MAX ? "before the graph"
+                                                   : Nodes[PassOrder[handoff.GiveStep]]->GetName())
+                  << " to "
+                  << (handoff.TakeStep == SIZE_MAX ? "after the graph"
+                                                   : Nodes[PassOrder[handoff.TakeStep]]->GetName())
+                  << std::endl;
+    }
+    for (size_t i = 1; i < PassOrder.size(); i++)
+    {
+        std::cout << Nodes[PassOrder[i]]->GetName() << " merge: "
+                  << GetMergeResultName(MergeResults[i]) << std::endl;
+    }
+    for (const auto& attachment : RenderPassAttachments)
+    {
+        std::cout << Nodes[attachment.NodeId]->GetName() << " load "
+                  << (int)attachment.LoadOp << " store " << (int)attachment.StoreOp << std::endl;
+    }
+    std::cout << "Transient heap: " << TransientStats.HeapSize << ", unaliased "
+              << TransientStats.UnaliasedSize << std::endl;
+}
+
+size_t CRenderGraph::GetCulledPassCount() const
+{
+    size_t passCount = 0;
+    for (const auto* node : Nodes)
+        if (node && node->GetType() == ERenderNodeType::RenderPass)
+            passCount++;
+    return passCount - PassOrder.size();
+}
+
+void CRenderGraph::BakePlan() const
+{
+    // Passes that don't contribute to the goal are not scheduled
+    for (auto* node : Nodes)
+        if (node)
+            node->_PassOrder = SIZE_MAX;
     size_t index = 0;
     for (size_t nodeId : PassOrder)
         Nodes[nodeId]->_PassOrder = index++;
 
-    Transitions.clear();
+    PlanTransitions();
+    PlanQueues();
+    PlanDependencies();
+    PlanQueueHandoffs();
+    PlanTransientLayout();
+    PlanSyncPoints();
+    PlanRenderPasses();
+    PlanAttachments();
+    PlanSplitBarriers();
+}
+
+void CRenderGraph::PlanTransitions() const
+{
+    // Keep the inner vectors around, their capacity is reused by the next bake
     Transitions.resize(PassOrder.size());
+    for (auto& transitions : Transitions)
+        transitions.clear();
 
     for (size_t i = 0; i < Nodes.size(); i++)
     {
-        auto node = Nodes[i];
-        if (node->GetType() == ERenderNodeType::RenderResource)
+        auto* node = Nodes[i];
+        if (!node || node->GetType() != ERenderNodeType::RenderResource)
+            continue;
+
+        // Plan the barriers for this resource, now that we have the pass ordering
+        auto& transitions = TransitionScratch;
+        transitions.clear();
+        for (uint32_t j = AdjOffsets[i]; j < AdjOffsets[i + 1]; j++)
+        {
+            const auto& edge = Edges[AdjEdges[j]];
+            size_t time = Nodes[edge.PassId]->_PassOrder;
+            if (time == SIZE_MAX)
+                continue;
+            CTransition t;
+            t.NodeId = i;
+            t.StateDuring = edge.Usage.RequiredState;
+            t.StateAfter = t.StateDuring;
+            t.bMemoryBarrier = edge.Usage.bWrite; // Whether the pass writes, for now
+            t.NextStep = SIZE_MAX;
+            t.bSplit = false;
+            transitions.emplace_back(time, t);
+        }
+        if (transitions.empty())
+            continue;
+        std::stable_sort(transitions.begin(), transitions.end(),
+                         [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; });
+        // Only the first usage of a pass decides the state, but any of them may write
+        size_t count = 0;
+        for (size_t j = 0; j < transitions.size(); j++)
+        {
+            if (count > 0 && transitions[count - 1].first == transitions[j].first)
+                transitions[count - 1].second.bMemoryBarrier |= transitions[j].second.bMemoryBarrier;
+            else
+                transitions[count++] = transitions[j];
+        }
+        transitions.resize(count);
+        for (size_t j = 0; j < transitions.size(); j++)
         {
-            // Plan the barriers for this resource, now that we have the pass ordering
-            std::map<size_t, CTransition> transitions;
-            for (const auto& pair : AdjLists[i])
+            auto& t = transitions[j].second;
+            if (j + 1 == transitions.size())
             {
-                size_t time = Nodes[pair.first]->_PassOrder;
-                CTransition t;
-                t.NodeId = i;
-                t.StateDuring = pair.second->RequiredState;
-                t.StateAfter = t.StateDuring;
-                transitions.emplace(time, t);
+                t.bMemoryBarrier = false;
+                continue;
             }
-            auto iter = transitions.begin();
-            while (true)
+            t.StateAfter = transitions[j + 1].second.StateDuring;
+            t.NextStep = transitions[j + 1].first;
+            // Storage writes followed by more storage access are the usual case
+            t.bMemoryBarrier = t.bMemoryBarrier && t.StateDuring == t.StateAfter;
+        }
+
+        // Actually store all those transitions
+        for (const auto& tp : transitions)
+            if (!tp.second.IsUnneeded())
+                Transitions[tp.first].push_back(tp.second);
+    }
+}
+
+void CRenderGraph::PlanQueues() const
+{
+    PassQueues.assign(PassOrder.size(), EQueueType::Render);
+    if (!bAsyncCompute)
+        return;
+
+    // The pass producing the goal stays on the render queue. Every other pass feeds into it, so
+    //   the render queue ends up waiting on all the compute work of the frame
+    for (size_t i = 0; i + 1 < PassOrder.size(); i++)
+    {
+        size_t nodeId = PassOrder[i];
+        const auto& pass = static_cast<const CGraphRenderPass&>(*Nodes[nodeId]);
+        if (pass.GetQueueAffinity() != EQueueType::Compute)
+            continue;
+
+        // Attachments can only be used on the render queue
+        bool eligible = true;
+        for (uint32_t j = AdjOffsets[nodeId]; j < AdjOffsets[nodeId + 1]; j++)
+        {
+            auto type = Edges[AdjEdges[j]].Usage.Type;
+            if (type != EResourceUsageType::ShaderResource
+                && type != EResourceUsageType::UnorderedAccess
+                && type != EResourceUsageType::IndirectArgument)
+                eligible = false;
+        }
+        if (eligible)
+            PassQueues[i] = EQueueType::Compute;
+    }
+}
+
+void CRenderGraph::PlanTransientLayout() const
+{
+    TransientPlacements.clear();
+    TransientStats = CTransientStats();
+    if (PassOrder.empty())
+        return;
+
+    // Lifetime analysis: a resource is alive from the first to the last pass that touches it
+    for (size_t i = 0; i < Nodes.size(); i++)
+    {
+        auto* node = Nodes[i];
+        if (!node || node->GetType() != ERenderNodeType::RenderResource)
+            continue;
+        size_t size = static_cast<const CRenderResource&>(*node).GetMemorySize();
+        if (size == 0)
+            continue;
+
+        CTransientPlacement alloc;
+        alloc.NodeId = i;
+        alloc.Offset = 0;
+        alloc.Size = (size + kTransientAlignment - 1) / kTransientAlignment * kTransientAlignment;
+        alloc.FirstUse = SIZE_MAX;
+        alloc.LastUse = 0;
+        for (uint32_t j = AdjOffsets[i]; j < AdjOffsets[i + 1]; j++)
+        {
+            size_t time = Nodes[Edges[AdjEdges[j]].PassId]->_PassOrder;
+            if (time == SIZE_MAX)
+                continue;
+            alloc.FirstUse = std::min(alloc.FirstUse, time);
+            alloc.LastUse = std::max(alloc.LastUse, time);
+            // With async compute the pass may still be running until another queue joins it
+            if (JoinSteps[time] != SIZE_MAX)
+                alloc.LastUse = std::max(alloc.LastUse, JoinSteps[time]);
+        }
+        if (alloc.FirstUse == SIZE_MAX)
+            continue;
+        // The goal is consumed after the graph is done, nothing may overwrite it
+        if (i == GoalNode)
+            alloc.LastUse = PassOrder.size() - 1;
+        TransientPlacements.push_back(alloc);
+        TransientStats.UnaliasedSize += alloc.Size;
+    }
+
+    // Best-fit placement, largest resources first: each resource goes into the tightest gap left
+    //   between the already placed resources whose lifetimes overlap with it
+    std::vector<size_t> placementOrder(TransientPlacements.size());
+    std::iota(placementOrder.begin(), placementOrder.end(), 0);
+    std::sort(placementOrder.begin(), placementOrder.end(), [this](size_t lhs, size_t rhs) {
+        const auto& l = TransientPlacements[lhs];
+        const auto& r = TransientPlacements[rhs];
+        if (l.Size != r.Size)
+            return l.Size > r.Size;
+        return l.FirstUse < r.FirstUse;
+    });
+
+    std::vector<size_t> placed;
+    std::vector<std::pair<size_t, size_t>> occupied;
+    for (size_t index : placementOrder)
+    {
+        auto& alloc = TransientPlacements[index];
+        occupied.clear();
+        for (size_t other : placed)
+        {
+            const auto& rhs = TransientPlacements[other];
+            if (rhs.LastUse < alloc.FirstUse || alloc.LastUse < rhs.FirstUse)
+                continue;
+            occupied.emplace_back(rhs.Offset, rhs.Offset + rhs.Size);
+        }
+        std::sort(occupied.begin(), occupied.end());
+
+        size_t bestOffset = SIZE_MAX;
+        size_t bestGap = SIZE_MAX;
+        size_t cursor = 0;
+        for (const auto& range : occupied)
+        {
+            if (range.first > cursor)
+            {
+                size_t gap = range.first - cursor;
+                if (gap >= alloc.Size && gap < bestGap)
+                {
+                    bestGap = gap;
+                    bestOffset = cursor;
+                }
+            }
+            cursor = std::max(cursor, range.second);
+        }
+        if (bestOffset == SIZE_MAX)
+            bestOffset = cursor;
+
+        alloc.Offset = bestOffset;
+        placed.push_back(index);
+        TransientStats.HeapSize = std::max(TransientStats.HeapSize, alloc.Offset + alloc.Size);
+    }
+}
+
+void CRenderGraph::SetWorkerCount(size_t count)
+{
+    WorkerCount = count;
+    if (Workers && Workers->GetThreadCount() != count)
+        Workers.reset();
+}
+
+void CRenderGraph::Execute(CCommandQueue& queue) const { Execute(queue, queue); }
+
+void CRenderGraph::Execute(CCommandQueue& renderQueue, CCommandQueue& computeQueue) const
+{
+    if (!ValidateSuccess || !bPlanBaked)
+        throw CRHIRuntimeError("Render graph has to be validated and baked before execution");
+
+    // Reserve the submission order up front. A render pass group with render funcs gets one list,
+    //   every other pass its own. The backend works out the barriers between the lists at
+    //   submission, so they don't depend on each other while recording and can all go wide at once
+    StepLists.resize(PassOrder.size());
+    ListFirstSteps.clear();
+    ExecuteLists.clear();
+    ExecuteRenderPasses.clear();
+    // Render queue lists that hand resources to the compute queue before the graph's own lists and
+    //   take them back after
+    bool isAsync = &renderQueue != &computeQueue;
+    auto isBefore = [](const CQueueHandoff& handoff) { return handoff.GiveStep == SIZE_MAX; };
+    auto isAfter = [](const CQueueHandoff& handoff) { return handoff.TakeStep == SIZE_MAX; };
+    // Checked before anything is enqueued, a list left uncommitted would hold up its queue
+    std::vector<bool> isRenderPassGroup(RenderPassGroups.size(), false);
+    for (size_t i = 0; i < RenderPassGroups.size(); i++)
+    {
+        const auto& group = RenderPassGroups[i];
+        for (size_t step = group.FirstStep; step < group.FirstStep + group.StepCount; step++)
+            if (static_cast<const CGraphRenderPass&>(*Nodes[PassOrder[step]]).GetRenderFunc())
+                isRenderPassGroup[i] = true;
+        for (size_t step = group.FirstStep; step < group.FirstStep + group.StepCount; step++)
+        {
+            const auto& pass = static_cast<const CGraphRenderPass&>(*Nodes[PassOrder[step]]);
+            if (pass.GetExecuteFunc() && !pass.GetRenderFunc()
+                && (isRenderPassGroup[i] || group.StepCount > 1))
+                throw CRHIRuntimeError("Render graph pass " + pass.GetName()
+                                       + " is merged into a render pass, it needs a render func");
+        }
+        if (isRenderPassGroup[i] && !Device)
+            throw CRHIRuntimeError("Render graph needs a device to record render passes");
+    }
+
+    CCommandList::Ref handoffBefore;
+    CCommandList::Ref handoffAfter;
+    if (isAsync && std::any_of(QueueHandoffs.begin(), QueueHandoffs.end(), isBefore))
+    {
+        handoffBefore = renderQueue.CreateCommandList();
+        handoffBefore->Enqueue();
+    }
+    for (size_t i = 0; i < RenderPassGroups.size(); i++)
+    {
+        const auto& group = RenderPassGroups[i];
+        bool isRenderPass = isRenderPassGroup[i];
+        for (size_t step = group.FirstStep; step < group.FirstStep + group.StepCount; step++)
+        {
+            if (isRenderPass && step != group.FirstStep)
+            {
+                StepLists[step] = ExecuteLists.size() - 1;
+                continue;
+            }
+
+            auto& queue = PassQueues[step] == EQueueType::Compute ? computeQueue : renderQueue;
+            auto cmdList = queue.CreateCommandList();
+            cmdList->Enqueue();
+            IParallelRenderContext::Ref renderPassContext;
+            if (isRenderPass)
+            {
+                // Cleared attachments are cleared to zero
+                auto renderPass = Device->CreateRenderPass(MakeRenderPassDesc(i));
+                renderPassContext = cmdList->CreateParallelRenderContext(
+                    renderPass,
+                    std::vector<CClearValue>(group.AttachmentCount, CClearValue(0, 0, 0, 0)));
+            }
+            StepLists[step] = ExecuteLists.size();
+            ListFirstSteps.push_back(step);
+            ExecuteLists.push_back(std::move(cmdList));
+            ExecuteRenderPasses.push_back(std::move(renderPassContext));
+        }
+    }
+    if (isAsync && std::any_of(QueueHandoffs.begin(), QueueHandoffs.end(), isAfter))
+    {
+        handoffAfter = renderQueue.CreateCommandList();
+        handoffAfter->Enqueue();
+    }
+
+    // The producer starts the split barriers, the next user of the resource finishes them
+    BarrierStats = CBarrierStats();
+    for (size_t i = 0; i < Transitions.size(); i++)
+    {
+        for (const auto& t : Transitions[i])
+        {
+            const auto& resource = static_cast<const CRenderResource&>(*Nodes[t.NodeId]);
+            bool isBound = resource.IsBuffer() ? !!resource.GetBuffer() : !!resource.GetImageView();
+            bool isSameList = t.NextStep != SIZE_MAX && StepLists[i] == StepLists[t.NextStep];
+            if (t.IsUnneeded() || !isBound || isSameList)
+                continue;
+            if (t.bSplit)
+            {
+                ExecuteLists[StepLists[i]]->SplitBarrier(*ExecuteLists[StepLists[t.NextStep]],
+                                                         resource.GetImageView());
+                BarrierStats.SplitBarriers++;
+            }
+            else
+                BarrierStats.FullBarriers++;
+        }
+    }
+
+    // One task per pass, the subpasses of a render pass record in parallel
+    if (!Workers)
+        Workers = std::make_unique<CWorkerPool>(WorkerCount);
+    // The lists are enqueued already and would hold up their queues, so a pass that throws still
+    //   gets its list finished and committed with whatever it recorded. The exception is passed on
+    //   once everything is committed
+    std::exception_ptr passError;
+    try
+    {
+        Workers->Run(PassOrder.size(), [this](size_t step) {
+            const auto& pass = static_cast<const CGraphRenderPass&>(*Nodes[PassOrder[step]]);
+            size_t list = StepLists[step];
+            if (!ExecuteRenderPasses[list])
+            {
+                if (pass.GetExecuteFunc())
+                    pass.GetExecuteFunc()(*ExecuteLists[list]);
+                return;
+            }
+            auto ctx = ExecuteRenderPasses[list]->CreateRenderContext(
+                static_cast<uint32_t>(step - ListFirstSteps[list]));
+            try
+            {
+                if (pass.GetRenderFunc())
+                    pass.GetRenderFunc()(*ctx);
+            }
+            catch (...)
+            {
+                ctx->FinishRecording();
+                throw;
+            }
+            ctx->FinishRecording();
+        });
+    }
+    catch (...)
+    {
+        passError = std::current_exception();
+    }
+    for (const auto& renderPassContext : ExecuteRenderPasses)
+        if (renderPassContext)
+            renderPassContext->FinishRecording();
+    ExecuteRenderPasses.clear();
+
+    // With a single queue, submission order alone takes care of the sync points
+    if (!isAsync)
+    {
+        for (const auto& cmdList : ExecuteLists)
+            cmdList->Commit();
+        ExecuteLists.clear();
+        if (passError)
+            std::rethrow_exception(passError);
+        return;
+    }
+
+    // Sync points never fall inside a render pass group, so each step is the first of its list
+    std::vector<bool> isSignaling(ExecuteLists.size(), false);
+    for (const auto& sync : SyncPoints)
+    {
+        ExecuteLists[StepLists[sync.WaitStep]]->WaitForCommandList(
+            *ExecuteLists[StepLists[sync.SignalStep]]);
+        isSignaling[StepLists[sync.SignalStep]] = true;
+    }
+    // Resources owned by a single queue family change owners on the way. The acquire waits on the
+    //   giving list, which is flushed like a signaling one
+    for (const auto& handoff : QueueHandoffs)
+    {
+        const auto& resource = static_cast<const CRenderResource&>(*Nodes[handoff.NodeId]);
+        auto& giver = handoff.GiveStep == SIZE_MAX ? *handoffBefore
+                                                   : *ExecuteLists[StepLists[handoff.GiveStep]];
+        auto& taker = handoff.TakeStep == SIZE_MAX ? *handoffAfter
+                                                   : *ExecuteLists[StepLists[handoff.TakeStep]];
+        if (resource.IsBuffer() && resource.GetBuffer())
+            giver.TransferOwnership(taker, resource.GetBuffer());
+        else if (!resource.IsBuffer() && resource.GetImageView())
+            giver.TransferOwnership(taker, resource.GetImageView());
+        if (handoff.GiveStep != SIZE_MAX)
+            isSignaling[StepLists[handoff.GiveStep]] = true;
+    }
+    if (handoffBefore)
+    {
+        handoffBefore->Commit();
+        renderQueue.Flush();
+    }
+    // A signal has to be submitted before anything waits on it. Lists are committed in pass order
+    //   and a signaling list is flushed right away, which is before any of its waiters is committed
+    for (size_t i = 0; i < ExecuteLists.size(); i++)
+    {
+        ExecuteLists[i]->Commit();
+        if (isSignaling[i])
+            (PassQueues[ListFirstSteps[i]] == EQueueType::Compute ? computeQueue : renderQueue)
+                .Flush();
+    }
+    if (handoffAfter)
+        handoffAfter->Commit();
+    ExecuteLists.clear();
+    if (passError)
+        std::rethrow_exception(passError);
+}
+
+void CRenderGraph::PlanDependencies() const
+{
+    Dependencies.clear();
+    JoinSteps.assign(PassOrder.size(), SIZE_MAX);
+    if (std::find(PassQueues.begin(), PassQueues.end(), EQueueType::Compute) == PassQueues.end())
+        return;
+
+    for (size_t i = 0; i < Nodes.size(); i++)
+    {
+        auto* node = Nodes[i];
+        if (!node || node->GetType() != ERenderNodeType::RenderResource)
+            continue;
+        for (uint32_t j = AdjOffsets[i]; j < AdjOffsets[i + 1]; j++)
+        {
+            const auto& later = Edges[AdjEdges[j]];
+            size_t laterTime = Nodes[later.PassId]->_PassOrder;
+            if (laterTime == SIZE_MAX)
+                continue;
+            for (uint32_t k = AdjOffsets[i]; k < AdjOffsets[i + 1]; k++)
+            {
+                const auto& earlier = Edges[AdjEdges[k]];
+                size_t earlierTime = Nodes[earlier.PassId]->_PassOrder;
+                if (earlierTime == SIZE_MAX || earlierTime >= laterTime
+                    || PassQueues[earlierTime] == PassQueues[laterTime])
+                    continue;
+                // Read after write, write after write and write after read
+                if (earlier.Usage.bWrite || later.Usage.bWrite)
+                    Dependencies.emplace_back(laterTime, earlierTime);
+            }
+        }
+    }
+
+    // Queues execute in order, so waiting for a pass also waits for everything before it
+    for (const auto& dependency : Dependencies)
+        JoinSteps[dependency.second] = std::min(JoinSteps[dependency.second], dependency.first);
+    for (size_t i = PassOrder.size() - 1; i-- > 0;)
+    {
+        for (size_t next = i + 1; next < PassOrder.size(); next++)
+        {
+            if (PassQueues[next] == PassQueues[i])
             {
-                auto next = iter;
-                std::advance(next, 1);
-                if (next == transitions.end())
-                    break;
-                iter->second.StateAfter = next->second.StateDuring;
-                iter = next;
+                JoinSteps[i] = std::min(JoinSteps[i], JoinSteps[next]);
+                break;
             }
-            // Actually store all those transitions
-            for (const auto& tp : transitions)
-                if (!tp.second.IsUnneeded())
-                    Transitions[tp.first].push_back(tp.second);
         }
     }
+}
 
+void CRenderGraph::PlanQueueHandoffs() const
+{
+    QueueHandoffs.clear();
+    if (std::find(PassQueues.begin(), PassQueues.end(), EQueueType::Compute) == PassQueues.end())
+        return;
+
+    // The compute queue only borrows resources, they go back to the render queue at the end
+    for (size_t i = 0; i < Nodes.size(); i++)
+    {
+        auto* node = Nodes[i];
+        if (!node || node->GetType() != ERenderNodeType::RenderResource)
+            continue;
+        auto& steps = HandoffScratch;
+        steps.clear();
+        for (uint32_t j = AdjOffsets[i]; j < AdjOffsets[i + 1]; j++)
+        {
+            size_t time = Nodes[Edges[AdjEdges[j]].PassId]->_PassOrder;
+            if (time != SIZE_MAX)
+                steps.push_back(time);
+        }
+        std::sort(steps.begin(), steps.end());
+
+        size_t prevStep = SIZE_MAX;
+        EQueueType prevQueue = EQueueType::Render;
+        for (size_t step : steps)
+        {
+            if (PassQueues[step] != prevQueue)
+                QueueHandoffs.push_back(CQueueHandoff { i, prevStep, step });
+            prevStep = step;
+            prevQueue = PassQueues[step];
+        }
+        if (prevQueue != EQueueType::Render)
+            QueueHandoffs.push_back(CQueueHandoff { i, prevStep, SIZE_MAX });
+    }
+}
+
+void CRenderGraph::PlanSyncPoints() const
+{
+    SyncPoints.clear();
+    if (std::find(PassQueues.begin(), PassQueues.end(), EQueueType::Compute) == PassQueues.end())
+        return;
+
+    // A resource can only move into aliased memory once every user of the previous one is done.
+    //   Lifetimes are already stretched to cover the other queues, so this is rarely needed
+    for (const auto& prev : TransientPlacements)
+    {
+        for (const auto& next : TransientPlacements)
+        {
+            if (prev.LastUse >= next.FirstUse)
+                continue;
+            if (prev.Offset + prev.Size <= next.Offset || next.Offset + next.Size <= prev.Offset)
+                continue;
+            for (uint32_t j = AdjOffsets[prev.NodeId]; j < AdjOffsets[prev.NodeId + 1]; j++)
+            {
+                size_t time = Nodes[Edges[AdjEdges[j]].PassId]->_PassOrder;
+                if (time != SIZE_MAX && PassQueues[time] != PassQueues[next.FirstUse])
+                    Dependencies.emplace_back(next.FirstUse, time);
+            }
+        }
+    }
+
+    // Only keep the waits that are not already implied by an earlier one on the same queue
+    std::sort(Dependencies.begin(), Dependencies.end());
+    const size_t kQueueCount = static_cast<size_t>(EQueueType::Count);
+    size_t covered[kQueueCount][kQueueCount] = {}; // Last waited signal step + 1
+    for (size_t i = 0; i < Dependencies.size();)
+    {
+        size_t waitStep = Dependencies[i].first;
+        size_t waitQueue = static_cast<size_t>(PassQueues[waitStep]);
+        size_t needed[kQueueCount] = {};
+        for (; i < Dependencies.size() && Dependencies[i].first == waitStep; i++)
+        {
+            size_t signalStep = Dependencies[i].second;
+            size_t signalQueue = static_cast<size_t>(PassQueues[signalStep]);
+            needed[signalQueue] = std::max(needed[signalQueue], signalStep + 1);
+        }
+        for (size_t queue = 0; queue < kQueueCount; queue++)
+        {
+            if (needed[queue] <= covered[queue][waitQueue])
+                continue;
+            SyncPoints.push_back(CSyncPoint { needed[queue] - 1, waitStep });
+            covered[queue][waitQueue] = needed[queue];
+        }
+    }
+}
+
+void CRenderGraph::PlanRenderPasses() const
+{
+    // Greedily grow each render pass with the passes right after it. The graph order is kept as
+    //   is, passes are never moved around to create more merges
+    RenderPassGroups.clear();
+    MergeResults.assign(PassOrder.size(), EPassMergeResult::FirstPass);
     for (size_t i = 0; i < PassOrder.size(); i++)
     {
-        size_t nodeId = PassOrder[i];
-        std::cout << Nodes[nodeId]->GetName() << std::endl;
-        for (const auto& tr : Transitions[i])
+        if (i > 0)
+            MergeResults[i] = CanMergeWithGroup(i, RenderPassGroups.back().FirstStep);
+        if (MergeResults[i] == EPassMergeResult::Merged)
+            RenderPassGroups.back().StepCount++;
+        else
+            RenderPassGroups.push_back(CRenderPassGroup { i, 1, 0, 0 });
+    }
+}
+
+EPassMergeResult CRenderGraph::CanMergeWithGroup(size_t step, size_t groupStart) const
+{
+    auto isAttachment = [](EResourceUsageType type) {
+        return type == EResourceUsageType::ColorAttachment
+            || type == EResourceUsageType::DepthStencilAttachment
+            || type == EResourceUsageType::InputAttachment;
+    };
+    auto isRaster = [this](size_t nodeId) {
+        for (uint32_t i = AdjOffsets[nodeId]; i < AdjOffsets[nodeId + 1]; i++)
         {
-            std::cout << Nodes[tr.NodeId]->GetName() << " " << (int)tr.StateDuring << " -> "
-                      << (int)tr.StateAfter << std::endl;
+            auto type = Edges[AdjEdges[i]].Usage.Type;
+            if (type == EResourceUsageType::ColorAttachment
+                || type == EResourceUsageType::DepthStencilAttachment)
+                return true;
+        }
+        return false;
+    };
+    auto findPlacement = [this](size_t nodeId) -> const CTransientPlacement* {
+        for (const auto& alloc : TransientPlacements)
+            if (alloc.NodeId == nodeId)
+                return &alloc;
+        return nullptr;
+    };
+
+    size_t nodeId = PassOrder[step];
+    if (PassQueues[step] != EQueueType::Render || PassQueues[step - 1] != EQueueType::Render
+        || !isRaster(nodeId) || !isRaster(PassOrder[step - 1]))
+        return EPassMergeResult::NotRaster;
+    for (const auto& sync : SyncPoints)
+        if (sync.WaitStep == step || sync.SignalStep == step - 1)
+            return EPassMergeResult::SyncPoint;
+
+    // The render area comes from the first attachment of the group
+    const CRenderResource* first = nullptr;
+    for (uint32_t i = AdjOffsets[PassOrder[groupStart]]; i < AdjOffsets[PassOrder[groupStart] + 1];
+         i++)
+    {
+        const auto& edge = Edges[AdjEdges[i]];
+        if (isAttachment(edge.Usage.Type))
+        {
+            first = static_cast<const CRenderResource*>(Nodes[edge.ResourceId]);
+            break;
+        }
+    }
+
+    bool shared = false;
+    for (uint32_t i = AdjOffsets[nodeId]; i < AdjOffsets[nodeId + 1]; i++)
+    {
+        const auto& edge = Edges[AdjEdges[i]];
+        const auto& resource = static_cast<const CRenderResource&>(*Nodes[edge.ResourceId]);
+        bool attachment = isAttachment(edge.Usage.Type);
+        if (attachment
+            && (resource.GetWidth() == 0 || resource.GetWidth() != first->GetWidth()
+                || resource.GetHeight() != first->GetHeight()
+                || resource.GetArrayLayers() != first->GetArrayLayers()))
+            return EPassMergeResult::ExtentMismatch;
+
+        const auto* alloc = findPlacement(edge.ResourceId);
+        for (size_t j = groupStart; j < step; j++)
+        {
+            size_t otherId = PassOrder[j];
+            for (uint32_t k = AdjOffsets[otherId]; k < AdjOffsets[otherId + 1]; k++)
+            {
+                const auto& other = Edges[AdjEdges[k]];
+                bool otherAttachment = isAttachment(other.Usage.Type);
+                if (other.ResourceId == edge.ResourceId)
+                {
+                    // Anything but attachments can see other pixels than the one being shaded
+                    if (attachment != otherAttachment && (edge.Usage.bWrite || other.Usage.bWrite))
+                        return EPassMergeResult::NonLocalAccess;
+                    shared |= attachment && otherAttachment;
+                    continue;
+                }
+                const auto* otherAlloc = findPlacement(other.ResourceId);
+                if (attachment && otherAttachment && alloc && otherAlloc
+                    && alloc->Offset < otherAlloc->Offset + otherAlloc->Size
+                    && otherAlloc->Offset < alloc->Offset + alloc->Size)
+                    return EPassMergeResult::AliasedMemory;
+            }
         }
     }
+    return shared ? EPassMergeResult::Merged : EPassMergeResult::NoSharedAttachment;
 }
 
-std::shared_ptr<CResourceUsage> CRenderGraph::AddEdge(size_t src, size_t dst)
+void CRenderGraph::PlanAttachments() const
 {
-    auto usage = std::make_shared<CResourceUsage>();
-    AdjLists[src][dst] = usage;
-    AdjLists[dst][src] = usage;
-    return usage;
+    RenderPassAttachments.clear();
+    SubpassAttachmentRefs.clear();
+    for (auto& group : RenderPassGroups)
+    {
+        group.FirstAttachment = RenderPassAttachments.size();
+        size_t groupEnd = group.FirstStep + group.StepCount;
+        for (size_t step = group.FirstStep; step < groupEnd; step++)
+        {
+            size_t nodeId = PassOrder[step];
+            for (uint32_t i = AdjOffsets[nodeId]; i < AdjOffsets[nodeId + 1]; i++)
+            {
+                const auto& edge = Edges[AdjEdges[i]];
+                if (edge.Usage.Type != EResourceUsageType::ColorAttachment
+                    && edge.Usage.Type != EResourceUsageType::DepthStencilAttachment
+                    && edge.Usage.Type != EResourceUsageType::InputAttachment)
+                    continue;
+                auto first = RenderPassAttachments.begin() + group.FirstAttachment;
+                if (std::find_if(first, RenderPassAttachments.end(), [&](const auto& attachment) {
+                        return attachment.NodeId == edge.ResourceId;
+                    }) == RenderPassAttachments.end())
+                    RenderPassAttachments.push_back(CRenderPassAttachment {
+                        edge.ResourceId, EAttachmentLoadOp::DontCare, EAttachmentStoreOp::DontCare });
+            }
+        }
+        group.AttachmentCount = RenderPassAttachments.size() - group.FirstAttachment;
+
+        // The subpass layout, what MakeRenderPassDesc builds from after a cache hit
+        for (size_t step = group.FirstStep; step < groupEnd; step++)
+        {
+            size_t nodeId = PassOrder[step];
+            for (uint32_t i = AdjOffsets[nodeId]; i < AdjOffsets[nodeId + 1]; i++)
+            {
+                const auto& edge = Edges[AdjEdges[i]];
+                auto first = RenderPassAttachments.begin() + group.FirstAttachment;
+                auto iter = std::find_if(first, RenderPassAttachments.end(),
+                                         [&](const auto& attachment) {
+                                             return attachment.NodeId == edge.ResourceId;
+                                         });
+                if (iter == RenderPassAttachments.end())
+                    continue;
+                SubpassAttachmentRefs.push_back(
+                    CSubpassAttachmentRef { step, static_cast<uint32_t>(iter - first),
+                                            edge.Usage.Type, edge.Usage.ColorAttachmentIndex });
+            }
+        }
+
+        for (size_t j = group.FirstAttachment; j < RenderPassAttachments.size(); j++)
+        {
+            // Look at the first use inside the group and the closest ones around it
+            auto& attachment = RenderPassAttachments[j];
+            size_t nodeId = attachment.NodeId;
+            bool usedBefore = false;
+            size_t firstInside = SIZE_MAX;
+            bool firstInsideReads = false;
+            size_t nextAfter = SIZE_MAX;
+            bool nextAfterReads = false;
+            for (uint32_t i = AdjOffsets[nodeId]; i < AdjOffsets[nodeId + 1]; i++)
+            {
+                const auto& edge = Edges[AdjEdges[i]];
+                size_t time = Nodes[edge.PassId]->_PassOrder;
+                if (time == SIZE_MAX)
+                    continue;
+                if (time < group.FirstStep)
+                    usedBefore = true;
+                else if (time < groupEnd && time <= firstInside)
+                {
+                    firstInsideReads = (time == firstInside && firstInsideReads) || edge.Usage.bRead;
+                    firstInside = time;
+                }
+                else if (time >= groupEnd && time <= nextAfter)
+                {
+                    nextAfterReads = (time == nextAfter && nextAfterReads) || edge.Usage.bRead;
+                    nextAfter = time;
+                }
+            }
+            // Nothing before the group means there is nothing worth loading, and a write-only
+            //   first use throws the old contents away anyway
+            if (usedBefore && firstInsideReads)
+                attachment.LoadOp = EAttachmentLoadOp::Load;
+            if (nextAfterReads || (nextAfter == SIZE_MAX && nodeId == GoalNode))
+                attachment.StoreOp = EAttachmentStoreOp::Store;
+        }
+    }
 }
 
-bool CRenderGraph::CTransition::IsUnneeded() const { return StateDuring == StateAfter; }
+void CRenderGraph::PlanSplitBarriers() const
+{
+    // Which render pass each step ended up in
+    std::vector<size_t> stepGroups(PassOrder.size());
+    for (size_t i = 0; i < RenderPassGroups.size(); i++)
+        for (size_t j = 0; j < RenderPassGroups[i].StepCount; j++)
+            stepGroups[RenderPassGroups[i].FirstStep + j] = i;
+
+    // Only worth it with something to overlap in between. Events can't cross queues, nor be set
+    //   inside a render pass, and buffers are left to the backend
+    for (size_t step = 0; step < Transitions.size(); step++)
+    {
+        for (auto& t : Transitions[step])
+        {
+            t.bSplit = t.NextStep != SIZE_MAX && t.NextStep > step + 1
+                && PassQueues[t.NextStep] == PassQueues[step]
+                && stepGroups[t.NextStep] != stepGroups[step]
+                && !static_cast<const CRenderResource&>(*Nodes[t.NodeId]).IsBuffer();
+        }
+    }
+}
+
+CRenderPassDesc CRenderGraph::MakeRenderPassDesc(size_t group) const
+{
+    if (!ValidateSuccess || !bPlanBaked)
+        throw CRHIRuntimeError("Render graph has to be validated and baked before execution");
+    const auto& g = RenderPassGroups[group];
+    if (g.AttachmentCount == 0)
+        throw CRHIRuntimeError("Render pass group has no attachments");
+
+    CRenderPassDesc desc;
+    for (size_t j = g.FirstAttachment; j < g.FirstAttachment + g.AttachmentCount; j++)
+    {
+        const auto& attachment = RenderPassAttachments[j];
+        const auto& resource = static_cast<const CRenderResource&>(*Nodes[attachment.NodeId]);
+        if (!resource.GetImageView())
+            throw CRHIRuntimeError("Render graph resource " + resource.GetName()
+                                   + " has no image view");
+        // Stencil follows depth, it is not tracked separately
+        bool hasStencil = HasStencilComponent(resource.GetFormat());
+        desc.AddAttachment(resource.GetImageView(), attachment.LoadOp, attachment.StoreOp,
+                           hasStencil ? attachment.LoadOp : EAttachmentLoadOp::DontCare,
+                           hasStencil ? attachment.StoreOp : EAttachmentStoreOp::DontCare);
+        if (j == g.FirstAttachment)
+            desc.SetExtent(resource.GetWidth(), resource.GetHeight(), resource.GetArrayLayers());
+    }
+
+    // Only the plan is read here, the adjacency may belong to another graph after a cache hit
+    auto ref = std::lower_bound(
+        SubpassAttachmentRefs.begin(), SubpassAttachmentRefs.end(), g.FirstStep,
+        [](const CSubpassAttachmentRef& lhs, size_t step) { return lhs.Step < step; });
+    for (size_t step = g.FirstStep; step < g.FirstStep + g.StepCount; step++)
+    {
+        auto& subpass = desc.NextSubpass();
+        for (; ref != SubpassAttachmentRefs.end() && ref->Step == step; ++ref)
+        {
+            // Locations the pass skips are left unused
+            uint32_t index = ref->Attachment;
+            auto place = [index](std::vector<uint32_t>& list, uint32_t location) {
+                if (list.size() <= location)
+                    list.resize(location + 1, static_cast<uint32_t>(CSubpassDesc::None));
+                list[location] = index;
+            };
+            if (ref->Type == EResourceUsageType::ColorAttachment)
+                place(subpass.ColorAttachments, ref->Location);
+            else if (ref->Type == EResourceUsageType::InputAttachment)
+                place(subpass.InputAttachments, ref->Location);
+            else if (ref->Type == EResourceUsageType::DepthStencilAttachment)
+                subpass.SetDepthStencilAttachment(index);
+        }
+    }
+    return desc;
+}
+
+const char* CRenderGraph::GetMergeResultName(EPassMergeResult result)
+{
+    switch (result)
+    {
+    case EPassMergeResult::Merged:
+        return "Merged";
+    case EPassMergeResult::FirstPass:
+        return "FirstPass";
+    case EPassMergeResult::NotRaster:
+        return "NotRaster";
+    case EPassMergeResult::ExtentMismatch:
+        return "ExtentMismatch";
+    case EPassMergeResult::NoSharedAttachment:
+        return "NoSharedAttachment";
+    case EPassMergeResult::NonLocalAccess:
+        return "NonLocalAccess";
+    case EPassMergeResult::SyncPoint:
+        return "SyncPoint";
+    case EPassMergeResult::AliasedMemory:
+        return "AliasedMemory";
+    }
+    return "Unknown";
+}
+
+bool CRenderGraph::CTransition::IsUnneeded() const
+{
+    return StateDuring == StateAfter && !bMemoryBarrier;
+}
 
 }
@@ -24,37 +24,376 @@ bool CAccessRecord::IsWrite() const
     return AccessType & allWriteBits;
 }
 
-bool CAccessTracker::CalcOverlap(const CImageSubresourceRange& range1,
-                                 const CImageSubresourceRange& range2, uint32_t& top,
-                                 uint32_t& bottom, uint32_t& left, uint32_t& right)
-{
-    top = std::max(range1.BaseMipLevel, range2.BaseMipLevel);
-    bottom = std::min(range1.BaseMipLevel + range1.LevelCount - 1,
-                      range2.BaseMipLevel + range2.LevelCount - 1);
-    left = std::max(range1.BaseArrayLayer, range2.BaseArrayLayer);
-    right = std::min(range1.BaseArrayLayer + range1.LayerCount - 1,
-                     range2.BaseArrayLayer + range2.LayerCount - 1);
-
-    if (bottom < top || right < left)
-        return false;
+void CImageAccessMap::Reset(uint32_t mipLevels, uint32_t arrayLayers, const CAccessRecord& record)
+{
+    MipLevels = mipLevels;
+    ArrayLayers = arrayLayers;
+    Uniform = record;
+    Records.clear();
+}
+
+CImageSubresourceRange CImageAccessMap::GetWholeRange() const
+{
+    CImageSubresourceRange range;
+    range.Set(0, MipLevels, 0, ArrayLayers);
+    return range;
+}
+
+void CImageAccessMap::Assign(const CImageSubresourceRange& range, const CAccessRecord& record)
+{
+    uint32_t mipEnd = std::min(range.BaseMipLevel + range.LevelCount, MipLevels);
+    uint32_t layerEnd = std::min(range.BaseArrayLayer + range.LayerCount, ArrayLayers);
+    if (range.BaseMipLevel == 0 && range.BaseArrayLayer == 0 && mipEnd == MipLevels
+        && layerEnd == ArrayLayers)
+    {
+        Uniform = record;
+        Records.clear();
+        return;
+    }
+    if (Records.empty())
+    {
+        if (Uniform == record)
+            return;
+        Expand();
+    }
+
+    for (uint32_t mip = range.BaseMipLevel; mip < mipEnd; mip++)
+        std::fill(Records.begin() + mip * ArrayLayers + range.BaseArrayLayer,
+                  Records.begin() + mip * ArrayLayers + layerEnd, record);
+    TryCollapse(record);
+}
+
+void CImageAccessMap::AssignUntracked(const CImageSubresourceRange& range,
+                                      const CAccessRecord& record)
+{
+    if (Records.empty())
+    {
+        if (Uniform.IsUntracked())
+            Assign(range, record);
+        return;
+    }
+
+    uint32_t mipEnd = std::min(range.BaseMipLevel + range.LevelCount, MipLevels);
+    uint32_t layerEnd = std::min(range.BaseArrayLayer + range.LayerCount, ArrayLayers);
+    for (uint32_t mip = range.BaseMipLevel; mip < mipEnd; mip++)
+        for (uint32_t layer = range.BaseArrayLayer; layer < layerEnd; layer++)
+        {
+            auto& entry = Records[mip * ArrayLayers + layer];
+            if (entry.IsUntracked())
+                entry = record;
+        }
+    TryCollapse(record);
+}
+
+void CImageAccessMap::Expand()
+{
+    Records.assign(MipLevels * ArrayLayers, Uniform);
+}
+
+void CImageAccessMap::TryCollapse(const CAccessRecord& record)
+{
+    // Only worth a scan when both corners already agree
+    if (Records.front() != record || Records.back() != record)
+        return;
+    for (const auto& entry : Records)
+        if (entry != record)
+            return;
+    Uniform = record;
+    Records.clear();
+}
+
+bool CImageAccessMap::IsRowEqual(uint32_t mipA, uint32_t mipB, uint32_t layerBegin,
+                                 uint32_t layerEnd) const
+{
+    const CAccessRecord* rowA = Records.data() + mipA * ArrayLayers;
+    const CAccessRecord* rowB = Records.data() + mipB * ArrayLayers;
+    for (uint32_t layer = layerBegin; layer < layerEnd; layer++)
+        if (rowA[layer] != rowB[layer])
+            return false;
     return true;
 }
 
+CBufferRange CBufferAccessMap::FirstOverlapKey(const CBufferRange& range) const
+{
+    CBufferRange key { range.Buffer, range.Offset, 0 };
+    auto iter = Ranges.lower_bound(key);
+    if (iter != Ranges.begin())
+    {
+        auto prev = std::prev(iter);
+        if (prev->first.Buffer == range.Buffer
+            && prev->first.Offset + prev->first.Size > range.Offset)
+            return prev->first;
+    }
+    return key;
+}
+
+void CBufferAccessMap::Assign(const CBufferRange& range, const CAccessRecord& record)
+{
+    if (range.Size == 0)
+        return;
+
+    // Cut out whatever the range covers, keeping the parts sticking out on either side
+    size_t begin = range.Offset;
+    size_t end = range.Offset + range.Size;
+    auto iter = Ranges.lower_bound(FirstOverlapKey(range));
+    while (iter != Ranges.end() && iter->first.Buffer == range.Buffer && iter->first.Offset < end)
+    {
+        CBufferRange old = iter->first;
+        CAccessRecord oldRecord = iter->second;
+        iter = Ranges.erase(iter);
+        if (old.Offset < begin)
+            Ranges.emplace(CBufferRange { range.Buffer, old.Offset, begin - old.Offset },
+                           oldRecord);
+        if (old.Offset + old.Size > end)
+        {
+            iter = Ranges.emplace(CBufferRange { range.Buffer, end, old.Offset + old.Size - end },
+                                  oldRecord)
+                       .first;
+            break;
+        }
+    }
+
+    // Then merge with the neighbours
+    auto next = Ranges.lower_bound(CBufferRange { range.Buffer, end, 0 });
+    if (next != Ranges.end() && next->first.Buffer == range.Buffer && next->first.Offset == end
+        && next->second == record)
+    {
+        end += next->first.Size;
+        Ranges.erase(next);
+    }
+    auto prev = Ranges.lower_bound(CBufferRange { range.Buffer, begin, 0 });
+    if (prev != Ranges.begin())
+    {
+        --prev;
+        if (prev->first.Buffer == range.Buffer
+            && prev->first.Offset + prev->first.Size == begin && prev->second == record)
+        {
+            begin = prev->first.Offset;
+            Ranges.erase(prev);
+        }
+    }
+    Ranges.emplace(CBufferRange { range.Buffer, begin, end - begin }, record);
+}
+
+void CBufferAccessMap::AssignUntracked(const CBufferRange& range, const CAccessRecord& record)
+{
+    std::vector<CBufferRange> gaps;
+    size_t cursor = range.Offset;
+    ForEachOverlap(range, [&](const CBufferRange& tracked, const CAccessRecord&) {
+        if (tracked.Offset > cursor)
+            gaps.push_back(CBufferRange { range.Buffer, cursor, tracked.Offset - cursor });
+        cursor = tracked.Offset + tracked.Size;
+    });
+    if (cursor < range.Offset + range.Size)
+        gaps.push_back(CBufferRange { range.Buffer, cursor, range.Offset + range.Size - cursor });
+    for (const auto& gap : gaps)
+        Assign(gap, record);
+}
+
+void CBarrierRecorderVk::PipelineBarrier(VkCommandBuffer cmdBuffer,
+                                         VkPipelineStageFlags srcStages,
+                                         VkPipelineStageFlags dstStages,
+                                         uint32_t bufferBarrierCount,
+                                         const VkBufferMemoryBarrier* bufferBarriers,
+                                         uint32_t imageBarrierCount,
+                                         const VkImageMemoryBarrier* imageBarriers)
+{
+    vkCmdPipelineBarrier(cmdBuffer, srcStages, dstStages, 0, 0, nullptr, bufferBarrierCount,
+                         bufferBarriers, imageBarrierCount, imageBarriers);
+}
+
+void CBarrierRecorderVk::WaitEvent(VkCommandBuffer cmdBuffer, VkEvent event,
+                                   VkPipelineStageFlags srcStages,
+                                   VkPipelineStageFlags dstStages,
+                                   const VkImageMemoryBarrier* imageBarrier)
+{
+    vkCmdWaitEvents(cmdBuffer, 1, &event, srcStages, dstStages, 0, nullptr, 0, nullptr,
+                    imageBarrier ? 1 : 0, imageBarrier);
+}
+
+static CBarrierRecorderVk DriverRecorder;
+CBarrierRecorderVk* CBarrierBatchVk::Recorder = &DriverRecorder;
+
+void CBarrierBatchVk::SetRecorder(CBarrierRecorderVk* recorder)
+{
+    Recorder = recorder ? recorder : &DriverRecorder;
+}
+
+void CBarrierBatchVk::Add(VkCommandBuffer cmdBuffer, VkPipelineStageFlags srcStages,
+                          VkPipelineStageFlags dstStages, const VkImageMemoryBarrier* imageBarrier)
+{
+    Counters.Requested++;
+    if (imageBarrier)
+    {
+        // Barriers in one call are unordered, a second transition of the same subresource has to
+        //   come after the first
+        const auto& range = imageBarrier->subresourceRange;
+        for (const auto& pending : ImageBarriers)
+        {
+            const auto& pendingRange = pending.subresourceRange;
+            if (pending.image == imageBarrier->image
+                && range.baseMipLevel < pendingRange.baseMipLevel + pendingRange.levelCount
+                && pendingRange.baseMipLevel < range.baseMipLevel + range.levelCount
+                && range.baseArrayLayer < pendingRange.baseArrayLayer + pendingRange.layerCount
+                && pendingRange.baseArrayLayer < range.baseArrayLayer + range.layerCount)
+            {
+                Flush(cmdBuffer);
+                break;
+            }
+        }
+        ImageBarriers.push_back(*imageBarrier);
+        ImageStages.push_back({ srcStages, dstStages });
+    }
+    else
+        ExecutionBarriers.push_back({ srcStages, dstStages });
+    SrcStages |= srcStages;
+    DstStages |= dstStages;
+}
+
+void CBarrierBatchVk::Add(VkCommandBuffer cmdBuffer, VkPipelineStageFlags srcStages,
+                          VkPipelineStageFlags dstStages,
+                          const VkBufferMemoryBarrier& bufferBarrier)
+{
+    Counters.Requested++;
+    for (const auto& pending : BufferBarriers)
+    {
+        if (pending.buffer == bufferBarrier.buffer
+            && bufferBarrier.offset < pending.offset + pending.size
+            && pending.offset < bufferBarrier.offset + bufferBarrier.size)
+        {
+            Flush(cmdBuffer);
+            break;
+        }
+    }
+    BufferBarriers.push_back(bufferBarrier);
+    BufferStages.push_back({ srcStages, dstStages });
+    SrcStages |= srcStages;
+    DstStages |= dstStages;
+}
+
+void CBarrierBatchVk::Flush(VkCommandBuffer cmdBuffer)
+{
+    if (IsEmpty())
+        return;
+#ifdef VK_KHR_synchronization2
+    if (PipelineBarrier2)
+        FlushSynchronization2(cmdBuffer);
+    else
+#endif
+        Recorder->PipelineBarrier(cmdBuffer, SrcStages, DstStages,
+                                  static_cast<uint32_t>(BufferBarriers.size()),
+                                  BufferBarriers.data(),
+                                  static_cast<uint32_t>(ImageBarriers.size()),
+                                  ImageBarriers.data());
+    Counters.Issued++;
+    SrcStages = 0;
+    DstStages = 0;
+    ExecutionBarriers.clear();
+    BufferBarriers.clear();
+    BufferStages.clear();
+    ImageBarriers.clear();
+    ImageStages.clear();
+}
+
+#ifdef VK_KHR_synchronization2
+PFN_vkCmdPipelineBarrier2KHR CBarrierBatchVk::PipelineBarrier2 = nullptr;
+
+void CBarrierRecorderVk::PipelineBarrier2(VkCommandBuffer cmdBuffer,
+                                          const VkDependencyInfoKHR& dependencyInfo)
+{
+    CBarrierBatchVk::PipelineBarrier2(cmdBuffer, &dependencyInfo);
+}
+
+void CBarrierBatchVk::FlushSynchronization2(VkCommandBuffer cmdBuffer)
+{
+    // The legacy flag bits are the low half of the 64-bit ones, so the masks carry over as is
+    std::vector<VkMemoryBarrier2KHR> memoryBarriers;
+    memoryBarriers.reserve(ExecutionBarriers.size());
+    for (const auto& stages : ExecutionBarriers)
+    {
+        VkMemoryBarrier2KHR barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2_KHR };
+        barrier.srcStageMask = stages.Src;
+        barrier.dstStageMask = stages.Dst;
+        memoryBarriers.push_back(barrier);
+    }
+
+    std::vector<VkBufferMemoryBarrier2KHR> bufferBarriers;
+    bufferBarriers.reserve(BufferBarriers.size());
+    for (size_t i = 0; i < BufferBarriers.size(); i++)
+    {
+        const auto& legacy = BufferBarriers[i];
+        VkBufferMemoryBarrier2KHR barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2_KHR };
+        barrier.srcStageMask = BufferStages[i].Src;
+        barrier.srcAccessMask = legacy.srcAccessMask;
+        barrier.dstStageMask = BufferStages[i].Dst;
+        barrier.dstAccessMask = legacy.dstAccessMask;
+        barrier.srcQueueFamilyIndex = legacy.srcQueueFamilyIndex;
+        barrier.dstQueueFamilyIndex = legacy.dstQueueFamilyIndex;
+        barrier.buffer = legacy.buffer;
+        barrier.offset = legacy.offset;
+        barrier.size = legacy.size;
+        bufferBarriers.push_back(barrier);
+    }
+
+    std::vector<VkImageMemoryBarrier2KHR> imageBarriers;
+    imageBarriers.reserve(ImageBarriers.size());
+    for (size_t i = 0; i < ImageBarriers.size(); i++)
+    {
+        const auto& legacy = ImageBarriers[i];
+        VkImageMemoryBarrier2KHR barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR };
+        barrier.srcStageMask = ImageStages[i].Src;
+        barrier.srcAccessMask = legacy.srcAccessMask;
+        barrier.dstStageMask = ImageStages[i].Dst;
+        barrier.dstAccessMask = legacy.dstAccessMask;
+        barrier.oldLayout = legacy.oldLayout;
+        barrier.newLayout = legacy.newLayout;
+        barrier.srcQueueFamilyIndex = legacy.srcQueueFamilyIndex;
+        barrier.dstQueueFamilyIndex = legacy.dstQueueFamilyIndex;
+        barrier.image = legacy.image;
+        barrier.subresourceRange = legacy.subresourceRange;
+        imageBarriers.push_back(barrier);
+    }
+
+    VkDependencyInfoKHR dependencyInfo = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR };
+    dependencyInfo.memoryBarrierCount = static_cast<uint32_t>(memoryBarriers.size());
+    dependencyInfo.pMemoryBarriers = memoryBarriers.data();
+    dependencyInfo.bufferMemoryBarrierCount = static_cast<uint32_t>(bufferBarriers.size());
+    dependencyInfo.pBufferMemoryBarriers = bufferBarriers.data();
+    dependencyInfo.imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size());
+    dependencyInfo.pImageMemoryBarriers = imageBarriers.data();
+    Recorder->PipelineBarrier2(cmdBuffer, dependencyInfo);
+}
+#endif
+
 void CAccessTracker::InsertImageBarrier(VkCommandBuffer cmdBuffer, CImageVk* image,
                                         const CImageSubresourceRange& range,
                                         const CAccessRecord& oldAccess,
-                                        const CAccessRecord& newAccess)
+                                        const CAccessRecord& newAccess,
+                                        const CSplitBarrierVk* split, CBarrierBatchVk* batch)
 {
     // Nop if read-read
     if (!oldAccess.IsWrite() && !newAccess.IsWrite()
         && oldAccess.ImageLayout == newAccess.ImageLayout)
         return;
 
-    // WAR only needs an execution barrier
-    if (oldAccess.IsRead() && oldAccess.ImageLayout == newAccess.ImageLayout)
+    // The event only covers what the signaler did. Anything since then needs a full barrier
+    if (split && (oldAccess.Stages & ~split->Stages))
+        split = nullptr;
+    // Without a batch the barrier goes out right away, but down the same path
+    CBarrierBatchVk immediate;
+    if (!batch)
+        batch = &immediate;
+
+    // WAR only needs an execution barrier. Read-write accesses like GENERAL storage images still
+    //   have writes to make visible
+    if (!oldAccess.IsWrite() && oldAccess.ImageLayout == newAccess.ImageLayout)
     {
-        vkCmdPipelineBarrier(cmdBuffer, oldAccess.Stages, newAccess.Stages, 0, 0, nullptr, 0,
-                             nullptr, 0, nullptr);
+        if (split)
+            CBarrierBatchVk::GetRecorder().WaitEvent(cmdBuffer, split->Event, split->Stages,
+                                                     newAccess.Stages, nullptr);
+        else
+            batch->Add(cmdBuffer, oldAccess.Stages, newAccess.Stages, nullptr);
+        immediate.Flush(cmdBuffer);
         return;
     }
 
@@ -73,30 +412,97 @@ void CAccessTracker::InsertImageBarrier(VkCommandBuffer cmdBuffer, CImageVk* ima
     barrier.subresourceRange.baseMipLevel = range.BaseMipLevel;
     barrier.subresourceRange.layerCount = range.LayerCount;
     barrier.subresourceRange.levelCount = range.LevelCount;
-    vkCmdPipelineBarrier(cmdBuffer, oldAccess.Stages, newAccess.Stages, 0, 0, nullptr, 0, nullptr,
-                         1, &barrier);
+    // Events are set with the legacy call, so they are waited on with it too
+    if (split)
+        CBarrierBatchVk::GetRecorder().WaitEvent(cmdBuffer, split->Event, split->Stages,
+                                                 newAccess.Stages, &barrier);
+    else
+        batch->Add(cmdBuffer, oldAccess.Stages, newAccess.Stages, &barrier);
+    immediate.Flush(cmdBuffer);
+}
+
+void CAccessTracker::InsertBufferBarrier(VkCommandBuffer cmdBuffer, const CBufferRange& range,
+                                         const CAccessRecord& oldAccess,
+                                         const CAccessRecord& newAccess, CBarrierBatchVk* batch)
+{
+    // Nop if read-read
+    if (!oldAccess.IsWrite() && !newAccess.IsWrite())
+        return;
+
+    CBarrierBatchVk immediate;
+    if (!batch)
+        batch = &immediate;
+
+    // WAR only needs an execution barrier
+    if (!oldAccess.IsWrite())
+    {
+        batch->Add(cmdBuffer, oldAccess.Stages, newAccess.Stages, nullptr);
+        immediate.Flush(cmdBuffer);
+        return;
+    }
+
+    VkBufferMemoryBarrier barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+    barrier.srcAccessMask = oldAccess.AccessType;
+    barrier.dstAccessMask = newAccess.AccessType;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = range.Buffer->GetHandle();
+    barrier.offset = range.Offset;
+    barrier.size = range.Size;
+    batch->Add(cmdBuffer, oldAccess.Stages, newAccess.Stages, barrier);
+    immediate.Flush(cmdBuffer);
 }
 
-void CAccessTracker::TransitionBuffer(CBufferVk* buffer, size_t offset, size_t size,
-                                      VkAccessFlags access, VkPipelineStageFlags stages)
+CAccessRecord CAccessTracker::ForComputeQueue(const CAccessRecord& lastAccess)
 {
-    throw "unimplemented";
+    const VkPipelineStageFlags computeQueueStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT
+        | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+        | VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT
+        | VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    CAccessRecord record = lastAccess;
+    if (record.Stages & ~computeQueueStages)
+    {
+        // Last touched by the render queue, which the compute queue waited for with a
+        //   semaphore. Only the layout transition is left to do
+        record.AccessType = 0;
+        record.Stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    }
+    return record;
+}
+
+void CAccessTracker::TransitionBuffer(VkCommandBuffer cmdBuffer, CBufferVk* buffer, size_t offset,
+                                      size_t size, VkAccessFlags access,
+                                      VkPipelineStageFlags stages)
+{
+    if (buffer->IsExplicitState())
+    {
+#ifndef NDEBUG
+        // General covers every access
+        EResourceState declared = buffer->GetDeclaredState();
+        if (declared != EResourceState::General && (access & ~StateToAccessMask(declared)))
+            throw CRHIRuntimeError("Buffer accessed in a way it wasn't declared for");
+#endif
+        return;
+    }
+    if (offset >= buffer->GetSize())
+        return;
+    CBufferRange range { buffer, offset, std::min(size, buffer->GetSize() - offset) };
+    CAccessRecord currAccess { access, stages, VK_IMAGE_LAYOUT_UNDEFINED };
+    BufferFirstAccess.AssignUntracked(range, currAccess);
+    HandleBufferLastAccess(cmdBuffer, range, currAccess);
 }
 
 void CAccessTracker::TransitionImageState(VkCommandBuffer cmdBuffer, CImageVk* image,
                                           const CImageSubresourceRange& range,
                                           EResourceState targetState, bool isTransferQueue)
 {
-    if (image->IsTrackingDisabled())
-        return;
-
     auto dstAccess = StateToAccessMask(targetState);
     auto dstStages = StateToShaderStageMask(targetState, false);
     if (isTransferQueue && targetState != EResourceState::CopyDest
         && targetState != EResourceState::CopySource)
     {
         // Only do layout transitions if we are on the transfer queue and the target state is not
-        // supported on the transfer queue
+        // supported on the transfer queue. Exclusive images go through ReleaseImage instead
         dstAccess = 0;
         dstStages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
     }
@@ -108,8 +514,16 @@ void CAccessTracker::TransitionImage(VkCommandBuffer cmdBuffer, CImageVk* image,
                                      const CImageSubresourceRange& range, VkAccessFlags access,
                                      VkPipelineStageFlags stages, VkImageLayout layout)
 {
-    if (image->IsTrackingDisabled())
+    if (image->IsExplicitState())
+    {
+#ifndef NDEBUG
+        // Undefined means the old content is thrown away, that goes with any state
+        if (layout != VK_IMAGE_LAYOUT_UNDEFINED
+            && layout != StateToImageLayout(image->GetDeclaredState()))
+            throw CRHIRuntimeError("Image used in a layout it wasn't declared to be in");
+#endif
         return;
+    }
 
     CAccessRecord currAccess;
     currAccess.AccessType = access;
@@ -119,292 +533,245 @@ void CAccessTracker::TransitionImage(VkCommandBuffer cmdBuffer, CImageVk* image,
     HandleImageLastAccess(cmdBuffer, image, range, currAccess);
 }
 
-void CAccessTracker::DeployAllBarriers(VkCommandBuffer cmdBuffer)
+void CAccessTracker::ReleaseImage(VkCommandBuffer cmdBuffer, CImageVk* image,
+                                  const CImageSubresourceRange& range,
+                                  const CAccessRecord& newAccess, uint32_t srcFamily,
+                                  uint32_t dstFamily, COwnershipAcquireVk& acquire)
 {
-    // Transition all relevant images to the needed state
-    for (const auto& iter : ImageFirstAccess)
+    std::vector<CImageSubresourceRange> released;
+    auto release = [&](const CImageSubresourceRange& overlap, const CAccessRecord& oldAccess) {
+        VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+        barrier.srcAccessMask = oldAccess.AccessType;
+        barrier.dstAccessMask = 0;
+        barrier.oldLayout = oldAccess.ImageLayout;
+        barrier.newLayout = newAccess.ImageLayout;
+        barrier.srcQueueFamilyIndex = srcFamily;
+        barrier.dstQueueFamilyIndex = dstFamily;
+        barrier.image = image->GetVkImage();
+        barrier.subresourceRange.aspectMask = GetImageAspectFlags(image->GetVkFormat());
+        barrier.subresourceRange.baseArrayLayer = overlap.BaseArrayLayer;
+        barrier.subresourceRange.baseMipLevel = overlap.BaseMipLevel;
+        barrier.subresourceRange.layerCount = overlap.LayerCount;
+        barrier.subresourceRange.levelCount = overlap.LevelCount;
+        Barriers.Add(cmdBuffer, oldAccess.Stages, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, &barrier);
+
+        // The receiving side makes the writes visible to itself
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = newAccess.AccessType;
+        acquire.ImageBarriers.push_back(barrier);
+        released.push_back(overlap);
+    };
+
+    // Nothing is tracked for explicit-state images, they are in their declared state. The caller
+    //   declares the new one
+    if (image->IsExplicitState())
     {
-        if (iter.second.ImageLayout == VK_IMAGE_LAYOUT_UNDEFINED
-            || iter.second.ImageLayout == VK_IMAGE_LAYOUT_PREINITIALIZED)
-            continue;
-        iter.first.Image->TransitionAccess(cmdBuffer, iter.first.Range, iter.second);
-    }
-    for (const auto& iter : ImageLastAccess)
-    {
-        iter.first.Image->UpdateAccess(iter.first.Range, iter.second);
+        auto state = image->GetDeclaredState();
+        release(range, { StateToAccessMask(state), StateToShaderStageMask(state, true),
+                         StateToImageLayout(state) });
+        acquire.DstStages |= newAccess.Stages;
+        acquire.Images.push_back(image->shared_from_this());
+        return;
     }
+
+    auto& lastAccess = GetTrackedImage(image).LastAccess;
+    lastAccess.ForEachRun(range, release);
+    if (released.empty())
+        return;
+
+    acquire.DstStages |= newAccess.Stages;
+    acquire.Images.push_back(image->shared_from_this());
+    for (const auto& overlap : released)
+        lastAccess.Assign(overlap, newAccess);
 }
 
-void CAccessTracker::Merge(VkCommandBuffer cmdBuffer, const CAccessTracker& rhs)
+void CAccessTracker::ReleaseBuffer(VkCommandBuffer cmdBuffer, CBufferVk* buffer, size_t offset,
+                                   size_t size, const CAccessRecord& newAccess,
+                                   uint32_t srcFamily, uint32_t dstFamily,
+                                   COwnershipAcquireVk& acquire)
 {
-    for (const auto& iter : rhs.ImageFirstAccess)
-    {
-        if (iter.second.ImageLayout == VK_IMAGE_LAYOUT_UNDEFINED
-            || iter.second.ImageLayout == VK_IMAGE_LAYOUT_PREINITIALIZED)
-            continue;
-        auto* image = iter.first.Image;
-        const auto& range = iter.first.Range;
-        const auto& access = iter.second;
-        HandleImageFirstAccess(image, range, access);
-        HandleImageLastAccess(cmdBuffer, image, range, access);
-    }
-    for (const auto& iter : rhs.ImageLastAccess)
+    if (offset >= buffer->GetSize())
+        return;
+    CBufferRange range { buffer, offset, std::min(size, buffer->GetSize() - offset) };
+
+    std::vector<CBufferRange> released;
+    auto release = [&](const CBufferRange& overlap, const CAccessRecord& oldAccess) {
+        VkBufferMemoryBarrier barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+        barrier.srcAccessMask = oldAccess.AccessType;
+        barrier.dstAccessMask = 0;
+        barrier.srcQueueFamilyIndex = srcFamily;
+        barrier.dstQueueFamilyIndex = dstFamily;
+        barrier.buffer = buffer->GetHandle();
+        barrier.offset = overlap.Offset;
+        barrier.size = overlap.Size;
+        Barriers.Add(cmdBuffer, oldAccess.Stages, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, barrier);
+
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = newAccess.AccessType;
+        acquire.BufferBarriers.push_back(barrier);
+        released.push_back(overlap);
+    };
+
+    // Explicit-state buffers are in their declared state, which the handoff doesn't change
+    if (buffer->IsExplicitState())
     {
-        auto* image = iter.first.Image;
-        const auto& range = iter.first.Range;
-        HandleImageLastAccess(VK_NULL_HANDLE, image, range, iter.second);
+        auto state = buffer->GetDeclaredState();
+        release(range, { StateToAccessMask(state), StateToShaderStageMask(state, true),
+                         VK_IMAGE_LAYOUT_UNDEFINED });
+        acquire.DstStages |= newAccess.Stages;
+        return;
     }
+
+    BufferLastAccess.ForEachOverlap(range, release);
+    if (released.empty())
+        return;
+
+    acquire.DstStages |= newAccess.Stages;
+    for (const auto& overlap : released)
+        BufferLastAccess.Assign(overlap, newAccess);
 }
 
-void CAccessTracker::HandleImageFirstAccess(CImageVk* image, const CImageSubresourceRange& range,
-                                            const CAccessRecord& record)
+bool CAccessTracker::DeployAllBarriers(
+    VkCommandBuffer cmdBuffer, bool isComputeQueue,
+    const std::vector<std::shared_ptr<CSplitBarrierVk>>& splitWaits)
 {
-    auto iter = ImageFirstAccess.lower_bound(CImageRange { image, CImageSubresourceRange() });
-    if (iter == ImageFirstAccess.end() || iter->first.Image != image)
+    bool waitedOnEvent = false;
+    for (const auto& iter : Images)
     {
-        // This image is never accessed before
-        ImageFirstAccess.emplace(CImageRange { image, range }, record);
-        return;
+        CImageVk* image = iter.first;
+
+        // An event that was never set would be waited on forever. One that was set before some
+        //   other access to the image doesn't cover that access, it falls back to a barrier
+        std::vector<CSplitBarrierVk*> splits;
+        for (const auto& candidate : splitWaits)
+            if (candidate->Image == image && candidate->Stages && !candidate->bIsConsumed
+                && candidate->Generation == image->GetAccessGeneration())
+                splits.push_back(candidate.get());
+
+        // Transition the image to the needed state
+        iter.second.FirstAccess.ForEachRun(
+            iter.second.FirstAccess.GetWholeRange(),
+            [&](const CImageSubresourceRange& range, const CAccessRecord& record) {
+                if (record.ImageLayout == VK_IMAGE_LAYOUT_UNDEFINED
+                    || record.ImageLayout == VK_IMAGE_LAYOUT_PREINITIALIZED)
+                    return;
+                const CSplitBarrierVk* split = nullptr;
+                for (auto* candidate : splits)
+                    if (candidate->Range.Overlaps(range))
+                        split = candidate;
+                image->TransitionAccess(cmdBuffer, range, record, isComputeQueue, split,
+                                        &Barriers);
+            });
+        // The access below moves the image past the events
+        for (auto* split : splits)
+            split->bIsConsumed = true;
+        waitedOnEvent |= !splits.empty();
+
+        iter.second.LastAccess.ForEachRun(
+            iter.second.LastAccess.GetWholeRange(),
+            [&](const CImageSubresourceRange& range, const CAccessRecord& record) {
+                image->UpdateAccess(range, record);
+            });
     }
+    BufferFirstAccess.ForEach([&](const CBufferRange& range, const CAccessRecord& record) {
+        range.Buffer->TransitionAccess(cmdBuffer, range.Offset, range.Size, record, isComputeQueue,
+                                       &Barriers);
+    });
+    BufferLastAccess.ForEach([&](const CBufferRange& range, const CAccessRecord& record) {
+        range.Buffer->UpdateAccess(range.Offset, range.Size, record);
+    });
+    Barriers.Flush(cmdBuffer);
+    return waitedOnEvent;
+}
 
-    // Rules for access record updating: for each subresource, first access should not change
-    //   but last access should always change
-    while (iter != ImageFirstAccess.end() && iter->first.Image == image)
+void CAccessTracker::Merge(VkCommandBuffer cmdBuffer, const CAccessTracker& rhs)
+{
+    for (const auto& iter : rhs.Images)
     {
-        if (!range.Overlaps(iter->first.Range))
-        {
-            iter++;
-            continue;
-        }
-
-        // Calculate the overlapping region, vertical axis is miplevel
-        uint32_t top, bottom, left, right;
-        CalcOverlap(range, iter->first.Range, top, bottom, left, right);
-
-        // Split the new region into 4 and recursively add them into the record store
-        uint32_t myTop = range.BaseMipLevel;
-        uint32_t myLeft = range.BaseArrayLayer;
-        uint32_t myBottom = myTop + range.LevelCount - 1;
-        uint32_t myRight = myLeft + range.LayerCount - 1;
+        CImageVk* image = iter.first;
+        iter.second.FirstAccess.ForEachRun(
+            iter.second.FirstAccess.GetWholeRange(),
+            [&](const CImageSubresourceRange& range, const CAccessRecord& record) {
+                if (record.ImageLayout == VK_IMAGE_LAYOUT_UNDEFINED
+                    || record.ImageLayout == VK_IMAGE_LAYOUT_PREINITIALIZED)
+                    return;
+                HandleImageFirstAccess(image, range, record);
+                HandleImageLastAccess(cmdBuffer, image, range, record);
+            });
+        iter.second.LastAccess.ForEachRun(
+            iter.second.LastAccess.GetWholeRange(),
+            [&](const CImageSubresourceRange& range, const CAccessRecord& record) {
+                HandleImageLastAccess(VK_NULL_HANDLE, image, range, record);
+            });
+    }
+    rhs.BufferFirstAccess.ForEach([&](const CBufferRange& range, const CAccessRecord& record) {
+        BufferFirstAccess.AssignUntracked(range, record);
+        HandleBufferLastAccess(cmdBuffer, range, record);
+    });
+    rhs.BufferLastAccess.ForEach([&](const CBufferRange& range, const CAccessRecord& record) {
+        HandleBufferLastAccess(VK_NULL_HANDLE, range, record);
+    });
+    if (cmdBuffer)
+        Barriers.Flush(cmdBuffer);
+}
 
-        // If completely overlap, we don't need to do anything
-        if (top == myTop && bottom == myBottom && left == myLeft && right == myRight)
-            return;
+const CImageAccessMap* CAccessTracker::GetFirstAccess(CImageVk* image) const
+{
+    auto iter = Images.find(image);
+    return iter == Images.end() ? nullptr : &iter->second.FirstAccess;
+}
 
-        /*
-         2 | 1
-        -------
-         3 | 4
-        */
-        uint32_t overlappingQuadrant;
-        uint32_t midVertical, midHorizontal;
-        if (top == myTop)
-        {
-            midVertical = bottom;
-            if (left == myLeft)
-            {
-                midHorizontal = right;
-                overlappingQuadrant = 2;
-            }
-            else
-            {
-                midHorizontal = left - 1;
-                overlappingQuadrant = 1;
-            }
-        }
-        else
-        {
-            midVertical = top - 1;
-            if (left == myLeft)
-            {
-                midHorizontal = right;
-                overlappingQuadrant = 3;
-            }
-            else
-            {
-                midHorizontal = left - 1;
-                overlappingQuadrant = 4;
-            }
-        }
+const CImageAccessMap* CAccessTracker::GetLastAccess(CImageVk* image) const
+{
+    auto iter = Images.find(image);
+    return iter == Images.end() ? nullptr : &iter->second.LastAccess;
+}
 
-        // Recursively add the non-overlapping regions
-        if (overlappingQuadrant != 2)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = myTop;
-            quadRange.LevelCount = midVertical - myTop + 1;
-            quadRange.BaseArrayLayer = myLeft;
-            quadRange.LayerCount = midHorizontal - myLeft + 1;
-            // This if statement handles degenerate quads
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                HandleImageFirstAccess(image, quadRange, record);
-        }
-        if (overlappingQuadrant != 1)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = myTop;
-            quadRange.LevelCount = midVertical - myTop + 1;
-            quadRange.BaseArrayLayer = midHorizontal + 1;
-            quadRange.LayerCount = myRight - midHorizontal;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                HandleImageFirstAccess(image, quadRange, record);
-        }
-        if (overlappingQuadrant != 3)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = midVertical + 1;
-            quadRange.LevelCount = myBottom - midVertical;
-            quadRange.BaseArrayLayer = myLeft;
-            quadRange.LayerCount = midHorizontal - myLeft + 1;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                HandleImageFirstAccess(image, quadRange, record);
-        }
-        if (overlappingQuadrant != 4)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = midVertical + 1;
-            quadRange.LevelCount = myBottom - midVertical;
-            quadRange.BaseArrayLayer = midHorizontal + 1;
-            quadRange.LayerCount = myRight - midHorizontal;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                HandleImageFirstAccess(image, quadRange, record);
-        }
-        return;
+CAccessTracker::CTrackedImage& CAccessTracker::GetTrackedImage(CImageVk* image)
+{
+    auto iter = Images.find(image);
+    if (iter == Images.end())
+    {
+        iter = Images.emplace(image, CTrackedImage()).first;
+        uint32_t mipLevels = image->GetMipLevels();
+        uint32_t arrayLayers = image->GetArrayLayers();
+        iter->second.FirstAccess.Reset(mipLevels, arrayLayers, CAccessRecord::Untracked());
+        iter->second.LastAccess.Reset(mipLevels, arrayLayers, CAccessRecord::Untracked());
     }
-    // We insert the whole range if we've found no overlapping
-    ImageFirstAccess.emplace(CImageRange { image, range }, record);
+    return iter->second;
+}
+
+void CAccessTracker::HandleImageFirstAccess(CImageVk* image, const CImageSubresourceRange& range,
+                                            const CAccessRecord& record)
+{
+    // For each subresource, first access should not change but last access should always change
+    GetTrackedImage(image).FirstAccess.AssignUntracked(range, record);
 }
 
 void CAccessTracker::HandleImageLastAccess(VkCommandBuffer cmdBuffer, CImageVk* image,
                                            const CImageSubresourceRange& range,
                                            const CAccessRecord& record)
 {
-    auto iter = ImageLastAccess.lower_bound(CImageRange { image, CImageSubresourceRange() });
-    if (iter == ImageLastAccess.end() || iter->first.Image != image)
-    {
-        // This image is never accessed before
-        ImageLastAccess.emplace(CImageRange { image, range }, record);
-        return;
-    }
-
-    while (iter != ImageLastAccess.end() && iter->first.Image == image)
-    {
-        if (!range.Overlaps(iter->first.Range))
-        {
-            iter++;
-            continue;
-        }
-
-        // Calculate the overlapping region, vertical axis is miplevel
-        uint32_t top, bottom, left, right;
-        CalcOverlap(range, iter->first.Range, top, bottom, left, right);
-
-        // Go ahead and transition the overlapping region
-        if (cmdBuffer)
-        {
-            CImageSubresourceRange overlapRange;
-            overlapRange.BaseMipLevel = top;
-            overlapRange.LevelCount = bottom - top + 1;
-            overlapRange.BaseArrayLayer = left;
-            overlapRange.LayerCount = right - left + 1;
-            InsertImageBarrier(cmdBuffer, image, overlapRange, iter->second, record);
-        }
-
-        // Split the old region into 4 and remove the overlapping one from the store
-        // NOTE: my* is actually iter
-        uint32_t myTop = iter->first.Range.BaseMipLevel;
-        uint32_t myLeft = iter->first.Range.BaseArrayLayer;
-        uint32_t myBottom = myTop + iter->first.Range.LevelCount - 1;
-        uint32_t myRight = myLeft + iter->first.Range.LayerCount - 1;
-
-        // Erase the region right now, we are gonna add the non-overlapping quadrants back in
-        CAccessRecord myAccess = iter->second;
-        ImageLastAccess.erase(iter++);
-
-        // No need to continue if the target region is completely contained
-        if (top == myTop && bottom == myBottom && left == myLeft && right == myRight)
-            continue;
-
-        /*
-         2 | 1
-        -------
-         3 | 4
-        */
-        uint32_t overlappingQuadrant;
-        uint32_t midVertical, midHorizontal;
-        if (top == myTop)
-        {
-            midVertical = bottom;
-            if (left == myLeft)
-            {
-                midHorizontal = right;
-                overlappingQuadrant = 2;
-            }
-            else
-            {
-                midHorizontal = left - 1;
-                overlappingQuadrant = 1;
-            }
-        }
-        else
-        {
-            midVertical = top - 1;
-            if (left == myLeft)
-            {
-                midHorizontal = right;
-                overlappingQuadrant = 3;
-            }
-            else
-            {
-                midHorizontal = left - 1;
-                overlappingQuadrant = 4;
-            }
-        }
+    auto& lastAccess = GetTrackedImage(image).LastAccess;
+    if (cmdBuffer)
+        lastAccess.ForEachRun(range,
+                              [&](const CImageSubresourceRange& overlap,
+                                  const CAccessRecord& oldAccess) {
+                                  InsertImageBarrier(cmdBuffer, image, overlap, oldAccess, record,
+                                                     nullptr, &Barriers);
+                              });
+    lastAccess.Assign(range, record);
+}
 
-        // Add the non-overlapping regions back in
-        if (overlappingQuadrant != 2)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = myTop;
-            quadRange.LevelCount = midVertical - myTop + 1;
-            quadRange.BaseArrayLayer = myLeft;
-            quadRange.LayerCount = midHorizontal - myLeft + 1;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                ImageLastAccess.emplace(CImageRange { image, quadRange }, myAccess);
-        }
-        if (overlappingQuadrant != 1)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = myTop;
-            quadRange.LevelCount = midVertical - myTop + 1;
-            quadRange.BaseArrayLayer = midHorizontal + 1;
-            quadRange.LayerCount = myRight - midHorizontal;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                ImageLastAccess.emplace(CImageRange { image, quadRange }, myAccess);
-        }
-        if (overlappingQuadrant != 3)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = midVertical + 1;
-            quadRange.LevelCount = myBottom - midVertical;
-            quadRange.BaseArrayLayer = myLeft;
-            quadRange.LayerCount = midHorizontal - myLeft + 1;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                ImageLastAccess.emplace(CImageRange { image, quadRange }, myAccess);
-        }
-        if (overlappingQuadrant != 4)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = midVertical + 1;
-            quadRange.LevelCount = myBottom - midVertical;
-            quadRange.BaseArrayLayer = midHorizontal + 1;
-            quadRange.LayerCount = myRight - midHorizontal;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                ImageLastAccess.emplace(CImageRange { image, quadRange }, myAccess);
-        }
-    }
-    // We insert the whole range if we've found no overlapping
-    ImageLastAccess.emplace(CImageRange { image, range }, record);
+void CAccessTracker::HandleBufferLastAccess(VkCommandBuffer cmdBuffer, const CBufferRange& range,
+                                            const CAccessRecord& record)
+{
+    if (cmdBuffer)
+        BufferLastAccess.ForEachOverlap(
+            range, [&](const CBufferRange& overlap, const CAccessRecord& oldAccess) {
+                InsertBufferBarrier(cmdBuffer, overlap, oldAccess, record, &Barriers);
+            });
+    BufferLastAccess.Assign(range, record);
 }
 
 }
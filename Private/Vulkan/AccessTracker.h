@@ -2,7 +2,10 @@
 #include "Resources.h"
 #include "VkCommon.h"
 #include "VkHelpers.h"
+#include <algorithm>
 #include <map>
+#include <unordered_map>
+#include <vector>
 
 namespace RHI
 {
@@ -39,51 +42,274 @@ struct CBufferRange
     }
 };
 
-struct CImageRange
+struct CAccessRecord
 {
-    CImageVk* Image;
-    CImageSubresourceRange Range;
+    VkAccessFlags AccessType;
+    VkPipelineStageFlags Stages;
+    VkImageLayout ImageLayout;
 
-    bool operator<(const CImageRange& rhs) const
+    bool IsRead() const;
+    bool IsWrite() const;
+
+    // Placeholder for the subresources a tracker hasn't seen
+    static CAccessRecord Untracked() { return { 0, 0, VK_IMAGE_LAYOUT_MAX_ENUM }; }
+    bool IsUntracked() const { return ImageLayout == VK_IMAGE_LAYOUT_MAX_ENUM; }
+
+    bool operator==(const CAccessRecord& rhs) const
     {
-        if (Image < rhs.Image)
-            return true;
-        if (Image > rhs.Image)
-            return false;
-        if (Range < rhs.Range)
-            return true;
-        return false;
+        return AccessType == rhs.AccessType && Stages == rhs.Stages
+            && ImageLayout == rhs.ImageLayout;
+    }
+    bool operator!=(const CAccessRecord& rhs) const { return !(*this == rhs); }
+};
+
+// Access records of every mip and layer of one image. While the whole image is in one state only
+//   that record is kept, otherwise a dense mip-major table
+class CImageAccessMap
+{
+public:
+    void Reset(uint32_t mipLevels, uint32_t arrayLayers, const CAccessRecord& record);
+    bool IsEmpty() const { return MipLevels == 0; }
+    CImageSubresourceRange GetWholeRange() const;
+
+    void Assign(const CImageSubresourceRange& range, const CAccessRecord& record);
+    // Like Assign, but leaves the subresources that are already tracked alone
+    void AssignUntracked(const CImageSubresourceRange& range, const CAccessRecord& record);
+
+    // Calls fn(range, record) for each rectangle of identical tracked records within range.
+    //   Identical layer runs are merged, and so are consecutive mips that look the same
+    template <typename TFn> void ForEachRun(const CImageSubresourceRange& range, TFn&& fn) const;
+
+private:
+    void Expand();
+    void TryCollapse(const CAccessRecord& record);
+    bool IsRowEqual(uint32_t mipA, uint32_t mipB, uint32_t layerBegin, uint32_t layerEnd) const;
+    template <typename TFn>
+    void EmitRow(uint32_t mip, uint32_t mipCount, uint32_t layerBegin, uint32_t layerEnd,
+                 TFn&& fn) const;
+
+    uint32_t MipLevels = 0;
+    uint32_t ArrayLayers = 0;
+    CAccessRecord Uniform = CAccessRecord::Untracked();
+    std::vector<CAccessRecord> Records; // [mip * ArrayLayers + layer], empty while uniform
+};
+
+template <typename TFn>
+void CImageAccessMap::ForEachRun(const CImageSubresourceRange& range, TFn&& fn) const
+{
+    uint32_t mipEnd = std::min(range.BaseMipLevel + range.LevelCount, MipLevels);
+    uint32_t layerEnd = std::min(range.BaseArrayLayer + range.LayerCount, ArrayLayers);
+    if (range.BaseMipLevel >= mipEnd || range.BaseArrayLayer >= layerEnd)
+        return;
+
+    if (Records.empty())
+    {
+        if (!Uniform.IsUntracked())
+        {
+            CImageSubresourceRange clipped;
+            clipped.Set(range.BaseMipLevel, mipEnd - range.BaseMipLevel, range.BaseArrayLayer,
+                        layerEnd - range.BaseArrayLayer);
+            fn(clipped, Uniform);
+        }
+        return;
+    }
+
+    // A block of mips whose rows are identical goes out as the runs of its first row
+    uint32_t blockBegin = range.BaseMipLevel;
+    for (uint32_t mip = blockBegin + 1; mip < mipEnd; mip++)
+    {
+        if (IsRowEqual(blockBegin, mip, range.BaseArrayLayer, layerEnd))
+            continue;
+        EmitRow(blockBegin, mip - blockBegin, range.BaseArrayLayer, layerEnd, fn);
+        blockBegin = mip;
+    }
+    EmitRow(blockBegin, mipEnd - blockBegin, range.BaseArrayLayer, layerEnd, fn);
+}
+
+template <typename TFn>
+void CImageAccessMap::EmitRow(uint32_t mip, uint32_t mipCount, uint32_t layerBegin,
+                              uint32_t layerEnd, TFn&& fn) const
+{
+    const CAccessRecord* row = Records.data() + mip * ArrayLayers;
+    uint32_t runBegin = layerBegin;
+    for (uint32_t layer = layerBegin + 1; layer <= layerEnd; layer++)
+    {
+        if (layer < layerEnd && row[layer] == row[runBegin])
+            continue;
+        if (!row[runBegin].IsUntracked())
+        {
+            CImageSubresourceRange run;
+            run.Set(mip, mipCount, runBegin, layer - runBegin);
+            fn(run, row[runBegin]);
+        }
+        runBegin = layer;
+    }
+}
+
+// Non-overlapping buffer ranges and their access records. Neighbours with the same record are
+//   merged into one range
+class CBufferAccessMap
+{
+public:
+    bool IsEmpty() const { return Ranges.empty(); }
+    void Clear() { Ranges.clear(); }
+
+    void Assign(const CBufferRange& range, const CAccessRecord& record);
+    // Like Assign, but only fills the gaps that aren't tracked yet
+    void AssignUntracked(const CBufferRange& range, const CAccessRecord& record);
+
+    // Calls fn(range, record) for each tracked range overlapping range, clipped to it
+    template <typename TFn> void ForEachOverlap(const CBufferRange& range, TFn&& fn) const;
+    template <typename TFn> void ForEach(TFn&& fn) const
+    {
+        for (const auto& iter : Ranges)
+            fn(iter.first, iter.second);
     }
 
-    bool operator==(const CImageRange& rhs) const
+private:
+    // Lower bound key of the first tracked range overlapping range
+    CBufferRange FirstOverlapKey(const CBufferRange& range) const;
+
+    std::map<CBufferRange, CAccessRecord> Ranges;
+};
+
+template <typename TFn>
+void CBufferAccessMap::ForEachOverlap(const CBufferRange& range, TFn&& fn) const
+{
+    size_t end = range.Offset + range.Size;
+    for (auto iter = Ranges.lower_bound(FirstOverlapKey(range));
+         iter != Ranges.end() && iter->first.Buffer == range.Buffer && iter->first.Offset < end;
+         ++iter)
     {
-        return Image == rhs.Image && Range == rhs.Range;
+        CBufferRange clipped = iter->first;
+        clipped.Offset = std::max(clipped.Offset, range.Offset);
+        clipped.Size = std::min(iter->first.Offset + iter->first.Size, end) - clipped.Offset;
+        fn(clipped, iter->second);
     }
+}
+
+// A barrier started by one command list with an event and finished by a later one on the queue.
+//   The event only stands for the access it was set after, so the waiter may use it once, and only
+//   while the image is still in that access
+struct CSplitBarrierVk
+{
+    VkEvent Event = VK_NULL_HANDLE;
+    CImageView::Ref ImageView; // Holds the image alive
+    CImageVk* Image;
+    CImageSubresourceRange Range;
+    VkPipelineStageFlags Stages = 0; // What the event was set with, zero until it is
+    uint64_t Generation = 0; // Access generation of the image when the event was set
+    bool bIsConsumed = false;
 };
 
-struct CAccessRecord
+// The acquire halves of queue family ownership transfers. The release halves are the same
+//   barriers, recorded by the giving queue before it signals the semaphore
+struct COwnershipAcquireVk
 {
-    VkAccessFlags AccessType;
-    VkPipelineStageFlags Stages;
-    VkImageLayout ImageLayout;
+    VkSemaphore Semaphore = VK_NULL_HANDLE;
+    VkPipelineStageFlags DstStages = 0;
+    std::vector<VkImageMemoryBarrier> ImageBarriers;
+    std::vector<VkBufferMemoryBarrier> BufferBarriers;
+    std::vector<CImage::Ref> Images; // Holds the images alive until the acquire is recorded
+};
 
-    bool IsRead() const;
-    bool IsWrite() const;
+struct CBarrierCounters
+{
+    uint32_t Requested = 0; // vkCmdPipelineBarrier calls there would be without batching
+    uint32_t Issued = 0;
+};
+
+// Where the barrier commands of the trackers end up. The default one calls into the driver, a test
+//   can put in one that keeps the calls instead
+class CBarrierRecorderVk
+{
+public:
+    virtual ~CBarrierRecorderVk() = default;
+
+    virtual void PipelineBarrier(VkCommandBuffer cmdBuffer, VkPipelineStageFlags srcStages,
+                                 VkPipelineStageFlags dstStages, uint32_t bufferBarrierCount,
+                                 const VkBufferMemoryBarrier* bufferBarriers,
+                                 uint32_t imageBarrierCount,
+                                 const VkImageMemoryBarrier* imageBarriers);
+#ifdef VK_KHR_synchronization2
+    virtual void PipelineBarrier2(VkCommandBuffer cmdBuffer,
+                                  const VkDependencyInfoKHR& dependencyInfo);
+#endif
+    // One event, and the image barrier that goes with it if any
+    virtual void WaitEvent(VkCommandBuffer cmdBuffer, VkEvent event,
+                           VkPipelineStageFlags srcStages, VkPipelineStageFlags dstStages,
+                           const VkImageMemoryBarrier* imageBarrier);
+};
+
+// Holds barriers back so that everything between two commands goes out in one call. The legacy
+//   vkCmdPipelineBarrier ORs the stage masks together, with VK_KHR_synchronization2 each barrier
+//   keeps its own
+class CBarrierBatchVk
+{
+public:
+#ifdef VK_KHR_synchronization2
+    // Set by the device when the extension is enabled, otherwise the legacy path is used
+    static void SetPipelineBarrier2(PFN_vkCmdPipelineBarrier2KHR fn) { PipelineBarrier2 = fn; }
+#endif
+    // Not thread safe, swap it before any recording starts. Null puts the driver back
+    static void SetRecorder(CBarrierRecorderVk* recorder);
+    static CBarrierRecorderVk& GetRecorder() { return *Recorder; }
+
+    // Flushes first if a pending barrier touches the same subresources
+    void Add(VkCommandBuffer cmdBuffer, VkPipelineStageFlags srcStages,
+             VkPipelineStageFlags dstStages, const VkImageMemoryBarrier* imageBarrier);
+    void Add(VkCommandBuffer cmdBuffer, VkPipelineStageFlags srcStages,
+             VkPipelineStageFlags dstStages, const VkBufferMemoryBarrier& bufferBarrier);
+    void Flush(VkCommandBuffer cmdBuffer);
+
+    bool IsEmpty() const { return SrcStages == 0; }
+    const CBarrierCounters& GetCounters() const { return Counters; }
+
+private:
+    struct CStageMasks
+    {
+        VkPipelineStageFlags Src;
+        VkPipelineStageFlags Dst;
+    };
+
+    friend class CBarrierRecorderVk;
+
+#ifdef VK_KHR_synchronization2
+    void FlushSynchronization2(VkCommandBuffer cmdBuffer);
+
+    static PFN_vkCmdPipelineBarrier2KHR PipelineBarrier2;
+#endif
+    static CBarrierRecorderVk* Recorder;
+
+    VkPipelineStageFlags SrcStages = 0;
+    VkPipelineStageFlags DstStages = 0;
+    std::vector<CStageMasks> ExecutionBarriers;
+    std::vector<VkBufferMemoryBarrier> BufferBarriers;
+    std::vector<CStageMasks> BufferStages;
+    std::vector<VkImageMemoryBarrier> ImageBarriers;
+    std::vector<CStageMasks> ImageStages;
+    CBarrierCounters Counters;
 };
 
 // Tracks resource access for a certain time period (usually a command buffer)
 class CAccessTracker
 {
 public:
-    static bool CalcOverlap(const CImageSubresourceRange& range1,
-                            const CImageSubresourceRange& range2, uint32_t& top, uint32_t& bottom,
-                            uint32_t& left, uint32_t& right);
+    // With an event, waits for it instead of placing a pipeline barrier. With a batch, the
+    //   pipeline barrier is only queued up
     static void InsertImageBarrier(VkCommandBuffer cmdBuffer, CImageVk* image,
                                    const CImageSubresourceRange& range,
-                                   const CAccessRecord& oldAccess, const CAccessRecord& newAccess);
+                                   const CAccessRecord& oldAccess, const CAccessRecord& newAccess,
+                                   const CSplitBarrierVk* split = nullptr,
+                                   CBarrierBatchVk* batch = nullptr);
+    static void InsertBufferBarrier(VkCommandBuffer cmdBuffer, const CBufferRange& range,
+                                    const CAccessRecord& oldAccess, const CAccessRecord& newAccess,
+                                    CBarrierBatchVk* batch = nullptr);
+    // What is left of a last access once the compute queue waited for the render queue
+    static CAccessRecord ForComputeQueue(const CAccessRecord& lastAccess);
 
-    void TransitionBuffer(CBufferVk* buffer, size_t offset, size_t size, VkAccessFlags access,
-                          VkPipelineStageFlags stages);
+    void TransitionBuffer(VkCommandBuffer cmdBuffer, CBufferVk* buffer, size_t offset,
+                          size_t size, VkAccessFlags access, VkPipelineStageFlags stages);
     void TransitionImageState(VkCommandBuffer cmdBuffer, CImageVk* image,
                               const CImageSubresourceRange& range, EResourceState targetState,
                               bool isTransferQueue = false);
@@ -91,29 +317,56 @@ public:
                          const CImageSubresourceRange& range, VkAccessFlags access,
                          VkPipelineStageFlags stages, VkImageLayout layout);
 
-    void DeployAllBarriers(VkCommandBuffer cmdBuffer);
+    // Give up what this tracker has seen of a range to another queue family. The acquire half is
+    //   added to acquire, and the range is left in newAccess as the receiving queue sees it
+    void ReleaseImage(VkCommandBuffer cmdBuffer, CImageVk* image,
+                      const CImageSubresourceRange& range, const CAccessRecord& newAccess,
+                      uint32_t srcFamily, uint32_t dstFamily, COwnershipAcquireVk& acquire);
+    void ReleaseBuffer(VkCommandBuffer cmdBuffer, CBufferVk* buffer, size_t offset, size_t size,
+                       const CAccessRecord& newAccess, uint32_t srcFamily, uint32_t dstFamily,
+                       COwnershipAcquireVk& acquire);
+
+    // Returns whether a split barrier was waited on, those don't go through the batch
+    bool DeployAllBarriers(VkCommandBuffer cmdBuffer, bool isComputeQueue = false,
+                           const std::vector<std::shared_ptr<CSplitBarrierVk>>& splitWaits = {});
 
     // Merge two access trackers together, and record the intermediate transitions
     void Merge(VkCommandBuffer cmdBuffer, const CAccessTracker& rhs);
 
+    // Must happen before the command buffer records anything that relies on the transitions
+    void FlushBarriers(VkCommandBuffer cmdBuffer) { Barriers.Flush(cmdBuffer); }
+    const CBarrierCounters& GetBarrierCounters() const { return Barriers.GetCounters(); }
+
+    // What the tracker has seen of an image so far, null if it hasn't seen the image at all
+    const CImageAccessMap* GetFirstAccess(CImageVk* image) const;
+    const CImageAccessMap* GetLastAccess(CImageVk* image) const;
+
     void Clear()
     {
-        ImageFirstAccess.clear();
-        ImageLastAccess.clear();
+        Images.clear();
+        BufferFirstAccess.Clear();
+        BufferLastAccess.Clear();
     }
 
 private:
+    struct CTrackedImage
+    {
+        CImageAccessMap FirstAccess;
+        CImageAccessMap LastAccess;
+    };
+
+    CTrackedImage& GetTrackedImage(CImageVk* image);
     void HandleImageFirstAccess(CImageVk* image, const CImageSubresourceRange& range,
                                 const CAccessRecord& record);
     void HandleImageLastAccess(VkCommandBuffer cmdBuffer, CImageVk* image,
                                const CImageSubresourceRange& range, const CAccessRecord& record);
+    void HandleBufferLastAccess(VkCommandBuffer cmdBuffer, const CBufferRange& range,
+                                const CAccessRecord& record);
 
-    // Not tracking buffers for now
-    // std::map<CBufferRange, CAccessRecord> BufferFirstAccess;
-    // std::map<CBufferRange, CAccessRecord> BufferLastAccess;
-
-    std::map<CImageRange, CAccessRecord> ImageFirstAccess;
-    std::map<CImageRange, CAccessRecord> ImageLastAccess;
+    CBufferAccessMap BufferFirstAccess;
+    CBufferAccessMap BufferLastAccess;
+    std::unordered_map<CImageVk*, CTrackedImage> Images;
+    CBarrierBatchVk Barriers;
 };
 
 }
@@ -1,6 +1,7 @@
 #include "BufferVk.h"
 #include "DeviceVk.h"
 
+#include <algorithm>
 #include <cstring>
 
 namespace RHI
@@ -55,7 +56,23 @@ CBufferVk::CBufferVk(CDeviceVk& p, size_t size, EBufferUsageFlags usage, const v
         allocInfo.usage = VMA_MEMORY_USAGE_GPU_TO_CPU;
     }
 
+    // Graph passes on a separate compute queue use the buffers too. Uploads are exclusive, they
+    //   are written on the copy queue and released to the render queue below
+    uint32_t sharingFamilies[2];
+    uint32_t sharingFamilyCount =
+        Parent.GetSharingFamilies(initialData && gpuOnly, sharingFamilies);
+    if (sharingFamilyCount > 1)
+    {
+        bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        bufferInfo.queueFamilyIndexCount = sharingFamilyCount;
+        bufferInfo.pQueueFamilyIndices = sharingFamilies;
+        bIsConcurrentAccess = true;
+    }
+
     vmaCreateBuffer(Parent.GetAllocator(), &bufferInfo, &allocInfo, &Buffer, &Allocation, nullptr);
+    LastAccess.Assign(CBufferRange { this, 0, size },
+                      CAccessRecord { 0, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                      VK_IMAGE_LAYOUT_UNDEFINED });
 
     if (initialData && gpuOnly)
     {
@@ -83,11 +100,16 @@ CBufferVk::CBufferVk(CDeviceVk& p, size_t size, EBufferUsageFlags usage, const v
         cmdList->Enqueue();
         auto ctx = std::static_pointer_cast<CCommandContextVk>(cmdList->CreateCopyContext());
         auto cmdBuffer = ctx->GetCmdBuffer();
+        ctx->TransitionBuffer(*this, 0, size, VK_ACCESS_TRANSFER_WRITE_BIT,
+                              VK_PIPELINE_STAGE_TRANSFER_BIT);
         VkBufferCopy copy;
         copy.srcOffset = 0;
         copy.dstOffset = 0;
         copy.size = size;
         vkCmdCopyBuffer(cmdBuffer, stagingBuffer, Buffer, 1, &copy);
+        // We don't know what the buffer is read as, so the render queue gets all of it
+        ctx->ReleaseBuffer(*this, 0, size, VK_ACCESS_MEMORY_READ_BIT,
+                           VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, *Parent.GetDefaultRenderQueue());
         ctx->FinishRecording();
         cmdList->Commit();
         Parent.GetDefaultCopyQueue()->Flush();
@@ -103,6 +125,9 @@ CBufferVk::CBufferVk(CDeviceVk& p, size_t size, EBufferUsageFlags usage, const v
         memcpy(mappedData, initialData, size);
         vmaUnmapMemory(Parent.GetAllocator(), Allocation);
     }
+
+    if (Any(usage, EBufferUsageFlags::ExplicitState))
+        DeclareState(EResourceState::General);
 }
 
 CBufferVk::~CBufferVk()
@@ -121,6 +146,66 @@ void* CBufferVk::Map(size_t offset, size_t size)
 
 void CBufferVk::Unmap() { vmaUnmapMemory(Parent.GetAllocator(), Allocation); }
 
+void CBufferVk::TransitionAccess(VkCommandBuffer cmdBuffer, size_t offset, size_t size,
+                                 const CAccessRecord& accessRecord, bool isComputeQueue,
+                                 CBarrierBatchVk* batch)
+{
+    LastAccess.ForEachOverlap(
+        CBufferRange { this, offset, size },
+        [&](const CBufferRange& overlap, const CAccessRecord& record) {
+            CAccessRecord lastAccess =
+                isComputeQueue ? CAccessTracker::ForComputeQueue(record) : record;
+            CAccessTracker::InsertBufferBarrier(cmdBuffer, overlap, lastAccess, accessRecord,
+                                                batch);
+        });
+}
+
+void CBufferVk::UpdateAccess(size_t offset, size_t size, const CAccessRecord& accessRecord)
+{
+    LastAccess.Assign(CBufferRange { this, offset, size }, accessRecord);
+}
+
+void CBufferVk::ReleaseAccess(VkCommandBuffer cmdBuffer, size_t offset, size_t size,
+                              uint32_t srcFamily, uint32_t dstFamily,
+                              COwnershipAcquireVk& acquire, CBarrierBatchVk* batch)
+{
+    if (offset >= Size)
+        return;
+    CBarrierBatchVk immediate;
+    if (!batch)
+        batch = &immediate;
+
+    auto release = [&](const CBufferRange& overlap, const CAccessRecord& record) {
+        VkBufferMemoryBarrier barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+        barrier.srcAccessMask = record.AccessType;
+        barrier.dstAccessMask = 0;
+        barrier.srcQueueFamilyIndex = srcFamily;
+        barrier.dstQueueFamilyIndex = dstFamily;
+        barrier.buffer = Buffer;
+        barrier.offset = overlap.Offset;
+        barrier.size = overlap.Size;
+        batch->Add(cmdBuffer, record.Stages, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, barrier);
+
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+        acquire.BufferBarriers.push_back(barrier);
+    };
+
+    CBufferRange range { this, offset, std::min(size, Size - offset) };
+    if (IsExplicitState())
+        release(range, { StateToAccessMask(DeclaredState),
+                         StateToShaderStageMask(DeclaredState, true),
+                         VK_IMAGE_LAYOUT_UNDEFINED });
+    else
+    {
+        LastAccess.ForEachOverlap(range, release);
+        LastAccess.Assign(range, { 0, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                                   VK_IMAGE_LAYOUT_UNDEFINED });
+    }
+    immediate.Flush(cmdBuffer);
+    acquire.DstStages |= VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+}
+
 CPersistentMappedRingBuffer::CPersistentMappedRingBuffer(CDeviceVk& p, size_t size,
                                                          VkBufferUsageFlags usage)
     : Parent(p)
@@ -1,4 +1,5 @@
 #pragma once
+#include "AccessTracker.h"
 #include "Resources.h"
 #include "VkCommon.h"
 #include <queue>
@@ -15,12 +16,40 @@ public:
     ~CBufferVk() override;
 
     const VkBuffer& GetHandle() const { return Buffer; }
+    size_t GetSize() const { return Size; }
 
     void* Map(size_t offset, size_t size);
     void Unmap();
 
+    // Access tracking for barrier deduction, same as CImageVk
+    void TransitionAccess(VkCommandBuffer cmdBuffer, size_t offset, size_t size,
+                          const CAccessRecord& accessRecord, bool isComputeQueue = false,
+                          CBarrierBatchVk* batch = nullptr);
+    void UpdateAccess(size_t offset, size_t size, const CAccessRecord& accessRecord);
+    // Hands a range of an exclusive buffer over to dstFamily, see CImageVk::ReleaseAccess
+    void ReleaseAccess(VkCommandBuffer cmdBuffer, size_t offset, size_t size, uint32_t srcFamily,
+                       uint32_t dstFamily, COwnershipAcquireVk& acquire,
+                       CBarrierBatchVk* batch = nullptr);
+
+    bool IsExplicitState() const { return bIsExplicitState; }
+    EResourceState GetDeclaredState() const { return DeclaredState; }
+    void DeclareState(EResourceState state)
+    {
+        bIsExplicitState = true;
+        DeclaredState = state;
+    }
+
+    // Shared by render and compute, see CDeviceVk::GetSharingFamilies
+    bool IsConcurrentAccess() const { return bIsConcurrentAccess; }
+
 private:
     CDeviceVk& Parent;
+    bool bIsConcurrentAccess = false;
+
+    // Only touched on submission, with the device's resource state lock held
+    CBufferAccessMap LastAccess;
+    bool bIsExplicitState = false;
+    EResourceState DeclaredState = EResourceState::Undefined;
 
     VkBuffer Buffer;
     VmaAllocation Allocation;
@@ -1,6 +1,7 @@
 #include "CommandBufferVk.h"
 #include "DeviceVk.h"
 #include "RenderPassVk.h"
+#include <algorithm>
 
 namespace RHI
 {
@@ -8,7 +9,6 @@ namespace RHI
 CCommandPoolVk::CCommandPoolVk(CDeviceVk& p, EQueueType queueType, bool resetIndividualBuffer)
     : Parent(p)
     , bResetIndividualBuffer(resetIndividualBuffer)
-    , bCanAllocateFromFreedList(false)
 {
     VkCommandPoolCreateInfo ci = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
     ci.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
@@ -22,32 +22,37 @@ CCommandPoolVk::~CCommandPoolVk() { vkDestroyCommandPool(Parent.GetVkDevice(), H
 
 std::unique_ptr<CCommandBufferVk> CCommandPoolVk::AllocateCommandBuffer(bool secondary)
 {
-    if (bResetIndividualBuffer || !bCanAllocateFromFreedList)
-        return std::make_unique<CCommandBufferVk>(shared_from_this(), secondary);
-
     std::unique_lock<tc::FSpinLock> lk(BufferListLock);
-    if (secondary)
-    {
-        if (FreedSecondaryBuffers.empty())
-            return std::make_unique<CCommandBufferVk>(shared_from_this(), secondary);
-        VkCommandBuffer buffer = FreedSecondaryBuffers.front();
-        FreedSecondaryBuffers.pop();
-        return std::make_unique<CCommandBufferVk>(shared_from_this(), buffer, secondary);
-    }
-    else
+    LiveBufferCount++;
+    auto& resetBuffers = secondary ? ResetSecondaryBuffers : ResetPrimaryBuffers;
+    if (resetBuffers.empty())
     {
-        if (FreedPrimaryBuffers.empty())
-            return std::make_unique<CCommandBufferVk>(shared_from_this(), secondary);
-        VkCommandBuffer buffer = FreedPrimaryBuffers.front();
-        FreedPrimaryBuffers.pop();
-        return std::make_unique<CCommandBufferVk>(shared_from_this(), buffer, secondary);
+        lk.unlock();
+        return std::make_unique<CCommandBufferVk>(shared_from_this(), secondary);
     }
+    VkCommandBuffer buffer = resetBuffers.front();
+    resetBuffers.pop();
+    return std::make_unique<CCommandBufferVk>(shared_from_this(), buffer, secondary);
 }
 
-void CCommandPoolVk::ResetPool()
+bool CCommandPoolVk::ResetPool()
 {
+    std::lock_guard<tc::FSpinLock> lk(BufferListLock);
+    if (LiveBufferCount != 0)
+        return false;
     VK(vkResetCommandPool(Parent.GetVkDevice(), Handle, 0));
-    bCanAllocateFromFreedList = true;
+    // Everything that was freed is back in the initial state
+    while (!FreedPrimaryBuffers.empty())
+    {
+        ResetPrimaryBuffers.push(FreedPrimaryBuffers.front());
+        FreedPrimaryBuffers.pop();
+    }
+    while (!FreedSecondaryBuffers.empty())
+    {
+        ResetSecondaryBuffers.push(FreedSecondaryBuffers.front());
+        FreedSecondaryBuffers.pop();
+    }
+    return true;
 }
 
 CCommandBufferVk::CCommandBufferVk(CCommandPoolVk::Ref pool, bool secondary)
@@ -74,22 +79,15 @@ CCommandBufferVk::CCommandBufferVk(CCommandPoolVk::Ref pool, VkCommandBuffer han
 
 CCommandBufferVk::~CCommandBufferVk()
 {
+    std::unique_lock<tc::FSpinLock> lk(CommandPool->BufferListLock);
+    CommandPool->LiveBufferCount--;
     if (CommandPool->bResetIndividualBuffer)
         vkFreeCommandBuffers(CommandPool->GetParent().GetVkDevice(), CommandPool->GetHandle(), 1,
                              &Handle);
+    else if (bIsSecondary)
+        CommandPool->FreedSecondaryBuffers.push(Handle);
     else
-    {
-        std::unique_lock<tc::FSpinLock> lk(CommandPool->BufferListLock);
-        if (bIsSecondary)
-            CommandPool->FreedSecondaryBuffers.push(Handle);
-        else
-            CommandPool->FreedPrimaryBuffers.push(Handle);
-        CommandPool->bCanAllocateFromFreedList = false;
-    }
-
-    if (BufferAllocator)
-        BufferAllocator->UnlockPool(AllocatorPoolIndex);
-    BufferAllocator = nullptr;
+        CommandPool->FreedPrimaryBuffers.push(Handle);
 }
 
 void CCommandBufferVk::BeginRecording(CRenderPass::Ref renderPass, uint32_t subpass)
@@ -125,44 +123,90 @@ void CCommandBufferVk::EndRecording()
     VkResult result = vkEndCommandBuffer(Handle);
     if (result != VK_SUCCESS)
         throw CRHIRuntimeError("Could not end command buffer");
-
-    if (BufferAllocator)
-        BufferAllocator->UnlockPool(AllocatorPoolIndex);
-    BufferAllocator = nullptr;
 }
 
-CCommandBufferAllocatorVk::CCommandBufferAllocatorVk(CDeviceVk& deviceVk, EQueueType queueType)
+static std::atomic<uint64_t> NextAllocatorSerial { 0 };
+
+struct CThreadPoolsCacheEntry
 {
-    for (size_t i = 0; i < kNumPools; i++)
+    uint64_t AllocatorSerial;
+    // Good as long as the allocator is, which a matching serial vouches for
+    CThreadCommandPoolsVk* Pools;
+    std::weak_ptr<CThreadCommandPoolsVk> Owner;
+};
+
+// One entry per allocator (so per queue) this thread has allocated from. Entries of destroyed
+//   allocators are pruned on the next miss, and the pools are handed back when the thread exits
+struct CThreadPoolsCache
+{
+    std::vector<CThreadPoolsCacheEntry> Entries;
+
+    ~CThreadPoolsCache()
     {
-        auto pool = std::make_shared<CCommandPoolVk>(deviceVk, queueType, true);
-        Pools.emplace_back(std::move(pool));
-        AvailablePools.push(i);
+        for (const auto& entry : Entries)
+            if (auto pools = entry.Owner.lock())
+                pools->bIsThreadGone = true;
     }
+};
+static thread_local CThreadPoolsCache ThreadPoolsCache;
+
+CCommandBufferAllocatorVk::CCommandBufferAllocatorVk(CDeviceVk& deviceVk, EQueueType queueType,
+                                                     uint32_t frameCount)
+    : Parent(deviceVk)
+    , QueueType(queueType)
+    , FrameCount(frameCount)
+    , Serial(NextAllocatorSerial++)
+{
 }
 
 std::unique_ptr<CCommandBufferVk> CCommandBufferAllocatorVk::Allocate(bool secondary)
 {
-    Mutex.Lock();
-    while (AvailablePools.empty())
+    auto& pools = GetThreadPools();
+    std::lock_guard<tc::FSpinLock> lk(pools.Lock);
+    uint32_t frameIndex = FrameIndex.load(std::memory_order_acquire);
+    return pools.Pools[frameIndex]->AllocateCommandBuffer(secondary);
+}
+
+void CCommandBufferAllocatorVk::BeginFrame(uint32_t frameIndex)
+{
     {
-        Mutex.Unlock();
-        Mutex.Lock();
+        // A pool with buffers still around (a list kept across frames, or recorded but never
+        //   submitted) can't be reset. Those buffers keep it to themselves, it goes away with the
+        //   last of them, and the frame carries on with a new pool
+        std::lock_guard<std::mutex> lk(ThreadPoolsMutex);
+        // Buffers from the pools of exited threads keep them alive for as long as they need
+        ThreadPools.erase(std::remove_if(ThreadPools.begin(), ThreadPools.end(),
+                                         [](const auto& pools) { return pools->bIsThreadGone; }),
+                          ThreadPools.end());
+        for (const auto& pools : ThreadPools)
+        {
+            std::lock_guard<tc::FSpinLock> poolsLock(pools->Lock);
+            auto& pool = pools->Pools[frameIndex];
+            if (!pool->ResetPool())
+                pool = std::make_shared<CCommandPoolVk>(Parent, QueueType);
+        }
     }
-    size_t poolIndex = AvailablePools.top();
-    AvailablePools.pop();
-    Mutex.Unlock();
-
-    auto cmdBuffer = Pools[poolIndex]->AllocateCommandBuffer(secondary);
-    cmdBuffer->BufferAllocator = this;
-    cmdBuffer->AllocatorPoolIndex = poolIndex;
-    return cmdBuffer;
+    FrameIndex.store(frameIndex, std::memory_order_release);
 }
 
-void CCommandBufferAllocatorVk::UnlockPool(size_t index)
+CThreadCommandPoolsVk& CCommandBufferAllocatorVk::GetThreadPools()
 {
-    std::lock_guard<tc::FSpinLock> lk(Mutex);
-    AvailablePools.push(index);
+    auto& entries = ThreadPoolsCache.Entries;
+    for (const auto& entry : entries)
+        if (entry.AllocatorSerial == Serial)
+            return *entry.Pools;
+
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [](const auto& entry) { return entry.Owner.expired(); }),
+                  entries.end());
+    auto pools = std::make_shared<CThreadCommandPoolsVk>();
+    for (uint32_t i = 0; i < FrameCount; i++)
+        pools->Pools.emplace_back(std::make_shared<CCommandPoolVk>(Parent, QueueType));
+    entries.push_back({ Serial, pools.get(), pools });
+
+    std::lock_guard<std::mutex> lk(ThreadPoolsMutex);
+    ThreadPools.emplace_back(std::move(pools));
+    return *ThreadPools.back();
 }
 
 }
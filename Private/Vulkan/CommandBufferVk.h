@@ -3,9 +3,10 @@
 #include "RenderPass.h"
 #include "VkCommon.h"
 #include <SpinLock.h>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <queue>
-#include <stack>
 #include <vector>
 
 namespace RHI
@@ -18,13 +19,15 @@ class CCommandPoolVk : public std::enable_shared_from_this<CCommandPoolVk>
 public:
     typedef std::shared_ptr<CCommandPoolVk> Ref;
 
-    CCommandPoolVk(CDeviceVk& p, EQueueType queueType, bool resetIndividualBuffer = true);
+    CCommandPoolVk(CDeviceVk& p, EQueueType queueType, bool resetIndividualBuffer = false);
     ~CCommandPoolVk();
 
     CDeviceVk& GetParent() const { return Parent; }
     VkCommandPool GetHandle() const { return Handle; }
     std::unique_ptr<CCommandBufferVk> AllocateCommandBuffer(bool secondary = false);
-    void ResetPool();
+    // Only once every buffer from this pool has been freed, returns whether it happened. None of
+    //   them may still be pending on the GPU
+    bool ResetPool();
 
 private:
     friend class CCommandBufferVk;
@@ -38,24 +41,55 @@ private:
     tc::FSpinLock BufferListLock;
     std::queue<VkCommandBuffer> FreedPrimaryBuffers;
     std::queue<VkCommandBuffer> FreedSecondaryBuffers;
-    bool bCanAllocateFromFreedList;
+    std::queue<VkCommandBuffer> ResetPrimaryBuffers;
+    std::queue<VkCommandBuffer> ResetSecondaryBuffers;
+    // Buffers handed out and not freed yet
+    size_t LiveBufferCount = 0;
 };
 
-// Purpose is to allow dynamic assignment of pools
+// The pools of one recording thread, one per frame in flight
+struct CThreadCommandPoolsVk
+{
+    // Held by the thread while it allocates, and by BeginFrame while it resets or replaces a pool.
+    //   Only contended for that moment
+    tc::FSpinLock Lock;
+    std::vector<CCommandPoolVk::Ref> Pools;
+    // Set when the thread exits, the allocator drops the pools at its next BeginFrame
+    std::atomic<bool> bIsThreadGone { false };
+};
+
+// Every thread that records gets its own pools, one per frame in flight, so allocating and
+//   recording never waits on another thread
 class CCommandBufferAllocatorVk
 {
 public:
-    CCommandBufferAllocatorVk(CDeviceVk& deviceVk, EQueueType queueType);
+    CCommandBufferAllocatorVk(CDeviceVk& deviceVk, EQueueType queueType, uint32_t frameCount);
 
     std::unique_ptr<CCommandBufferVk> Allocate(bool secondary = false);
 
-    void UnlockPool(size_t index);
+    // Resets the frame's pools and allocates from them from now on. The frame's buffers must be
+    //   done on the GPU. Only one thread, the queue's submitting one, calls this
+    // NOTE: Threads may keep allocating meanwhile, but recording must not span SubmitFrame: a
+    //   list started before it gets buffers from both frames' pools
+    void BeginFrame(uint32_t frameIndex);
 
 private:
-    tc::FSpinLock Mutex;
-    static const size_t kNumPools = 12;
-    std::vector<CCommandPoolVk::Ref> Pools;
-    std::stack<size_t> AvailablePools;
+    // The calling thread's pools, created the first time it shows up
+    CThreadCommandPoolsVk& GetThreadPools();
+
+    CDeviceVk& Parent;
+    EQueueType QueueType;
+    uint32_t FrameCount;
+    // Stored with release after the frame's pools are reset, and loaded with acquire in Allocate.
+    //   A thread that sees the new index also sees the reset pools
+    std::atomic<uint32_t> FrameIndex { 0 };
+    // Tells allocators apart in the threads' lookup caches, addresses may get reused
+    uint64_t Serial;
+
+    // Only locked when a thread allocates from this allocator for the first time, and by
+    //   BeginFrame. The threads' caches only hold weak references
+    std::mutex ThreadPoolsMutex;
+    std::vector<std::shared_ptr<CThreadCommandPoolsVk>> ThreadPools;
 };
 
 class CCommandBufferVk
@@ -73,11 +107,6 @@ private:
     CCommandPoolVk::Ref CommandPool;
     VkCommandBuffer Handle;
     bool bIsSecondary;
-
-    // If this command buffer is allocated from an allocator, we need to unlock the pool
-    friend class CCommandBufferAllocatorVk;
-    CCommandBufferAllocatorVk* BufferAllocator = nullptr;
-    size_t AllocatorPoolIndex = 0;
 };
 
 }
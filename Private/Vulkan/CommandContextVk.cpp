@@ -1,12 +1,14 @@
 #include "CommandContextVk.h"
 #include "BufferVk.h"
 #include "CommandQueueVk.h"
+#include "DeferredContextVk.h"
 #include "DescriptorSetVk.h"
 #include "DeviceVk.h"
 #include "ImageViewVk.h"
 #include "ImageVk.h"
 #include "PipelineVk.h"
 #include "RenderPassVk.h"
+#include <cstring>
 
 namespace RHI
 {
@@ -17,22 +19,19 @@ CRenderPassContextVk::CRenderPassContextVk(CCommandListVk::Ref cmdList, CRenderP
     , RenderPass(std::move(renderPass))
     , ClearValues(std::move(clearValues))
 {
-    if (CmdList->IsCommitted())
-        throw CRHIRuntimeError("A committed command list can no longer be recorded into");
-    if (CmdList->bIsContextActive)
-        throw CRHIRuntimeError("One context is already active on this command list");
-    CmdList->bIsContextActive = true;
-
     auto rpImpl = std::static_pointer_cast<CRenderPassVk>(RenderPass);
     SubpassInfos.resize(rpImpl->GetSubpassCount());
 
     if (ClearValues.size() != rpImpl->GetAttachmentDesc().size())
         throw CRHIRuntimeError("ClearValues count doesn't match attachment count");
+
+    // Contexts created while this one records go after the render pass
+    Section = &CmdList->GetSection(CmdList->AddSection(false));
 }
 
 CRenderPassContextVk::~CRenderPassContextVk()
 {
-    if (CmdList && CmdList->bIsContextActive)
+    if (CmdList)
     {
         throw CRHIRuntimeError("Command Context destroyed before FinishRecording");
     }
@@ -51,12 +50,49 @@ IRenderContext::Ref CRenderPassContextVk::CreateRenderContext(uint32_t subpass)
     return std::make_shared<CCommandContextVk>(shared_from_this(), subpass);
 }
 
+IRenderContext::Ref CRenderPassContextVk::CreateDeferredRenderContext(uint32_t subpass)
+{
+    uint32_t cmdBufferIndex = MakeSubpassInfo(subpass);
+    {
+        std::lock_guard<tc::FSpinLock> lk(SpinLock);
+        OpenDeferredCount++;
+    }
+    return std::make_shared<CDeferredContextVk>(shared_from_this(), subpass, cmdBufferIndex);
+}
+
+void CRenderPassContextVk::AddDeferredStream(uint32_t subpass, uint32_t cmdBufferIndex,
+                                             std::unique_ptr<CCommandStreamVk> stream)
+{
+    std::lock_guard<tc::FSpinLock> lk(SpinLock);
+    DeferredStreams.push_back({ subpass, cmdBufferIndex, std::move(stream) });
+    OpenDeferredCount--;
+}
+
 void CRenderPassContextVk::FinishRecording()
 {
     static_assert(sizeof(VkClearValue) == sizeof(CClearValue), "Struct sizes mismatch");
     // TODO: make sure all those render contexts are done
 
-    CCommandListSection section;
+    // The secondary buffers of the deferred contexts are recorded now, each on its own worker
+    std::vector<CDeferredStream> streams;
+    {
+        std::lock_guard<tc::FSpinLock> lk(SpinLock);
+        if (OpenDeferredCount != 0)
+            throw CRHIRuntimeError("Deferred render contexts have to finish before the pass");
+        streams.swap(DeferredStreams);
+    }
+    if (!streams.empty())
+    {
+        auto self = shared_from_this();
+        CmdList->GetQueue().GetDevice().RunOnWorkers(streams.size(), [&](size_t i) {
+            CCommandContextVk ctx(self, streams[i].Subpass, streams[i].CmdBufferIndex);
+            streams[i].Stream->Translate(ctx);
+            ctx.FinishRecording();
+        });
+    }
+
+    // The section keeps its own first and last accesses until the list is submitted
+    CCommandListSection& section = *Section;
     auto& allocator = CmdList->GetQueue().GetCmdBufferAllocator();
     section.CmdBuffer = allocator.Allocate(false);
     // Record all those render lists
@@ -96,6 +132,8 @@ void CRenderPassContextVk::FinishRecording()
                 section.SecondaryBuffers.emplace_back(std::move(bufferRef));
 
                 section.AccessTracker.Merge(VK_NULL_HANDLE, subpassInfo.AccessTracker);
+                section.BindCounters.Requested += subpassInfo.BindCounters.Requested;
+                section.BindCounters.Filtered += subpassInfo.BindCounters.Filtered;
             }
 
             vkCmdExecuteCommands(handle, static_cast<uint32_t>(secondaryBuffers.size()),
@@ -110,22 +148,8 @@ void CRenderPassContextVk::FinishRecording()
 
         renderPass->UpdateImageFinalAccess(section.AccessTracker);
     }
-    CmdList->Sections.emplace_back(std::move(section));
-
-    // Grab a new command buffer to write all the resource transitions
-    if (CmdList->Sections.size() > 1)
-    {
-        CmdList->Sections.back().PreCmdBuffer =
-            CmdList->GetQueue().GetCmdBufferAllocator().Allocate();
-        CmdList->Sections.back().PreCmdBuffer->BeginRecording(VK_NULL_HANDLE, 0);
-        CmdList->Sections[0].AccessTracker.Merge(CmdList->Sections.back().PreCmdBuffer->GetHandle(),
-                                                 CmdList->Sections.back().AccessTracker);
-        CmdList->Sections.back().PreCmdBuffer->EndRecording();
-        CmdList->Sections.back().AccessTracker.Clear();
-    }
-
     // Drop reference
-    CmdList->bIsContextActive = false;
+    CmdList->EndContext();
     CmdList.reset();
 }
 
@@ -218,33 +242,33 @@ void CCommandContextVk::Convert(VkRect2D& dst, const CRect2D& src)
 CCommandContextVk::CCommandContextVk(const CCommandListVk::Ref& cmdList)
     : CmdList(cmdList)
 {
-    if (CmdList->IsCommitted())
-        throw CRHIRuntimeError("A committed command list can no longer be recorded into");
-    if (CmdList->bIsContextActive)
-        throw CRHIRuntimeError("One context is already active on this command list");
-    CmdList->bIsContextActive = true;
+    // The command buffer comes later, see CmdBuffer
+    Section = &CmdList->GetSection(CmdList->AddSection(false));
+}
 
-    CCommandListSection section;
-    auto& allocator = cmdList->GetQueue().GetCmdBufferAllocator();
-    section.CmdBuffer = allocator.Allocate(false);
-    section.CmdBuffer->BeginRecording(nullptr, 0);
-    CmdList->Sections.emplace_back(std::move(section));
+CCommandContextVk::CCommandContextVk(const CCommandListVk::Ref& cmdList, size_t sectionIndex)
+    : CmdList(cmdList)
+    , Section(&cmdList->GetSection(sectionIndex))
+    , bIsTranslating(true)
+{
 }
 
 CCommandContextVk::CCommandContextVk(const CRenderPassContextVk::Ref& renderPassContext,
                                      uint32_t subpass)
+    : CCommandContextVk(renderPassContext, subpass, renderPassContext->MakeSubpassInfo(subpass))
+{
+}
+
+CCommandContextVk::CCommandContextVk(const CRenderPassContextVk::Ref& renderPassContext,
+                                     uint32_t subpass, uint32_t cmdBufferIndex)
 {
     RenderPassContext = renderPassContext;
     SubpassIndex = subpass;
-    CmdBufferIndex = renderPassContext->MakeSubpassInfo(subpass);
-
-    auto& allocator = renderPassContext->GetCmdList()->GetQueue().GetCmdBufferAllocator();
-    auto cmdBuffer = allocator.Allocate(true);
-    cmdBuffer->BeginRecording(renderPassContext->GetRenderPass(), subpass);
-
-    auto& subpassInfo = renderPassContext->GetSubpassInfo(subpass, CmdBufferIndex);
-    subpassInfo.SecondaryBuffer = std::move(cmdBuffer);
+    CmdBufferIndex = cmdBufferIndex;
+}
 
+void CCommandContextVk::SetDefaultViewport()
+{
     auto rpImpl = std::static_pointer_cast<CRenderPassVk>(RenderPassContext->GetRenderPass());
     CViewportDesc vp {};
     vp.X = 0.0f;
@@ -263,20 +287,39 @@ CCommandContextVk::CCommandContextVk(const CRenderPassContextVk::Ref& renderPass
 
 CCommandContextVk::~CCommandContextVk()
 {
-    if (CmdList && CmdList->bIsContextActive)
+    if (CmdList && !bIsTranslating)
     {
         throw CRHIRuntimeError("Command Context destroyed before FinishRecording");
     }
 }
 
+static CAccessRecord DeclaredAccess(EResourceState state, bool src)
+{
+    return { StateToAccessMask(state), StateToShaderStageMask(state, src),
+             StateToImageLayout(state) };
+}
+
 void CCommandContextVk::TransitionImage(CImage& image, EResourceState newState)
 {
+    TrackedPipelines.fill(nullptr);
     auto& imageImpl = static_cast<CImageVk&>(image);
     CImageSubresourceRange range;
     range.BaseArrayLayer = 0;
     range.BaseMipLevel = 0;
     range.LayerCount = imageImpl.GetArrayLayers();
     range.LevelCount = imageImpl.GetMipLevels();
+    if (imageImpl.IsExplicitState())
+    {
+        // The caller owns the state, so the barrier goes out right here without any tracking
+        if (!CmdList)
+            throw CRHIRuntimeError("Explicit-state transitions can't be inside a render pass");
+        FlushBarriers();
+        CAccessTracker::InsertImageBarrier(CmdBuffer(), &imageImpl, range,
+                                           DeclaredAccess(imageImpl.GetDeclaredState(), true),
+                                           DeclaredAccess(newState, false));
+        imageImpl.DeclareState(newState);
+        return;
+    }
     AccessTracker().TransitionImageState(CmdBuffer(), &imageImpl, range, newState,
                                          CmdList->GetQueue().GetType() == EQueueType::Copy);
 }
@@ -285,6 +328,7 @@ void CCommandContextVk::TransitionImage(CImage& image, uint32_t baseMip, uint32_
                                         uint32_t baseLayer, uint32_t layerCount,
                                         EResourceState newState)
 {
+    TrackedPipelines.fill(nullptr);
     auto& imageImpl = static_cast<CImageVk&>(image);
     CImageSubresourceRange range;
     range.BaseArrayLayer = baseLayer;
@@ -299,6 +343,83 @@ void CCommandContextVk::TransitionImage(CImage& image, uint32_t baseMip, uint32_
                                          CmdList->GetQueue().GetType() == EQueueType::Copy);
 }
 
+void CCommandContextVk::TransitionBuffer(CBuffer& buffer, size_t offset, size_t size,
+                                         VkAccessFlags access, VkPipelineStageFlags stages)
+{
+    if (CAccessRecord { access, stages, VK_IMAGE_LAYOUT_UNDEFINED }.IsWrite())
+        TrackedPipelines.fill(nullptr);
+    // Inside a render pass the barriers go before it, same as the descriptor sets
+    AccessTracker().TransitionBuffer(CmdList ? CmdBuffer() : VK_NULL_HANDLE,
+                                     &static_cast<CBufferVk&>(buffer), offset, size, access,
+                                     stages);
+}
+
+void CCommandContextVk::TransitionBuffer(CBuffer& buffer, EResourceState newState)
+{
+    auto& bufferImpl = static_cast<CBufferVk&>(buffer);
+    if (!bufferImpl.IsExplicitState())
+    {
+        TransitionBuffer(buffer, 0, bufferImpl.GetSize(), StateToAccessMask(newState),
+                         StateToShaderStageMask(newState, false));
+        return;
+    }
+    if (!CmdList)
+        throw CRHIRuntimeError("Explicit-state transitions can't be inside a render pass");
+    FlushBarriers();
+    CAccessTracker::InsertBufferBarrier(CmdBuffer(), { &bufferImpl, 0, bufferImpl.GetSize() },
+                                        DeclaredAccess(bufferImpl.GetDeclaredState(), true),
+                                        DeclaredAccess(newState, false));
+    bufferImpl.DeclareState(newState);
+}
+
+void CCommandContextVk::ReleaseImage(CImage& image, EResourceState newState,
+                                     CCommandQueueVk& dstQueue)
+{
+    if (!CmdList)
+        throw CRHIRuntimeError("Can't release ownership inside a render pass");
+    TrackedPipelines.fill(nullptr);
+    auto& device = CmdList->GetQueue().GetDevice();
+    uint32_t srcFamily = device.GetQueueFamily(CmdList->GetQueue().GetType());
+    uint32_t dstFamily = device.GetQueueFamily(dstQueue.GetType());
+    auto& imageImpl = static_cast<CImageVk&>(image);
+    if (srcFamily == dstFamily || imageImpl.IsConcurrentAccess())
+    {
+        TransitionImage(image, newState);
+        return;
+    }
+
+    CImageSubresourceRange range;
+    range.Set(0, imageImpl.GetMipLevels(), 0, imageImpl.GetArrayLayers());
+    CAccessRecord newAccess { StateToAccessMask(newState), StateToShaderStageMask(newState, false),
+                              StateToImageLayout(newState) };
+    AccessTracker().ReleaseImage(CmdBuffer(), &imageImpl, range, newAccess, srcFamily, dstFamily,
+                                 CmdList->GetOwnershipAcquire(dstQueue));
+    if (imageImpl.IsExplicitState())
+        imageImpl.DeclareState(newState);
+}
+
+void CCommandContextVk::ReleaseBuffer(CBuffer& buffer, size_t offset, size_t size,
+                                      VkAccessFlags access, VkPipelineStageFlags stages,
+                                      CCommandQueueVk& dstQueue)
+{
+    if (!CmdList)
+        throw CRHIRuntimeError("Can't release ownership inside a render pass");
+    TrackedPipelines.fill(nullptr);
+    auto& device = CmdList->GetQueue().GetDevice();
+    uint32_t srcFamily = device.GetQueueFamily(CmdList->GetQueue().GetType());
+    uint32_t dstFamily = device.GetQueueFamily(dstQueue.GetType());
+    if (srcFamily == dstFamily || static_cast<CBufferVk&>(buffer).IsConcurrentAccess())
+    {
+        TransitionBuffer(buffer, offset, size, access, stages);
+        return;
+    }
+
+    CAccessRecord newAccess { access, stages, VK_IMAGE_LAYOUT_UNDEFINED };
+    AccessTracker().ReleaseBuffer(CmdBuffer(), &static_cast<CBufferVk&>(buffer), offset, size,
+                                  newAccess, srcFamily, dstFamily,
+                                  CmdList->GetOwnershipAcquire(dstQueue));
+}
+
 void CCommandContextVk::ClearImage(CImage& image, const CClearValue& clearValue,
                                    const CImageSubresourceRange& range)
 {
@@ -316,6 +437,7 @@ void CCommandContextVk::ClearImage(CImage& image, const CClearValue& clearValue,
     vkRange.levelCount = range.LevelCount;
     vkRange.layerCount = range.LayerCount;
 
+    FlushBarriers();
     vkCmdClearColorImage(CmdBuffer(), imageImpl.GetVkImage(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                          reinterpret_cast<const VkClearColorValue*>(clearValue.ColorFloat32), 1,
                          &vkRange);
@@ -327,6 +449,14 @@ void CCommandContextVk::CopyBuffer(CBuffer& src, CBuffer& dst,
     static_assert(sizeof(CBufferCopy) == sizeof(VkBufferCopy), "struct size mismatch");
     const auto* r = reinterpret_cast<const VkBufferCopy*>(regions.data());
 
+    for (const auto& region : regions)
+    {
+        TransitionBuffer(src, region.SrcOffset, region.Size, VK_ACCESS_TRANSFER_READ_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT);
+        TransitionBuffer(dst, region.DstOffset, region.Size, VK_ACCESS_TRANSFER_WRITE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT);
+    }
+    FlushBarriers();
     vkCmdCopyBuffer(CmdBuffer(), static_cast<CBufferVk&>(src).GetHandle(),
                     static_cast<CBufferVk&>(dst).GetHandle(), static_cast<uint32_t>(regions.size()),
                     r);
@@ -348,6 +478,7 @@ void CCommandContextVk::CopyImage(CImage& src, CImage& dst, const std::vector<CI
     }
     auto& srcImpl = static_cast<CImageVk&>(src);
     auto& dstImpl = static_cast<CImageVk&>(dst);
+    FlushBarriers();
     vkCmdCopyImage(CmdBuffer(), srcImpl.GetVkImage(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
                    dstImpl.GetVkImage(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                    static_cast<uint32_t>(r.size()), r.data());
@@ -365,8 +496,12 @@ void CCommandContextVk::CopyBufferToImage(CBuffer& src, CImage& dst,
 
         TransitionImage(dst, rs.ImageSubresource.MipLevel, 1, rs.ImageSubresource.BaseArrayLayer,
                         rs.ImageSubresource.LayerCount, EResourceState::CopyDest);
+        // The footprint depends on the format, read up to the end
+        TransitionBuffer(src, rs.BufferOffset, VK_WHOLE_SIZE, VK_ACCESS_TRANSFER_READ_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT);
     }
     auto& dstImpl = static_cast<CImageVk&>(dst);
+    FlushBarriers();
     vkCmdCopyBufferToImage(CmdBuffer(), static_cast<CBufferVk&>(src).GetHandle(),
                            dstImpl.GetVkImage(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                            static_cast<uint32_t>(vkregions.size()), vkregions.data());
@@ -384,8 +519,11 @@ void CCommandContextVk::CopyImageToBuffer(CImage& src, CBuffer& dst,
 
         TransitionImage(src, rs.ImageSubresource.MipLevel, 1, rs.ImageSubresource.BaseArrayLayer,
                         rs.ImageSubresource.LayerCount, EResourceState::CopySource);
+        TransitionBuffer(dst, rs.BufferOffset, VK_WHOLE_SIZE, VK_ACCESS_TRANSFER_WRITE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT);
     }
     auto& srcImpl = static_cast<CImageVk&>(src);
+    FlushBarriers();
     vkCmdCopyImageToBuffer(CmdBuffer(), srcImpl.GetVkImage(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
                            static_cast<CBufferVk&>(dst).GetHandle(),
                            static_cast<uint32_t>(vkregions.size()), vkregions.data());
@@ -410,6 +548,7 @@ void CCommandContextVk::BlitImage(CImage& src, CImage& dst, const std::vector<CI
         TransitionImage(dst, rs.DstSubresource.MipLevel, 1, rs.DstSubresource.BaseArrayLayer,
                         rs.DstSubresource.LayerCount, EResourceState::CopyDest);
     }
+    FlushBarriers();
     vkCmdBlitImage(CmdBuffer(), srcImpl.GetVkImage(), srcLayout, dstImpl.GetVkImage(), dstLayout,
                    static_cast<uint32_t>(r.size()), r.data(), VkCast(filter));
 }
@@ -431,6 +570,7 @@ void CCommandContextVk::ResolveImage(CImage& src, CImage& dst,
     }
     auto& srcImpl = static_cast<CImageVk&>(src);
     auto& dstImpl = static_cast<CImageVk&>(dst);
+    FlushBarriers();
     vkCmdResolveImage(CmdBuffer(), srcImpl.GetVkImage(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
                       dstImpl.GetVkImage(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                       static_cast<uint32_t>(r.size()), r.data());
@@ -445,7 +585,7 @@ void CCommandContextVk::BindComputePipeline(CPipeline& pipeline)
 
 void CCommandContextVk::BindComputeDescriptorSet(uint32_t set, CDescriptorSet& descriptorSet)
 {
-    // TODO: access tracking
+    // Access is tracked per dispatch, in WriteDescriptorSets
     auto& impl = static_cast<CDescriptorSetVk&>(descriptorSet);
     BoundDescriptorSets[set] = &impl;
     BindingDirty[set] = true;
@@ -454,6 +594,7 @@ void CCommandContextVk::BindComputeDescriptorSet(uint32_t set, CDescriptorSet& d
 void CCommandContextVk::Dispatch(uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ)
 {
     WriteDescriptorSets(VK_PIPELINE_BIND_POINT_COMPUTE);
+    FlushBarriers();
     vkCmdDispatch(CmdBuffer(), groupCountX, groupCountY, groupCountZ);
 }
 
@@ -461,6 +602,9 @@ void CCommandContextVk::DispatchIndirect(CBuffer& buffer, size_t offset)
 {
     WriteDescriptorSets(VK_PIPELINE_BIND_POINT_COMPUTE);
     auto& impl = static_cast<CBufferVk&>(buffer);
+    TransitionBuffer(buffer, offset, sizeof(VkDispatchIndirectCommand),
+                     VK_ACCESS_INDIRECT_COMMAND_READ_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT);
+    FlushBarriers();
     vkCmdDispatchIndirect(CmdBuffer(), impl.GetHandle(), offset);
 }
 
@@ -468,36 +612,79 @@ void CCommandContextVk::BindRenderPipeline(CPipeline& pipeline)
 {
     auto& impl = static_cast<CPipelineVk&>(pipeline);
     CurrPipeline = &impl;
+    BindCounters().Requested++;
+    // A compute pipeline in between doesn't touch the graphics bind point
+    if (BoundState.RenderPipeline == impl.GetHandle())
+    {
+        BindCounters().Filtered++;
+        return;
+    }
+    BoundState.RenderPipeline = impl.GetHandle();
     vkCmdBindPipeline(CmdBuffer(), VK_PIPELINE_BIND_POINT_GRAPHICS, impl.GetHandle());
 }
 
 void CCommandContextVk::SetViewport(const CViewportDesc& viewportDesc)
 {
+    // Up front, a subpass buffer starts out with the default viewport
+    VkCommandBuffer cmdBuffer = CmdBuffer();
     VkViewport vp;
     Convert(vp, viewportDesc);
-    vkCmdSetViewport(CmdBuffer(), 0, 1, &vp);
+    BindCounters().Requested++;
+    if (BoundState.bHasViewport && memcmp(&BoundState.Viewport, &vp, sizeof(vp)) == 0)
+    {
+        BindCounters().Filtered++;
+        return;
+    }
+    BoundState.bHasViewport = true;
+    BoundState.Viewport = vp;
+    vkCmdSetViewport(cmdBuffer, 0, 1, &vp);
 }
 
 void CCommandContextVk::SetScissor(const CRect2D& scissor)
 {
+    VkCommandBuffer cmdBuffer = CmdBuffer();
     VkRect2D region;
     Convert(region, scissor);
-    vkCmdSetScissor(CmdBuffer(), 0, 1, &region);
+    BindCounters().Requested++;
+    if (BoundState.bHasScissor && memcmp(&BoundState.Scissor, &region, sizeof(region)) == 0)
+    {
+        BindCounters().Filtered++;
+        return;
+    }
+    BoundState.bHasScissor = true;
+    BoundState.Scissor = region;
+    vkCmdSetScissor(cmdBuffer, 0, 1, &region);
 }
 
 void CCommandContextVk::SetBlendConstants(const std::array<float, 4>& blendConstants)
 {
+    BindCounters().Requested++;
+    if (BoundState.bHasBlendConstants && BoundState.BlendConstants == blendConstants)
+    {
+        BindCounters().Filtered++;
+        return;
+    }
+    BoundState.bHasBlendConstants = true;
+    BoundState.BlendConstants = blendConstants;
     vkCmdSetBlendConstants(CmdBuffer(), blendConstants.data());
 }
 
 void CCommandContextVk::SetStencilReference(uint32_t reference)
 {
+    BindCounters().Requested++;
+    if (BoundState.bHasStencilReference && BoundState.StencilReference == reference)
+    {
+        BindCounters().Filtered++;
+        return;
+    }
+    BoundState.bHasStencilReference = true;
+    BoundState.StencilReference = reference;
     vkCmdSetStencilReference(CmdBuffer(), VK_STENCIL_FRONT_AND_BACK, reference);
 }
 
 void CCommandContextVk::BindRenderDescriptorSet(uint32_t set, CDescriptorSet& descriptorSet)
 {
-    // TODO: access tracking
+    // Access is tracked per draw, in WriteDescriptorSets
     auto& impl = static_cast<CDescriptorSetVk&>(descriptorSet);
     BoundDescriptorSets[set] = &impl;
     BindingDirty[set] = true;
@@ -508,6 +695,16 @@ void CCommandContextVk::BindIndexBuffer(CBuffer& buffer, size_t offset, EFormat
     auto& impl = static_cast<CBufferVk&>(buffer);
     VkIndexType indexType =
         format == EFormat::R16_UINT ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+    BindCounters().Requested++;
+    if (BoundState.IndexBuffer == impl.GetHandle() && BoundState.IndexOffset == offset
+        && BoundState.IndexType == indexType)
+    {
+        BindCounters().Filtered++;
+        return;
+    }
+    BoundState.IndexBuffer = impl.GetHandle();
+    BoundState.IndexOffset = offset;
+    BoundState.IndexType = indexType;
     vkCmdBindIndexBuffer(CmdBuffer(), impl.GetHandle(), offset, indexType);
 }
 
@@ -516,6 +713,19 @@ void CCommandContextVk::BindVertexBuffer(uint32_t binding, CBuffer& buffer, size
     auto& impl = static_cast<CBufferVk&>(buffer);
     // Workaround for systems where size_t != 8
     VkDeviceSize vkOffset = offset;
+    BindCounters().Requested++;
+    // Bindings past the shadowed ones always go through
+    if (binding < BoundState.VertexBuffers.size())
+    {
+        if (BoundState.VertexBuffers[binding] == impl.GetHandle()
+            && BoundState.VertexOffsets[binding] == vkOffset)
+        {
+            BindCounters().Filtered++;
+            return;
+        }
+        BoundState.VertexBuffers[binding] = impl.GetHandle();
+        BoundState.VertexOffsets[binding] = vkOffset;
+    }
     vkCmdBindVertexBuffers(CmdBuffer(), binding, 1, &impl.GetHandle(), &vkOffset);
 }
 
@@ -523,6 +733,7 @@ void CCommandContextVk::Draw(uint32_t vertexCount, uint32_t instanceCount, uint3
                              uint32_t firstInstance)
 {
     WriteDescriptorSets(VK_PIPELINE_BIND_POINT_GRAPHICS);
+    FlushBarriers();
     vkCmdDraw(CmdBuffer(), vertexCount, instanceCount, firstVertex, firstInstance);
 }
 
@@ -531,6 +742,7 @@ void CCommandContextVk::DrawIndexed(uint32_t indexCount, uint32_t instanceCount,
                                     uint32_t firstInstance)
 {
     WriteDescriptorSets(VK_PIPELINE_BIND_POINT_GRAPHICS);
+    FlushBarriers();
     vkCmdDrawIndexed(CmdBuffer(), indexCount, instanceCount, firstIndex, vertexOffset,
                      firstInstance);
 }
@@ -540,6 +752,10 @@ void CCommandContextVk::DrawIndirect(CBuffer& buffer, size_t offset, uint32_t dr
 {
     WriteDescriptorSets(VK_PIPELINE_BIND_POINT_GRAPHICS);
     VkBuffer vkBuffer = static_cast<CBufferVk&>(buffer).GetHandle();
+    if (drawCount > 0)
+        TransitionBuffer(buffer, offset, (drawCount - 1) * stride + sizeof(VkDrawIndirectCommand),
+                         VK_ACCESS_INDIRECT_COMMAND_READ_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT);
+    FlushBarriers();
     vkCmdDrawIndirect(CmdBuffer(), vkBuffer, offset, drawCount, stride);
 }
 
@@ -548,34 +764,29 @@ void CCommandContextVk::DrawIndexedIndirect(CBuffer& buffer, size_t offset, uint
 {
     WriteDescriptorSets(VK_PIPELINE_BIND_POINT_GRAPHICS);
     VkBuffer vkBuffer = static_cast<CBufferVk&>(buffer).GetHandle();
-    vkCmdDrawIndirect(CmdBuffer(), vkBuffer, offset, drawCount, stride);
+    if (drawCount > 0)
+        TransitionBuffer(buffer, offset,
+                         (drawCount - 1) * stride + sizeof(VkDrawIndexedIndirectCommand),
+                         VK_ACCESS_INDIRECT_COMMAND_READ_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT);
+    FlushBarriers();
+    vkCmdDrawIndexedIndirect(CmdBuffer(), vkBuffer, offset, drawCount, stride);
 }
 
 void CCommandContextVk::FinishRecording()
 {
     if (CmdList)
     {
-        CmdList->Sections.back().CmdBuffer->EndRecording();
-
-        // Grab a new command buffer to write all the resource transitions
-        if (CmdList->Sections.size() > 1)
-        {
-            CmdList->Sections.back().PreCmdBuffer =
-                CmdList->GetQueue().GetCmdBufferAllocator().Allocate();
-            CmdList->Sections.back().PreCmdBuffer->BeginRecording(VK_NULL_HANDLE, 0);
-            CmdList->Sections[0].AccessTracker.Merge(
-                CmdList->Sections.back().PreCmdBuffer->GetHandle(),
-                CmdList->Sections.back().AccessTracker);
-            CmdList->Sections.back().PreCmdBuffer->EndRecording();
-            CmdList->Sections.back().AccessTracker.Clear();
-        }
+        FlushBarriers();
+        Section->CmdBuffer->EndRecording();
 
         // Drop reference
-        CmdList->bIsContextActive = false;
+        if (!bIsTranslating)
+            CmdList->EndContext();
         CmdList.reset();
     }
     else
     {
+        CmdBuffer();
         RenderPassContext->GetSubpassInfo(SubpassIndex, CmdBufferIndex)
             .SecondaryBuffer->EndRecording();
         RenderPassContext.reset();
@@ -585,37 +796,74 @@ void CCommandContextVk::FinishRecording()
 CAccessTracker& CCommandContextVk::AccessTracker()
 {
     if (CmdList)
-        return CmdList->Sections.back().AccessTracker;
+        return Section->AccessTracker;
     return RenderPassContext->GetSubpassInfo(SubpassIndex, CmdBufferIndex).AccessTracker;
 }
 
+CBindCounters& CCommandContextVk::BindCounters()
+{
+    if (CmdList)
+        return Section->BindCounters;
+    return RenderPassContext->GetSubpassInfo(SubpassIndex, CmdBufferIndex).BindCounters;
+}
+
+void CCommandContextVk::FlushBarriers() { AccessTracker().FlushBarriers(CmdBuffer()); }
+
 VkCommandBuffer CCommandContextVk::CmdBuffer()
 {
+    // Allocated by the first command, so the buffer comes from the pool of the thread recording
+    //   it rather than the one that created the context
     if (CmdList)
-        return CmdList->Sections.back().CmdBuffer->GetHandle();
-    return RenderPassContext->GetSubpassInfo(SubpassIndex, CmdBufferIndex)
-        .SecondaryBuffer->GetHandle();
+    {
+        auto& cmdBuffer = Section->CmdBuffer;
+        if (!cmdBuffer)
+        {
+            cmdBuffer = CmdList->GetQueue().GetCmdBufferAllocator().Allocate(false);
+            cmdBuffer->BeginRecording(nullptr, 0);
+        }
+        return cmdBuffer->GetHandle();
+    }
+
+    auto& subpassInfo = RenderPassContext->GetSubpassInfo(SubpassIndex, CmdBufferIndex);
+    if (!subpassInfo.SecondaryBuffer)
+    {
+        auto& allocator = RenderPassContext->GetCmdList()->GetQueue().GetCmdBufferAllocator();
+        subpassInfo.SecondaryBuffer = allocator.Allocate(true);
+        subpassInfo.SecondaryBuffer->BeginRecording(RenderPassContext->GetRenderPass(),
+                                                    SubpassIndex);
+        SetDefaultViewport();
+    }
+    return subpassInfo.SecondaryBuffer->GetHandle();
 }
 
 void CCommandContextVk::WriteDescriptorSets(VkPipelineBindPoint bindPoint)
 {
+    // Barriers inside a render pass go before it
+    VkCommandBuffer barrierCmdBuffer =
+        bindPoint == VK_PIPELINE_BIND_POINT_COMPUTE ? CmdBuffer() : VK_NULL_HANDLE;
+
     uint32_t set = 0;
     for (auto* ds : BoundDescriptorSets)
     {
         if (ds)
         {
-            if (ds->IsContentDirty() || BindingDirty[set])
+            bool isRebound = ds->IsContentDirty() || BindingDirty[set];
+            if (isRebound)
             {
-                if (bindPoint == VK_PIPELINE_BIND_POINT_COMPUTE)
-                    ds->WriteUpdates(AccessTracker(), CmdBuffer());
-                else
-                    ds->WriteUpdates(AccessTracker(), VK_NULL_HANDLE);
+                ds->WriteUpdates();
 
                 VkDescriptorSet setHandle = ds->GetHandle();
                 vkCmdBindDescriptorSets(CmdBuffer(), bindPoint, CurrPipeline->GetPipelineLayout(),
                                         set, 1, &setHandle, 0, nullptr);
             }
             BindingDirty[set] = false;
+            // A set that can be written is tracked every time, each draw or dispatch may depend on
+            //   the one before. Tracking a read-only set again only repeats the same reads
+            if (isRebound || ds->HasWritableBindings() || TrackedPipelines[set] != CurrPipeline)
+            {
+                ds->TrackAccess(AccessTracker(), barrierCmdBuffer, *CurrPipeline, set);
+                TrackedPipelines[set] = CurrPipeline;
+            }
             ds->SetUsed();
         }
         set++;
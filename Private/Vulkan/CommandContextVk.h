@@ -13,6 +13,7 @@ struct CSubpassInfo
 {
     std::unique_ptr<CCommandBufferVk> SecondaryBuffer;
     CAccessTracker AccessTracker;
+    CBindCounters BindCounters;
 };
 
 class CRenderPassContextVk : public std::enable_shared_from_this<CRenderPassContextVk>,
@@ -34,17 +35,33 @@ public:
     uint32_t MakeSubpassInfo(uint32_t subpass);
 
     IRenderContext::Ref CreateRenderContext(uint32_t subpass) override;
+    IRenderContext::Ref CreateDeferredRenderContext(uint32_t subpass) override;
     void FinishRecording() override;
 
+    void AddDeferredStream(uint32_t subpass, uint32_t cmdBufferIndex,
+                           std::unique_ptr<CCommandStreamVk> stream);
+
 private:
     // The target we are recording into
     CCommandListVk::Ref CmdList;
+    // Reserved on creation, filled in by FinishRecording
+    CCommandListSection* Section = nullptr;
     CRenderPass::Ref RenderPass;
     std::vector<CClearValue> ClearValues;
 
     // Holds info for render contexts to write to. Cleared when FinishRecording
     tc::FSpinLock SpinLock;
     std::vector<std::vector<CSubpassInfo>> SubpassInfos;
+
+    // Streams of the deferred contexts, also guarded by SpinLock
+    struct CDeferredStream
+    {
+        uint32_t Subpass;
+        uint32_t CmdBufferIndex;
+        std::unique_ptr<CCommandStreamVk> Stream;
+    };
+    uint32_t OpenDeferredCount = 0;
+    std::vector<CDeferredStream> DeferredStreams;
 };
 
 class CCommandContextVk : public ICopyContext, public IComputeContext, public IRenderContext
@@ -67,11 +84,23 @@ public:
     explicit CCommandContextVk(const CCommandListVk::Ref& cmdList);
     explicit CCommandContextVk(const CRenderPassContextVk::Ref& renderPassContext,
                                uint32_t subpass);
+    // Translation of deferred streams, into the section or subpass slot they reserved
+    CCommandContextVk(const CCommandListVk::Ref& cmdList, size_t sectionIndex);
+    CCommandContextVk(const CRenderPassContextVk::Ref& renderPassContext, uint32_t subpass,
+                      uint32_t cmdBufferIndex);
     ~CCommandContextVk() override;
 
-    void TransitionImage(CImage& image, EResourceState newState);
+    void TransitionImage(CImage& image, EResourceState newState) override;
     void TransitionImage(CImage& image, uint32_t baseMip, uint32_t mipCount, uint32_t baseLayer,
                          uint32_t layerCount, EResourceState newState);
+    void TransitionBuffer(CBuffer& buffer, size_t offset, size_t size, VkAccessFlags access,
+                          VkPipelineStageFlags stages);
+    void TransitionBuffer(CBuffer& buffer, EResourceState newState) override;
+    // Hand a resource over to another queue. Falls back to a plain transition when both queues
+    //   are in the same family, otherwise dstQueue acquires it before its next submission
+    void ReleaseImage(CImage& image, EResourceState newState, CCommandQueueVk& dstQueue);
+    void ReleaseBuffer(CBuffer& buffer, size_t offset, size_t size, VkAccessFlags access,
+                       VkPipelineStageFlags stages, CCommandQueueVk& dstQueue);
     VkCommandBuffer GetCmdBuffer() { return CmdBuffer(); }
 
     // Copy commands
@@ -115,12 +144,21 @@ public:
 
 protected:
     CAccessTracker& AccessTracker();
+    CBindCounters& BindCounters();
+    // Pending transitions go out before each command that depends on them
+    void FlushBarriers();
+    // Allocates and begins the command buffer on first use
     VkCommandBuffer CmdBuffer();
+    // The whole render area, what a subpass starts out with
+    void SetDefaultViewport();
     void WriteDescriptorSets(VkPipelineBindPoint bindPoint);
 
 private:
     // The target we are recording into
     CCommandListVk::Ref CmdList;
+    CCommandListSection* Section = nullptr;
+    // Translating a stream doesn't make us the list's active context
+    bool bIsTranslating = false;
 
     // The target when we are a render pass
     CRenderPassContextVk::Ref RenderPassContext;
@@ -131,6 +169,29 @@ private:
     CPipelineVk* CurrPipeline = nullptr;
     std::array<CDescriptorSetVk*, 8> BoundDescriptorSets {};
     std::array<bool, 8> BindingDirty {};
+    // The pipeline each set last had its accesses tracked with. Any other access to a resource
+    //   that may be in a set (a transition or copy) clears them all
+    std::array<const CPipelineVk*, 8> TrackedPipelines {};
+
+    // What the command buffer has bound already, binds that match it are dropped. All pipelines
+    //   share the same dynamic states, so switching pipelines doesn't invalidate any of it
+    struct CBoundState
+    {
+        VkPipeline RenderPipeline = VK_NULL_HANDLE;
+        bool bHasViewport = false;
+        VkViewport Viewport;
+        bool bHasScissor = false;
+        VkRect2D Scissor;
+        bool bHasBlendConstants = false;
+        std::array<float, 4> BlendConstants;
+        bool bHasStencilReference = false;
+        uint32_t StencilReference;
+        VkBuffer IndexBuffer = VK_NULL_HANDLE;
+        VkDeviceSize IndexOffset = 0;
+        VkIndexType IndexType = VK_INDEX_TYPE_UINT16;
+        std::array<VkBuffer, 16> VertexBuffers {};
+        std::array<VkDeviceSize, 16> VertexOffsets {};
+    } BoundState;
 };
 
 }
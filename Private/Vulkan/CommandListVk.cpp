@@ -1,24 +1,52 @@
 #include "CommandListVk.h"
+#include "BufferVk.h"
 #include "CommandContextVk.h"
 #include "CommandQueueVk.h"
+#include "DeferredContextVk.h"
+#include "DeviceVk.h"
+#include "ImageViewVk.h"
 
 namespace RHI
 {
 
-VkSubmitInfo CCommandListSection::MakeSubmitInfo(std::vector<VkCommandBuffer>& stagingArray) const
+void CCommandListSection::AddToSubmitInfos(std::vector<VkSubmitInfo>& submitInfos,
+                                           std::vector<VkCommandBuffer>& stagingArray,
+                                           bool mergeAfterWait) const
 {
-    stagingArray.push_back(PreCmdBuffer->GetHandle());
+    // Sections without barriers or that only set events don't come with a pre-buffer
+    uint32_t count = PreCmdBuffer ? 2 : 1;
+    bool canMerge = false;
+    if (!submitInfos.empty() && WaitSemaphores.empty())
+    {
+        const auto& last = submitInfos.back();
+        // The command buffers of a submit info have to be next to each other in the staging array
+        canMerge = last.signalSemaphoreCount == 0
+            && (mergeAfterWait || last.waitSemaphoreCount == 0)
+            && last.pCommandBuffers + last.commandBufferCount
+                == stagingArray.data() + stagingArray.size();
+    }
+    if (PreCmdBuffer)
+        stagingArray.push_back(PreCmdBuffer->GetHandle());
     stagingArray.push_back(CmdBuffer->GetHandle());
 
+    if (canMerge)
+    {
+        auto& last = submitInfos.back();
+        last.commandBufferCount += count;
+        last.signalSemaphoreCount = static_cast<uint32_t>(SignalSemaphores.size());
+        last.pSignalSemaphores = SignalSemaphores.data();
+        return;
+    }
+
     VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
     submitInfo.waitSemaphoreCount = static_cast<uint32_t>(WaitSemaphores.size());
     submitInfo.pWaitSemaphores = WaitSemaphores.data();
     submitInfo.pWaitDstStageMask = WaitStages.data();
-    submitInfo.commandBufferCount = 2;
-    submitInfo.pCommandBuffers = stagingArray.data() + stagingArray.size() - 2;
+    submitInfo.commandBufferCount = count;
+    submitInfo.pCommandBuffers = stagingArray.data() + stagingArray.size() - count;
     submitInfo.signalSemaphoreCount = static_cast<uint32_t>(SignalSemaphores.size());
     submitInfo.pSignalSemaphores = SignalSemaphores.data();
-    return submitInfo;
+    submitInfos.push_back(submitInfo);
 }
 
 CCommandListVk::CCommandListVk(CCommandQueueVk& p)
@@ -43,12 +71,81 @@ void CCommandListVk::Commit()
     if (!bIsQueued)
         Enqueue();
 
-    if (bIsContextActive)
-        throw CRHIRuntimeError("Can't commit when the list is still being recorded");
+    {
+        std::lock_guard<tc::FSpinLock> lk(DeferredLock);
+        if (bIsContextActive)
+            throw CRHIRuntimeError("Can't commit when the list is still being recorded");
+    }
 
+    TranslateDeferredStreams();
     bIsCommitted = true;
 }
 
+void CCommandListVk::WaitForCommandList(CCommandList& signaler)
+{
+    auto& signalerImpl = static_cast<CCommandListVk&>(signaler);
+    if (IsCommitted() || signalerImpl.IsCommitted())
+        throw CRHIRuntimeError("Can't add a dependency between committed command lists");
+    // Same queue, submission order already takes care of it
+    if (&signalerImpl.GetQueue() == &GetQueue())
+        return;
+
+    VkSemaphoreCreateInfo semaphoreInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+    VkSemaphore semaphore;
+    VK(vkCreateSemaphore(GetQueue().GetDevice().GetVkDevice(), &semaphoreInfo, nullptr,
+                         &semaphore));
+    signalerImpl.QueueSignalSemaphores.push_back(semaphore);
+    QueueWaitSemaphores.push_back(semaphore);
+    QueueWaitStages.push_back(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+}
+
+void CCommandListVk::SplitBarrier(CCommandList& waiter, const CImageView::Ref& view)
+{
+    auto& waiterImpl = static_cast<CCommandListVk&>(waiter);
+    if (IsCommitted() || waiterImpl.IsCommitted())
+        throw CRHIRuntimeError("Can't add a dependency between committed command lists");
+    // Events don't work across queues, the full barrier on submission has it covered
+    if (&waiterImpl.GetQueue() != &GetQueue())
+        return;
+
+    auto viewImpl = std::static_pointer_cast<CImageViewVk>(view);
+    auto split = std::make_shared<CSplitBarrierVk>();
+    VkEventCreateInfo eventInfo = { VK_STRUCTURE_TYPE_EVENT_CREATE_INFO };
+    VK(vkCreateEvent(GetQueue().GetDevice().GetVkDevice(), &eventInfo, nullptr, &split->Event));
+    split->ImageView = view;
+    split->Image = viewImpl->GetImage().get();
+    split->Range = viewImpl->GetResourceRange();
+    SplitSignals.push_back(split);
+    waiterImpl.SplitWaits.push_back(std::move(split));
+}
+
+void CCommandListVk::TransferOwnership(CCommandList& receiver, const CImageView::Ref& view)
+{
+    auto& receiverImpl = static_cast<CCommandListVk&>(receiver);
+    if (IsCommitted() || receiverImpl.IsCommitted())
+        throw CRHIRuntimeError("Can't transfer ownership between committed command lists");
+    auto& device = GetQueue().GetDevice();
+    auto image = std::static_pointer_cast<CImageViewVk>(view)->GetImage();
+    if (image->IsConcurrentAccess()
+        || device.GetQueueFamily(GetQueue().GetType())
+            == device.GetQueueFamily(receiverImpl.GetQueue().GetType()))
+        return;
+    OwnershipTransfers.push_back({ &receiverImpl.GetQueue(), view, nullptr });
+}
+
+void CCommandListVk::TransferOwnership(CCommandList& receiver, const CBuffer::Ref& buffer)
+{
+    auto& receiverImpl = static_cast<CCommandListVk&>(receiver);
+    if (IsCommitted() || receiverImpl.IsCommitted())
+        throw CRHIRuntimeError("Can't transfer ownership between committed command lists");
+    auto& device = GetQueue().GetDevice();
+    if (static_cast<CBufferVk&>(*buffer).IsConcurrentAccess()
+        || device.GetQueueFamily(GetQueue().GetType())
+            == device.GetQueueFamily(receiverImpl.GetQueue().GetType()))
+        return;
+    OwnershipTransfers.push_back({ &receiverImpl.GetQueue(), nullptr, buffer });
+}
+
 ICopyContext::Ref CCommandListVk::CreateCopyContext()
 {
     return std::make_shared<CCommandContextVk>(
@@ -61,6 +158,70 @@ IComputeContext::Ref CCommandListVk::CreateComputeContext()
         std::static_pointer_cast<CCommandListVk>(shared_from_this()));
 }
 
+IComputeContext::Ref CCommandListVk::CreateDeferredComputeContext()
+{
+    // The section keeps the place of the stream among the others until it gets translated
+    size_t sectionIndex = AddSection(true);
+    return std::make_shared<CDeferredContextVk>(
+        std::static_pointer_cast<CCommandListVk>(shared_from_this()), sectionIndex);
+}
+
+size_t CCommandListVk::AddSection(bool isDeferred)
+{
+    std::lock_guard<tc::FSpinLock> lk(DeferredLock);
+    if (IsCommitted())
+        throw CRHIRuntimeError("A committed command list can no longer be recorded into");
+    if (isDeferred)
+        OpenDeferredCount++;
+    else if (bIsContextActive)
+        throw CRHIRuntimeError("One context is already active on this command list");
+    else
+        bIsContextActive = true;
+    Sections.emplace_back();
+    return Sections.size() - 1;
+}
+
+CCommandListSection& CCommandListVk::GetSection(size_t index)
+{
+    std::lock_guard<tc::FSpinLock> lk(DeferredLock);
+    return Sections[index];
+}
+
+void CCommandListVk::EndContext()
+{
+    std::lock_guard<tc::FSpinLock> lk(DeferredLock);
+    bIsContextActive = false;
+}
+
+void CCommandListVk::AddDeferredStream(size_t sectionIndex,
+                                       std::unique_ptr<CCommandStreamVk> stream)
+{
+    std::lock_guard<tc::FSpinLock> lk(DeferredLock);
+    DeferredStreams.emplace_back(sectionIndex, std::move(stream));
+    OpenDeferredCount--;
+}
+
+void CCommandListVk::TranslateDeferredStreams()
+{
+    std::vector<std::pair<size_t, std::unique_ptr<CCommandStreamVk>>> streams;
+    {
+        std::lock_guard<tc::FSpinLock> lk(DeferredLock);
+        if (OpenDeferredCount != 0)
+            throw CRHIRuntimeError("Can't commit when the list is still being recorded");
+        streams.swap(DeferredStreams);
+    }
+    if (streams.empty())
+        return;
+
+    // Every stream has a section of its own, so the workers don't share anything in the list
+    auto self = std::static_pointer_cast<CCommandListVk>(shared_from_this());
+    GetQueue().GetDevice().RunOnWorkers(streams.size(), [&](size_t i) {
+        CCommandContextVk ctx(self, streams[i].first);
+        streams[i].second->Translate(ctx);
+        ctx.FinishRecording();
+    });
+}
+
 IParallelRenderContext::Ref
 CCommandListVk::CreateParallelRenderContext(CRenderPass::Ref renderPass,
                                             const std::vector<CClearValue>& clearValues)
@@ -69,21 +230,183 @@ CCommandListVk::CreateParallelRenderContext(CRenderPass::Ref renderPass,
         std::static_pointer_cast<CCommandListVk>(shared_from_this()), renderPass, clearValues);
 }
 
+CBarrierCounters CCommandListVk::GetBarrierCounters() const
+{
+    CBarrierCounters counters;
+    for (const auto& section : Sections)
+    {
+        counters.Requested += section.AccessTracker.GetBarrierCounters().Requested;
+        counters.Issued += section.AccessTracker.GetBarrierCounters().Issued;
+    }
+    return counters;
+}
+
+CBindCounters CCommandListVk::GetBindCounters() const
+{
+    CBindCounters counters;
+    for (const auto& section : Sections)
+    {
+        counters.Requested += section.BindCounters.Requested;
+        counters.Filtered += section.BindCounters.Filtered;
+    }
+    return counters;
+}
+
+COwnershipAcquireVk& CCommandListVk::GetOwnershipAcquire(CCommandQueueVk& dstQueue)
+{
+    for (auto& iter : OwnershipAcquires)
+        if (iter.first == &dstQueue)
+            return iter.second;
+    OwnershipAcquires.emplace_back(&dstQueue, COwnershipAcquireVk());
+    return OwnershipAcquires.back().second;
+}
+
+void CCommandListVk::HandOverOwnership()
+{
+    for (auto& iter : OwnershipAcquires)
+        iter.first->AddOwnershipAcquire(std::move(iter.second));
+    OwnershipAcquires.clear();
+}
+
 void CCommandListVk::MakeSubmitInfos(std::vector<VkSubmitInfo>& submitInfos,
                                      std::vector<VkCommandBuffer>& stagingArray)
 {
-    if (!Sections.empty())
+    if (!Sections.empty() || !OwnershipTransfers.empty())
+    {
+        // Every section goes from the global state left by whatever was submitted before it to
+        //   its own first accesses, and leaves its last accesses behind for the next one
+        // A pre-buffer that is still empty afterwards is passed on to the next section
+        std::unique_ptr<CCommandBufferVk> preCmdBuffer;
+        for (auto& section : Sections)
+        {
+            assert(section.PreCmdBuffer == nullptr);
+            if (!preCmdBuffer)
+            {
+                preCmdBuffer = GetQueue().GetCmdBufferAllocator().Allocate();
+                preCmdBuffer->BeginRecording(VK_NULL_HANDLE, 0);
+            }
+            uint32_t issued = section.AccessTracker.GetBarrierCounters().Issued;
+            bool waitedOnEvent = section.AccessTracker.DeployAllBarriers(
+                preCmdBuffer->GetHandle(), GetQueue().GetType() == EQueueType::Compute,
+                SplitWaits);
+            bool isRecorded =
+                section.AccessTracker.GetBarrierCounters().Issued != issued || waitedOnEvent;
+            section.AccessTracker.Clear();
+            if (isRecorded)
+            {
+                preCmdBuffer->EndRecording();
+                section.PreCmdBuffer = std::move(preCmdBuffer);
+            }
+        }
+        if (preCmdBuffer)
+            preCmdBuffer->EndRecording();
+
+        // The images now remember what this list did to them last, which is what the events wait
+        //   for. The barriers themselves happen on the waiting side
+        if (!SplitSignals.empty())
+        {
+            CCommandListSection section;
+            section.CmdBuffer = GetQueue().GetCmdBufferAllocator().Allocate();
+            section.CmdBuffer->BeginRecording(VK_NULL_HANDLE, 0);
+            for (const auto& split : SplitSignals)
+            {
+                split->Stages = split->Image->GetLastAccessStages(split->Range);
+                if (!split->Stages)
+                    split->Stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+                split->Generation = split->Image->GetAccessGeneration();
+                vkCmdSetEvent(section.CmdBuffer->GetHandle(), split->Event, split->Stages);
+            }
+            section.CmdBuffer->EndRecording();
+            Sections.push_back(std::move(section));
+        }
+
+        // Released once everything above is done with them. The receiving queues acquire them
+        //   before their next submission, waiting on the semaphores below
+        if (!OwnershipTransfers.empty())
+        {
+            auto& device = GetQueue().GetDevice();
+            uint32_t srcFamily = device.GetQueueFamily(GetQueue().GetType());
+            CCommandListSection section;
+            section.CmdBuffer = GetQueue().GetCmdBufferAllocator().Allocate();
+            section.CmdBuffer->BeginRecording(VK_NULL_HANDLE, 0);
+            auto cmdBuffer = section.CmdBuffer->GetHandle();
+            CBarrierBatchVk batch;
+            for (const auto& transfer : OwnershipTransfers)
+            {
+                uint32_t dstFamily = device.GetQueueFamily(transfer.DstQueue->GetType());
+                auto& acquire = GetOwnershipAcquire(*transfer.DstQueue);
+                // Even with nothing to acquire, the semaphore wait needs a stage
+                acquire.DstStages |= VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+                if (transfer.ImageView)
+                {
+                    auto view = std::static_pointer_cast<CImageViewVk>(transfer.ImageView);
+                    view->GetImage()->ReleaseAccess(cmdBuffer, view->GetResourceRange(),
+                                                    srcFamily, dstFamily, acquire, &batch);
+                }
+                else
+                {
+                    auto& buffer = static_cast<CBufferVk&>(*transfer.Buffer);
+                    buffer.ReleaseAccess(cmdBuffer, 0, buffer.GetSize(), srcFamily, dstFamily,
+                                         acquire, &batch);
+                }
+            }
+            batch.Flush(cmdBuffer);
+            section.CmdBuffer->EndRecording();
+            Sections.push_back(std::move(section));
+            OwnershipTransfers.clear();
+        }
+
+        auto& first = Sections.front();
+        first.WaitSemaphores.insert(first.WaitSemaphores.end(), QueueWaitSemaphores.begin(),
+                                    QueueWaitSemaphores.end());
+        first.WaitStages.insert(first.WaitStages.end(), QueueWaitStages.begin(),
+                                QueueWaitStages.end());
+        auto& last = Sections.back();
+        last.SignalSemaphores.insert(last.SignalSemaphores.end(), QueueSignalSemaphores.begin(),
+                                     QueueSignalSemaphores.end());
+        // The receiving queue cleans these up along with the acquires
+        for (auto& iter : OwnershipAcquires)
+        {
+            VkSemaphoreCreateInfo semaphoreInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+            VK(vkCreateSemaphore(GetQueue().GetDevice().GetVkDevice(), &semaphoreInfo, nullptr,
+                                 &iter.second.Semaphore));
+            last.SignalSemaphores.push_back(iter.second.Semaphore);
+        }
+    }
+    else if (!QueueWaitSemaphores.empty() || !QueueSignalSemaphores.empty())
+    {
+        // Nothing recorded, but the other queue still relies on us
+        VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+        submitInfo.waitSemaphoreCount = static_cast<uint32_t>(QueueWaitSemaphores.size());
+        submitInfo.pWaitSemaphores = QueueWaitSemaphores.data();
+        submitInfo.pWaitDstStageMask = QueueWaitStages.data();
+        submitInfo.signalSemaphoreCount = static_cast<uint32_t>(QueueSignalSemaphores.size());
+        submitInfo.pSignalSemaphores = QueueSignalSemaphores.data();
+        submitInfos.push_back(submitInfo);
+    }
+
+    // Waiter cleans up the semaphore
+    for (VkSemaphore semaphore : QueueWaitSemaphores)
+    {
+        GetQueue().GetDevice().AddPostFrameCleanup([semaphore](CDeviceVk& p) {
+            vkDestroySemaphore(p.GetVkDevice(), semaphore, nullptr);
+        });
+    }
+    // And the event
+    for (const auto& split : SplitWaits)
     {
-        assert(Sections[0].PreCmdBuffer == nullptr);
-        Sections[0].PreCmdBuffer = GetQueue().GetCmdBufferAllocator().Allocate();
-        Sections[0].PreCmdBuffer->BeginRecording(VK_NULL_HANDLE, 0);
-        Sections[0].AccessTracker.DeployAllBarriers(Sections[0].PreCmdBuffer->GetHandle());
-        Sections[0].AccessTracker.Clear();
-        Sections[0].PreCmdBuffer->EndRecording();
+        VkEvent event = split->Event;
+        GetQueue().GetDevice().AddPostFrameCleanup(
+            [event](CDeviceVk& p) { vkDestroyEvent(p.GetVkDevice(), event, nullptr); });
     }
+    SplitSignals.clear();
+    SplitWaits.clear();
 
+    // Our own sections may join the first one's wait, a previous list's wait is none of our
+    //   business
+    size_t firstInfo = submitInfos.size();
     for (const auto& iter : Sections)
-        submitInfos.emplace_back(iter.MakeSubmitInfo(stagingArray));
+        iter.AddToSubmitInfos(submitInfos, stagingArray, submitInfos.size() > firstInfo);
 }
 
 void CCommandListVk::ReleaseAllResources() { Sections.clear(); }
@@ -1,16 +1,25 @@
 #pragma once
 #include "AccessTracker.h"
 #include "CommandBufferVk.h"
+#include "CommandStreamVk.h"
 #include "ComputeContext.h"
 #include "CopyContext.h"
 #include "RenderContext.h"
 #include "VkCommon.h"
+#include <SpinLock.h>
+#include <deque>
 #include <memory>
 #include <vector>
 
 namespace RHI
 {
 
+struct CBindCounters
+{
+    uint32_t Requested = 0; // Pipeline, vertex/index buffer and dynamic state calls
+    uint32_t Filtered = 0; // The ones dropped since they would not change anything
+};
+
 // A command list of made up from multiple sections (copy pass, compute pass, etc)
 struct CCommandListSection
 {
@@ -24,8 +33,12 @@ struct CCommandListSection
     std::vector<VkSemaphore> SignalSemaphores;
 
     CAccessTracker AccessTracker;
+    CBindCounters BindCounters;
 
-    VkSubmitInfo MakeSubmitInfo(std::vector<VkCommandBuffer>& stagingArray) const;
+    // Joins the last submit info when nothing has to wait or signal in between. That one may
+    //   only wait on semaphores if mergeAfterWait is set
+    void AddToSubmitInfos(std::vector<VkSubmitInfo>& submitInfos,
+                          std::vector<VkCommandBuffer>& stagingArray, bool mergeAfterWait) const;
 };
 
 class CCommandListVk : public CCommandList
@@ -44,18 +57,47 @@ public:
 
     void Enqueue() override;
     void Commit() override;
+    void WaitForCommandList(CCommandList& signaler) override;
+    void SplitBarrier(CCommandList& waiter, const CImageView::Ref& view) override;
+    void TransferOwnership(CCommandList& receiver, const CImageView::Ref& view) override;
+    void TransferOwnership(CCommandList& receiver, const CBuffer::Ref& buffer) override;
 
     ICopyContext::Ref CreateCopyContext() override;
     IComputeContext::Ref CreateComputeContext() override;
+    IComputeContext::Ref CreateDeferredComputeContext() override;
     IParallelRenderContext::Ref
     CreateParallelRenderContext(CRenderPass::Ref renderPass,
                                 const std::vector<CClearValue>& clearValues) override;
 
+    // Every context reserves its section when it is created, so the sections keep the order the
+    //   contexts were created in. Only one direct context may be active at a time, deferred ones
+    //   can be created next to it from any thread
+    size_t AddSection(bool isDeferred);
+    CCommandListSection& GetSection(size_t index);
+    // Called by the direct context when it is done
+    void EndContext();
+    // Deferred contexts hand their streams in from whatever thread they finished on
+    void AddDeferredStream(size_t sectionIndex, std::unique_ptr<CCommandStreamVk> stream);
+
+    // Barrier calls recorded into this list, summed over all sections
+    CBarrierCounters GetBarrierCounters() const;
+    CBindCounters GetBindCounters() const;
+
+    // Where the acquire halves of the ownership transfers to dstQueue are collected
+    COwnershipAcquireVk& GetOwnershipAcquire(CCommandQueueVk& dstQueue);
+    // Pass the acquires on to their queues. Only after this list's submission is on the queue,
+    //   since they wait on the semaphores it signals
+    void HandOverOwnership();
+
+    // Called by the queue with the device's resource state lock held
     void MakeSubmitInfos(std::vector<VkSubmitInfo>& submitInfos,
                          std::vector<VkCommandBuffer>& stagingArray);
     void ReleaseAllResources();
 
 private:
+    // Turns the streams into the sections reserved for them, on the device's worker threads
+    void TranslateDeferredStreams();
+
     // Not holding a reference to prevent circular reference
     CCommandQueueVk& Parent;
     // Whether this command list is enqueued
@@ -64,11 +106,39 @@ private:
     bool bIsCommitted = false;
 
     // The context has access to all the temporary states
-    // NOTE: Sections[0].AccessTracker tracks the entire command list
-    // NOTE: Each of these "sections" become a VkSubmitInfo
-    std::vector<CCommandListSection> Sections;
+    // NOTE: Each section's AccessTracker only sees that section. They are resolved against the
+    //   images and buffers one after another on submission
+    // NOTE: Sections are submitted back to back, in as few VkSubmitInfos as the semaphores allow
+    // NOTE: A deque, since the contexts keep references to their sections while others get added
+    std::deque<CCommandListSection> Sections;
     // Whether there is a context currently recording into this
     bool bIsContextActive = false;
+
+    // Deferred contexts can record all at once, and next to a regular one. Guards adding to
+    //   Sections, bIsContextActive and the deferred streams
+    tc::FSpinLock DeferredLock;
+    uint32_t OpenDeferredCount = 0;
+    std::vector<std::pair<size_t, std::unique_ptr<CCommandStreamVk>>> DeferredStreams;
+
+    // Cross-queue dependencies, attached to the first and the last section on submission
+    std::vector<VkSemaphore> QueueWaitSemaphores;
+    std::vector<VkPipelineStageFlags> QueueWaitStages;
+    std::vector<VkSemaphore> QueueSignalSemaphores;
+
+    // Events set after the last section, and the ones the first section waits on
+    std::vector<std::shared_ptr<CSplitBarrierVk>> SplitSignals;
+    std::vector<std::shared_ptr<CSplitBarrierVk>> SplitWaits;
+
+    // Ownership transfers to other queue families, one semaphore per receiving queue
+    std::vector<std::pair<CCommandQueueVk*, COwnershipAcquireVk>> OwnershipAcquires;
+    // Resources released after the last section, either an image view or a buffer each
+    struct COwnershipTransfer
+    {
+        CCommandQueueVk* DstQueue;
+        CImageView::Ref ImageView;
+        CBuffer::Ref Buffer;
+    };
+    std::vector<COwnershipTransfer> OwnershipTransfers;
 };
 
 }
@@ -9,7 +9,7 @@ CCommandQueueVk::CCommandQueueVk(CDeviceVk& p, EQueueType queueType, VkQueue han
     : Parent(p)
     , Type(queueType)
     , Handle(handle)
-    , CmdBufferAllocator(p, queueType)
+    , CmdBufferAllocator(p, queueType, FrameIndexCount)
     , FrameResources { p, p, p }
 {
     // Fences are created signaled, unsignal the first one
@@ -37,14 +37,67 @@ void CCommandQueueVk::EnqueueCommandList(CCommandListVk::Ref cmdList)
     QueuedLists.push_back(std::move(cmdList));
 }
 
+void CCommandQueueVk::AddOwnershipAcquire(COwnershipAcquireVk acquire)
+{
+    std::lock_guard<tc::FSpinLock> lk(AcquireLock);
+    PendingAcquires.push_back(std::move(acquire));
+}
+
 void CCommandQueueVk::Submit(bool setFence)
 {
     std::lock_guard<std::mutex> lk(Mutex);
 
-    // Try to submit all queued lists that are committed
+    std::vector<COwnershipAcquireVk> acquires;
+    {
+        std::lock_guard<tc::FSpinLock> lka(AcquireLock);
+        acquires.swap(PendingAcquires);
+    }
+
     std::vector<VkCommandBuffer> cmdBufferStaging;
     cmdBufferStaging.reserve(512);
     std::vector<VkSubmitInfo> submitInfos;
+
+    // Acquires go before everything else, none of the lists can use the resources without them
+    std::vector<VkSemaphore> acquireSemaphores;
+    std::vector<VkPipelineStageFlags> acquireWaitStages;
+    if (!acquires.empty())
+    {
+        auto cmdBuffer = CmdBufferAllocator.Allocate();
+        cmdBuffer->BeginRecording(VK_NULL_HANDLE, 0);
+        for (const auto& acquire : acquires)
+        {
+            // Source stages match the semaphore wait so that the two form a dependency chain
+            vkCmdPipelineBarrier(cmdBuffer->GetHandle(), acquire.DstStages, acquire.DstStages, 0,
+                                 0, nullptr,
+                                 static_cast<uint32_t>(acquire.BufferBarriers.size()),
+                                 acquire.BufferBarriers.data(),
+                                 static_cast<uint32_t>(acquire.ImageBarriers.size()),
+                                 acquire.ImageBarriers.data());
+            acquireSemaphores.push_back(acquire.Semaphore);
+            acquireWaitStages.push_back(acquire.DstStages);
+        }
+        cmdBuffer->EndRecording();
+        cmdBufferStaging.push_back(cmdBuffer->GetHandle());
+
+        VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+        submitInfo.waitSemaphoreCount = static_cast<uint32_t>(acquireSemaphores.size());
+        submitInfo.pWaitSemaphores = acquireSemaphores.data();
+        submitInfo.pWaitDstStageMask = acquireWaitStages.data();
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &cmdBufferStaging.back();
+        submitInfos.push_back(submitInfo);
+
+        auto& frame = FrameResources[CurrFrameIndex];
+        frame.AcquireBuffers.push_back(std::move(cmdBuffer));
+        for (VkSemaphore semaphore : acquireSemaphores)
+            frame.PostFrameCleanup.emplace_back([semaphore](CDeviceVk& p) {
+                vkDestroySemaphore(p.GetVkDevice(), semaphore, nullptr);
+            });
+    }
+
+    // Try to submit all queued lists that are committed. The other queues resolve against the same
+    //   images and buffers, so the lock is held until the lists are actually on the queue
+    std::unique_lock<std::mutex> lks(GetDevice().GetResourceStateMutex());
     size_t submittedCount = 0;
     for (const auto& list : QueuedLists)
     {
@@ -61,7 +114,8 @@ void CCommandQueueVk::Submit(bool setFence)
             break;
     }
 
-	if (submittedCount == 0)
+    // A frame fence has to be signaled even if there is nothing to submit
+    if (submittedCount == 0 && acquires.empty() && !setFence)
         return;
 
     QueuedLists.erase(QueuedLists.begin(), QueuedLists.begin() + submittedCount);
@@ -73,6 +127,12 @@ void CCommandQueueVk::Submit(bool setFence)
     else
         VK(vkQueueSubmit(GetHandle(), static_cast<uint32_t>(submitInfos.size()), submitInfos.data(),
                          VK_NULL_HANDLE));
+    lks.unlock();
+
+    // Our semaphores are pending now, the receiving queues may wait on them
+    auto& inFlight = FrameResources[CurrFrameIndex].ListsInFlight;
+    for (size_t i = inFlight.size() - submittedCount; i < inFlight.size(); i++)
+        inFlight[i]->HandOverOwnership();
 
     std::lock_guard<std::mutex> lkd(GetDevice().DeviceMutex);
     auto& fnList = FrameResources[CurrFrameIndex].PostFrameCleanup;
@@ -86,9 +146,14 @@ void CCommandQueueVk::SubmitFrame()
     // Do Submit() and advance frame index
     Submit(true);
 
-    GetDevice().GetHugeConstantBuffer()->MarkBlockEnd();
-    FrameResources[CurrFrameIndex].PostFrameCleanup.emplace_back(
-        [](CDeviceVk& p) { p.GetHugeConstantBuffer()->FreeBlock(); });
+    // The render queue waits on all the other queues' work by the end of the frame, so it owns
+    //   the constant buffer blocks
+    if (this == GetDevice().GetDefaultRenderQueue().get())
+    {
+        GetDevice().GetHugeConstantBuffer()->MarkBlockEnd();
+        FrameResources[CurrFrameIndex].PostFrameCleanup.emplace_back(
+            [](CDeviceVk& p) { p.GetHugeConstantBuffer()->FreeBlock(); });
+    }
 
     // Advance
     CurrFrameIndex++;
@@ -97,6 +162,7 @@ void CCommandQueueVk::SubmitFrame()
                        1000000000)); // 1s timeout
     VK(vkResetFences(Parent.GetVkDevice(), 1, &FrameResources[CurrFrameIndex].Fence));
     FrameResources[CurrFrameIndex].Reset();
+    CmdBufferAllocator.BeginFrame(CurrFrameIndex);
 }
 
 CCommandQueueVk::CFrameResources::CFrameResources(CDeviceVk& deviceVk)
@@ -120,6 +186,7 @@ void CCommandQueueVk::CFrameResources::Reset()
     for (const auto& cleanupFn : PostFrameCleanup)
         cleanupFn(DeviceVk);
     ListsInFlight.clear();
+    AcquireBuffers.clear();
     PostFrameCleanup.clear();
 }
 
@@ -31,10 +31,12 @@ public:
 
     // Reserve a spot for the command list in this queue
     void EnqueueCommandList(CCommandListVk::Ref cmdList);
+    // Resources another queue family gave up to us, acquired ahead of the next submission
+    void AddOwnershipAcquire(COwnershipAcquireVk acquire);
 
     // Submit all committed command lists
     void Submit(bool setFence = false);
-    // Submit and advance frame index
+    // Submit and advance frame index. No command list may be recording across it
     void SubmitFrame();
 
 private:
@@ -47,6 +49,10 @@ private:
 
     std::vector<CCommandListVk::Ref> QueuedLists;
 
+    // Other queues hand these over while holding their own mutex
+    tc::FSpinLock AcquireLock;
+    std::vector<COwnershipAcquireVk> PendingAcquires;
+
     static const uint32_t FrameIndexCount = 3;
     struct CFrameResources
     {
@@ -54,6 +60,7 @@ private:
         VkFence Fence = VK_NULL_HANDLE;
 
         std::vector<CCommandListVk::Ref> ListsInFlight;
+        std::vector<std::unique_ptr<CCommandBufferVk>> AcquireBuffers;
         std::vector<std::function<void(CDeviceVk&)>> PostFrameCleanup;
 
         CFrameResources(CDeviceVk& deviceVk);
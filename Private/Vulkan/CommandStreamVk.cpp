@@ -0,0 +1,276 @@
+#include "CommandStreamVk.h"
+#include "CommandContextVk.h"
+#include <cstring>
+#include <type_traits>
+
+namespace RHI
+{
+
+namespace
+{
+
+struct CCommandHeader
+{
+    EStreamCommand Command;
+    uint32_t Size; // Of the arguments right after
+};
+
+struct CPipelineArgs
+{
+    CPipeline* Pipeline;
+};
+
+struct CDescriptorSetArgs
+{
+    uint32_t Set;
+    CDescriptorSet* DescriptorSet;
+};
+
+struct CDispatchArgs
+{
+    uint32_t GroupCountX;
+    uint32_t GroupCountY;
+    uint32_t GroupCountZ;
+};
+
+// Index and vertex buffers
+struct CBindBufferArgs
+{
+    CBuffer* Buffer;
+    size_t Offset;
+    uint32_t Binding;
+    EFormat Format;
+};
+
+struct CDrawArgs
+{
+    uint32_t Count;
+    uint32_t InstanceCount;
+    uint32_t First;
+    int32_t VertexOffset;
+    uint32_t FirstInstance;
+};
+
+struct CIndirectArgs
+{
+    CBuffer* Buffer;
+    size_t Offset;
+    uint32_t DrawCount;
+    uint32_t Stride;
+};
+
+// Keeps every header 8 byte aligned
+uint32_t AlignedSize(size_t size) { return static_cast<uint32_t>((size + 7) & ~size_t(7)); }
+
+template <typename T> T Read(const uint8_t* data)
+{
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+}
+
+template <typename T> void CCommandStreamVk::Write(EStreamCommand command, const T& args)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "Stream arguments are copied as bytes");
+    CCommandHeader header { command, AlignedSize(sizeof(T)) };
+    size_t size = sizeof(CCommandHeader) + header.Size;
+    if (Chunks.empty() || Chunks.back().Used + size > kChunkSize)
+        Chunks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[kChunkSize]), 0 });
+
+    auto& chunk = Chunks.back();
+    memcpy(chunk.Data.get() + chunk.Used, &header, sizeof(header));
+    memcpy(chunk.Data.get() + chunk.Used + sizeof(header), &args, sizeof(T));
+    chunk.Used += size;
+    CommandCount++;
+}
+
+void CCommandStreamVk::BindComputePipeline(CPipeline& pipeline)
+{
+    Write(EStreamCommand::BindComputePipeline, CPipelineArgs { &pipeline });
+}
+
+void CCommandStreamVk::BindComputeDescriptorSet(uint32_t set, CDescriptorSet& descriptorSet)
+{
+    Write(EStreamCommand::BindComputeDescriptorSet, CDescriptorSetArgs { set, &descriptorSet });
+}
+
+void CCommandStreamVk::Dispatch(uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ)
+{
+    Write(EStreamCommand::Dispatch, CDispatchArgs { groupCountX, groupCountY, groupCountZ });
+}
+
+void CCommandStreamVk::DispatchIndirect(CBuffer& buffer, size_t offset)
+{
+    Write(EStreamCommand::DispatchIndirect, CIndirectArgs { &buffer, offset, 0, 0 });
+}
+
+void CCommandStreamVk::BindRenderPipeline(CPipeline& pipeline)
+{
+    Write(EStreamCommand::BindRenderPipeline, CPipelineArgs { &pipeline });
+}
+
+void CCommandStreamVk::SetViewport(const CViewportDesc& viewportDesc)
+{
+    Write(EStreamCommand::SetViewport, viewportDesc);
+}
+
+void CCommandStreamVk::SetScissor(const CRect2D& scissor)
+{
+    Write(EStreamCommand::SetScissor, scissor);
+}
+
+void CCommandStreamVk::SetBlendConstants(const std::array<float, 4>& blendConstants)
+{
+    Write(EStreamCommand::SetBlendConstants, blendConstants);
+}
+
+void CCommandStreamVk::SetStencilReference(uint32_t reference)
+{
+    Write(EStreamCommand::SetStencilReference, reference);
+}
+
+void CCommandStreamVk::BindRenderDescriptorSet(uint32_t set, CDescriptorSet& descriptorSet)
+{
+    Write(EStreamCommand::BindRenderDescriptorSet, CDescriptorSetArgs { set, &descriptorSet });
+}
+
+void CCommandStreamVk::BindIndexBuffer(CBuffer& buffer, size_t offset, EFormat format)
+{
+    Write(EStreamCommand::BindIndexBuffer, CBindBufferArgs { &buffer, offset, 0, format });
+}
+
+void CCommandStreamVk::BindVertexBuffer(uint32_t binding, CBuffer& buffer, size_t offset)
+{
+    Write(EStreamCommand::BindVertexBuffer,
+          CBindBufferArgs { &buffer, offset, binding, EFormat::UNDEFINED });
+}
+
+void CCommandStreamVk::Draw(uint32_t vertexCount, uint32_t instanceCount, uint32_t firstVertex,
+                            uint32_t firstInstance)
+{
+    Write(EStreamCommand::Draw,
+          CDrawArgs { vertexCount, instanceCount, firstVertex, 0, firstInstance });
+}
+
+void CCommandStreamVk::DrawIndexed(uint32_t indexCount, uint32_t instanceCount,
+                                   uint32_t firstIndex, int32_t vertexOffset,
+                                   uint32_t firstInstance)
+{
+    Write(EStreamCommand::DrawIndexed,
+          CDrawArgs { indexCount, instanceCount, firstIndex, vertexOffset, firstInstance });
+}
+
+void CCommandStreamVk::DrawIndirect(CBuffer& buffer, size_t offset, uint32_t drawCount,
+                                    uint32_t stride)
+{
+    Write(EStreamCommand::DrawIndirect, CIndirectArgs { &buffer, offset, drawCount, stride });
+}
+
+void CCommandStreamVk::DrawIndexedIndirect(CBuffer& buffer, size_t offset, uint32_t drawCount,
+                                           uint32_t stride)
+{
+    Write(EStreamCommand::DrawIndexedIndirect,
+          CIndirectArgs { &buffer, offset, drawCount, stride });
+}
+
+void CCommandStreamVk::Translate(CCommandContextVk& ctx) const
+{
+    for (const auto& chunk : Chunks)
+    {
+        const uint8_t* cursor = chunk.Data.get();
+        const uint8_t* end = cursor + chunk.Used;
+        while (cursor < end)
+        {
+            auto header = Read<CCommandHeader>(cursor);
+            const uint8_t* args = cursor + sizeof(CCommandHeader);
+            cursor = args + header.Size;
+
+            switch (header.Command)
+            {
+            case EStreamCommand::BindComputePipeline:
+                ctx.BindComputePipeline(*Read<CPipelineArgs>(args).Pipeline);
+                break;
+            case EStreamCommand::BindComputeDescriptorSet:
+            {
+                auto a = Read<CDescriptorSetArgs>(args);
+                ctx.BindComputeDescriptorSet(a.Set, *a.DescriptorSet);
+                break;
+            }
+            case EStreamCommand::Dispatch:
+            {
+                auto a = Read<CDispatchArgs>(args);
+                ctx.Dispatch(a.GroupCountX, a.GroupCountY, a.GroupCountZ);
+                break;
+            }
+            case EStreamCommand::DispatchIndirect:
+            {
+                auto a = Read<CIndirectArgs>(args);
+                ctx.DispatchIndirect(*a.Buffer, a.Offset);
+                break;
+            }
+            case EStreamCommand::BindRenderPipeline:
+                ctx.BindRenderPipeline(*Read<CPipelineArgs>(args).Pipeline);
+                break;
+            case EStreamCommand::SetViewport:
+                ctx.SetViewport(Read<CViewportDesc>(args));
+                break;
+            case EStreamCommand::SetScissor:
+                ctx.SetScissor(Read<CRect2D>(args));
+                break;
+            case EStreamCommand::SetBlendConstants:
+                ctx.SetBlendConstants(Read<std::array<float, 4>>(args));
+                break;
+            case EStreamCommand::SetStencilReference:
+                ctx.SetStencilReference(Read<uint32_t>(args));
+                break;
+            case EStreamCommand::BindRenderDescriptorSet:
+            {
+                auto a = Read<CDescriptorSetArgs>(args);
+                ctx.BindRenderDescriptorSet(a.Set, *a.DescriptorSet);
+                break;
+            }
+            case EStreamCommand::BindIndexBuffer:
+            {
+                auto a = Read<CBindBufferArgs>(args);
+                ctx.BindIndexBuffer(*a.Buffer, a.Offset, a.Format);
+                break;
+            }
+            case EStreamCommand::BindVertexBuffer:
+            {
+                auto a = Read<CBindBufferArgs>(args);
+                ctx.BindVertexBuffer(a.Binding, *a.Buffer, a.Offset);
+                break;
+            }
+            case EStreamCommand::Draw:
+            {
+                auto a = Read<CDrawArgs>(args);
+                ctx.Draw(a.Count, a.InstanceCount, a.First, a.FirstInstance);
+                break;
+            }
+            case EStreamCommand::DrawIndexed:
+            {
+                auto a = Read<CDrawArgs>(args);
+                ctx.DrawIndexed(a.Count, a.InstanceCount, a.First, a.VertexOffset,
+                                a.FirstInstance);
+                break;
+            }
+            case EStreamCommand::DrawIndirect:
+            {
+                auto a = Read<CIndirectArgs>(args);
+                ctx.DrawIndirect(*a.Buffer, a.Offset, a.DrawCount, a.Stride);
+                break;
+            }
+            case EStreamCommand::DrawIndexedIndirect:
+            {
+                auto a = Read<CIndirectArgs>(args);
+                ctx.DrawIndexedIndirect(*a.Buffer, a.Offset, a.DrawCount, a.Stride);
+                break;
+            }
+            }
+        }
+    }
+}
+
+}
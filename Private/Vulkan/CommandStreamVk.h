@@ -0,0 +1,78 @@
+#pragma once
+#include "RenderContext.h"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace RHI
+{
+
+class CCommandContextVk;
+
+enum class EStreamCommand : uint32_t
+{
+    BindComputePipeline,
+    BindComputeDescriptorSet,
+    Dispatch,
+    DispatchIndirect,
+    BindRenderPipeline,
+    SetViewport,
+    SetScissor,
+    SetBlendConstants,
+    SetStencilReference,
+    BindRenderDescriptorSet,
+    BindIndexBuffer,
+    BindVertexBuffer,
+    Draw,
+    DrawIndexed,
+    DrawIndirect,
+    DrawIndexedIndirect
+};
+
+// Compute and render commands packed into arena chunks, without touching the driver or the access
+//   trackers. Only plain pointers are kept, what they point to has to outlive the translation
+class CCommandStreamVk
+{
+public:
+    // Compute commands
+    void BindComputePipeline(CPipeline& pipeline);
+    void BindComputeDescriptorSet(uint32_t set, CDescriptorSet& descriptorSet);
+    void Dispatch(uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ);
+    void DispatchIndirect(CBuffer& buffer, size_t offset);
+
+    // Render commands
+    void BindRenderPipeline(CPipeline& pipeline);
+    void SetViewport(const CViewportDesc& viewportDesc);
+    void SetScissor(const CRect2D& scissor);
+    void SetBlendConstants(const std::array<float, 4>& blendConstants);
+    void SetStencilReference(uint32_t reference);
+    void BindRenderDescriptorSet(uint32_t set, CDescriptorSet& descriptorSet);
+    void BindIndexBuffer(CBuffer& buffer, size_t offset, EFormat format);
+    void BindVertexBuffer(uint32_t binding, CBuffer& buffer, size_t offset);
+    void Draw(uint32_t vertexCount, uint32_t instanceCount, uint32_t firstVertex,
+              uint32_t firstInstance);
+    void DrawIndexed(uint32_t indexCount, uint32_t instanceCount, uint32_t firstIndex,
+                     int32_t vertexOffset, uint32_t firstInstance);
+    void DrawIndirect(CBuffer& buffer, size_t offset, uint32_t drawCount, uint32_t stride);
+    void DrawIndexedIndirect(CBuffer& buffer, size_t offset, uint32_t drawCount, uint32_t stride);
+
+    // Replays the commands into ctx in recording order. Everything the direct path does (access
+    //   tracking, barriers, redundant state filtering) happens here
+    void Translate(CCommandContextVk& ctx) const;
+    size_t GetCommandCount() const { return CommandCount; }
+
+private:
+    template <typename T> void Write(EStreamCommand command, const T& args);
+
+    struct CChunk
+    {
+        std::unique_ptr<uint8_t[]> Data;
+        size_t Used;
+    };
+    static const size_t kChunkSize = 16 * 1024;
+    std::vector<CChunk> Chunks;
+    size_t CommandCount = 0;
+};
+
+}
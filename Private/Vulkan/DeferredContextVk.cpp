@@ -0,0 +1,122 @@
+#include "DeferredContextVk.h"
+
+namespace RHI
+{
+
+CDeferredContextVk::CDeferredContextVk(const CCommandListVk::Ref& cmdList, size_t sectionIndex)
+    : CmdList(cmdList)
+    , SectionIndex(sectionIndex)
+    , Stream(std::make_unique<CCommandStreamVk>())
+{
+}
+
+CDeferredContextVk::CDeferredContextVk(const CRenderPassContextVk::Ref& renderPassContext,
+                                       uint32_t subpass, uint32_t cmdBufferIndex)
+    : RenderPassContext(renderPassContext)
+    , SubpassIndex(subpass)
+    , CmdBufferIndex(cmdBufferIndex)
+    , Stream(std::make_unique<CCommandStreamVk>())
+{
+}
+
+void CDeferredContextVk::BindComputePipeline(CPipeline& pipeline)
+{
+    Stream->BindComputePipeline(pipeline);
+}
+
+void CDeferredContextVk::BindComputeDescriptorSet(uint32_t set, CDescriptorSet& descriptorSet)
+{
+    Stream->BindComputeDescriptorSet(set, descriptorSet);
+}
+
+void CDeferredContextVk::Dispatch(uint32_t groupCountX, uint32_t groupCountY,
+                                  uint32_t groupCountZ)
+{
+    Stream->Dispatch(groupCountX, groupCountY, groupCountZ);
+}
+
+void CDeferredContextVk::DispatchIndirect(CBuffer& buffer, size_t offset)
+{
+    Stream->DispatchIndirect(buffer, offset);
+}
+
+void CDeferredContextVk::BindRenderPipeline(CPipeline& pipeline)
+{
+    Stream->BindRenderPipeline(pipeline);
+}
+
+void CDeferredContextVk::SetViewport(const CViewportDesc& viewportDesc)
+{
+    Stream->SetViewport(viewportDesc);
+}
+
+void CDeferredContextVk::SetScissor(const CRect2D& scissor) { Stream->SetScissor(scissor); }
+
+void CDeferredContextVk::SetBlendConstants(const std::array<float, 4>& blendConstants)
+{
+    Stream->SetBlendConstants(blendConstants);
+}
+
+void CDeferredContextVk::SetStencilReference(uint32_t reference)
+{
+    Stream->SetStencilReference(reference);
+}
+
+void CDeferredContextVk::BindRenderDescriptorSet(uint32_t set, CDescriptorSet& descriptorSet)
+{
+    Stream->BindRenderDescriptorSet(set, descriptorSet);
+}
+
+void CDeferredContextVk::BindIndexBuffer(CBuffer& buffer, size_t offset, EFormat format)
+{
+    Stream->BindIndexBuffer(buffer, offset, format);
+}
+
+void CDeferredContextVk::BindVertexBuffer(uint32_t binding, CBuffer& buffer, size_t offset)
+{
+    Stream->BindVertexBuffer(binding, buffer, offset);
+}
+
+void CDeferredContextVk::Draw(uint32_t vertexCount, uint32_t instanceCount, uint32_t firstVertex,
+                              uint32_t firstInstance)
+{
+    Stream->Draw(vertexCount, instanceCount, firstVertex, firstInstance);
+}
+
+void CDeferredContextVk::DrawIndexed(uint32_t indexCount, uint32_t instanceCount,
+                                     uint32_t firstIndex, int32_t vertexOffset,
+                                     uint32_t firstInstance)
+{
+    Stream->DrawIndexed(indexCount, instanceCount, firstIndex, vertexOffset, firstInstance);
+}
+
+void CDeferredContextVk::DrawIndirect(CBuffer& buffer, size_t offset, uint32_t drawCount,
+                                      uint32_t stride)
+{
+    Stream->DrawIndirect(buffer, offset, drawCount, stride);
+}
+
+void CDeferredContextVk::DrawIndexedIndirect(CBuffer& buffer, size_t offset, uint32_t drawCount,
+                                             uint32_t stride)
+{
+    Stream->DrawIndexedIndirect(buffer, offset, drawCount, stride);
+}
+
+void CDeferredContextVk::FinishRecording()
+{
+    if (!Stream)
+        return;
+
+    if (CmdList)
+    {
+        CmdList->AddDeferredStream(SectionIndex, std::move(Stream));
+        CmdList.reset();
+    }
+    else
+    {
+        RenderPassContext->AddDeferredStream(SubpassIndex, CmdBufferIndex, std::move(Stream));
+        RenderPassContext.reset();
+    }
+}
+
+}
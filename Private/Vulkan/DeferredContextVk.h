@@ -0,0 +1,58 @@
+#pragma once
+#include "CommandContextVk.h"
+#include "CommandStreamVk.h"
+
+namespace RHI
+{
+
+// Records into a command stream from any thread, without calling into the driver. The stream is
+//   translated on worker threads, when the list is committed or when the render pass finishes
+class CDeferredContextVk : public IComputeContext, public IRenderContext
+{
+public:
+    typedef std::shared_ptr<CDeferredContextVk> Ref;
+
+    CDeferredContextVk(const CCommandListVk::Ref& cmdList, size_t sectionIndex);
+    CDeferredContextVk(const CRenderPassContextVk::Ref& renderPassContext, uint32_t subpass,
+                       uint32_t cmdBufferIndex);
+
+    // Compute commands
+    void BindComputePipeline(CPipeline& pipeline) override;
+    void BindComputeDescriptorSet(uint32_t set, CDescriptorSet& descriptorSet) override;
+    void Dispatch(uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ) override;
+    void DispatchIndirect(CBuffer& buffer, size_t offset) override;
+
+    // Render commands
+    void BindRenderPipeline(CPipeline& pipeline) override;
+    void SetViewport(const CViewportDesc& viewportDesc) override;
+    void SetScissor(const CRect2D& scissor) override;
+    void SetBlendConstants(const std::array<float, 4>& blendConstants) override;
+    void SetStencilReference(uint32_t reference) override;
+    void BindRenderDescriptorSet(uint32_t set, CDescriptorSet& descriptorSet) override;
+    void BindIndexBuffer(CBuffer& buffer, size_t offset, EFormat format) override;
+    void BindVertexBuffer(uint32_t binding, CBuffer& buffer, size_t offset) override;
+    void Draw(uint32_t vertexCount, uint32_t instanceCount, uint32_t firstVertex,
+              uint32_t firstInstance) override;
+    void DrawIndexed(uint32_t indexCount, uint32_t instanceCount, uint32_t firstIndex,
+                     int32_t vertexOffset, uint32_t firstInstance) override;
+    void DrawIndirect(CBuffer& buffer, size_t offset, uint32_t drawCount, uint32_t stride) override;
+    void DrawIndexedIndirect(CBuffer& buffer, size_t offset, uint32_t drawCount,
+                             uint32_t stride) override;
+
+    // Hand the stream over for translation
+    void FinishRecording() override;
+
+private:
+    // Where the stream goes, a section the list reserved for us
+    CCommandListVk::Ref CmdList;
+    size_t SectionIndex = 0;
+
+    // Or a secondary buffer slot of a subpass
+    CRenderPassContextVk::Ref RenderPassContext;
+    uint32_t SubpassIndex = 0;
+    uint32_t CmdBufferIndex = 0;
+
+    std::unique_ptr<CCommandStreamVk> Stream;
+};
+
+}
@@ -1,6 +1,7 @@
 #include "DescriptorSetVk.h"
 #include "DeviceVk.h"
 #include "ImageViewVk.h"
+#include "PipelineVk.h"
 #include "SamplerVk.h"
 #include <cstring>
 #include <mutex>
@@ -18,8 +19,18 @@ RHI::CDescriptorSetVk::~CDescriptorSetVk() {}
 void RHI::CDescriptorSetVk::BindBuffer(CBuffer::Ref buffer, size_t offset, size_t range,
                                        uint32_t binding, uint32_t index)
 {
-    auto handle = std::static_pointer_cast<CBufferVk>(buffer)->GetHandle();
-    ResourceBindings.BindBuffer(handle, offset, range, 0, binding, index);
+    auto impl = std::static_pointer_cast<CBufferVk>(buffer);
+
+    VkAccessFlags access = VK_ACCESS_UNIFORM_READ_BIT;
+    VkDescriptorType type = Layout->GetDescriptorType(binding);
+    if (type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+        || type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC)
+        access = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    VkPipelineStageFlags stages = Layout->GetPipelineStages(binding);
+    bHasWritableBindings |= !!(access & VK_ACCESS_SHADER_WRITE_BIT);
+
+    ResourceBindings.BindBuffer(impl->GetHandle(), offset, range, 0, binding, index, impl.get(),
+                                access, stages);
 }
 
 void CDescriptorSetVk::BindConstants(const void* data, size_t size, uint32_t binding,
@@ -38,16 +49,19 @@ void RHI::CDescriptorSetVk::BindImageView(CImageView::Ref imageView, uint32_t bi
 {
     auto impl = std::static_pointer_cast<CImageViewVk>(imageView);
 
+    // Whether the image gets written, and which of these stages use it, is up to the pipeline,
+    //   see TrackAccess
     VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
     VkAccessFlags access = VK_ACCESS_SHADER_READ_BIT;
-    if (Any(impl->GetImage()->GetUsageFlags(), EImageUsageFlags::Storage))
+    if (Layout->GetDescriptorType(binding) == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)
     {
         layout = VK_IMAGE_LAYOUT_GENERAL;
         access |= VK_ACCESS_SHADER_WRITE_BIT;
     }
-    if (GetImageAspectFlags(impl->GetFormat()) != VK_IMAGE_ASPECT_COLOR_BIT)
+    else if (GetImageAspectFlags(impl->GetFormat()) != VK_IMAGE_ASPECT_COLOR_BIT)
         layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
     VkPipelineStageFlags stages = Layout->GetPipelineStages(binding);
+    bHasWritableBindings |= !!(access & VK_ACCESS_SHADER_WRITE_BIT);
 
     ResourceBindings.BindImageView(impl.get(), access, stages, layout, 0, binding, index);
 }
@@ -69,7 +83,23 @@ void CDescriptorSetVk::SetDynamicOffset(size_t offset, uint32_t binding, uint32_
     throw "unimplemented";
 }
 
-VkDescriptorSet RHI::CDescriptorSetVk::GetHandle() { return Handle; }
+VkDescriptorSet RHI::CDescriptorSetVk::GetHandle()
+{
+    std::lock_guard<tc::FSpinLock> lk(Lock);
+    return Handle;
+}
+
+bool CDescriptorSetVk::IsContentDirty()
+{
+    std::lock_guard<tc::FSpinLock> lk(Lock);
+    return ResourceBindings.IsDirty();
+}
+
+void CDescriptorSetVk::SetUsed()
+{
+    std::lock_guard<tc::FSpinLock> lk(Lock);
+    bIsUsed = true;
+}
 
 void CDescriptorSetVk::DiscardAndRecreate()
 {
@@ -86,28 +116,100 @@ void CDescriptorSetVk::DiscardAndRecreate()
     Handle = poolPtr->AllocateDescriptorSet();
 }
 
-void CDescriptorSetVk::WriteUpdates(CAccessTracker& tracker, VkCommandBuffer cmdBuffer)
+#ifndef NDEBUG
+// An explicit-state image has to be declared for at least the stages sampling it
+static void CheckSampledState(const CImageVk& image, VkImageLayout layout,
+                              VkPipelineStageFlags stages)
 {
-    if (!ResourceBindings.IsDirty())
+    EResourceState declared = image.GetDeclaredState();
+    if (layout != VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL || declared == EResourceState::General)
+        return;
+    VkPipelineStageFlags needed = StateToShaderStageMask(ShaderStagesToReadState(stages), false);
+    if ((StateToShaderStageMask(declared, false) & needed) != needed)
+        throw CRHIRuntimeError("Image sampled in a stage its declared state doesn't cover");
+}
+#endif
+
+void CDescriptorSetVk::TrackAccess(CAccessTracker& tracker, VkCommandBuffer cmdBuffer,
+                                   const CPipelineVk& pipeline, uint32_t set)
+{
+    if (ResourceBindings.GetSetBindings().empty())
+        return;
+
+    // Since we only have one descriptor set, the first SetBindings is it
+    auto& setBindings = ResourceBindings.GetSetBindings().begin()->second;
+    for (const auto& bindingIter : setBindings.Bindings)
     {
-        // Update access tracker only
-        auto& setBindings = ResourceBindings.GetSetBindings().begin()->second;
-        for (const auto& bindingIter : setBindings.Bindings)
+        // Storage bindings are only written if the shaders say so, and only the stages of the
+        //   shaders referencing a binding wait for it. The reflection is only looked up for a
+        //   binding with something tracked in it
+        VkAccessFlags reflected = 0;
+        VkPipelineStageFlags reflectedStages = 0;
+        bool isReflected = false;
+        auto reflect = [&]() {
+            if (isReflected)
+                return;
+            reflected = pipeline.GetResourceAccess(set, bindingIter.first);
+            reflectedStages = pipeline.GetResourceStages(set, bindingIter.first);
+            isReflected = true;
+        };
+        for (const auto& arrayIter : bindingIter.second)
         {
-            for (const auto& arrayIter : bindingIter.second)
+            const auto& bindingInfo = arrayIter.second;
+            if (bindingInfo.ImageView && bindingInfo.ImageView->GetImage()->IsExplicitState())
+            {
+#ifndef NDEBUG
+                // Only checks the layout and the sampling stages against the declared state
+                reflect();
+                VkPipelineStageFlags stages = bindingInfo.ImageStages;
+                if (stages & reflectedStages)
+                    stages &= reflectedStages;
+                tracker.TransitionImage(cmdBuffer, bindingInfo.ImageView->GetImage().get(),
+                                        bindingInfo.ImageView->GetResourceRange(),
+                                        bindingInfo.ImageAccess, stages, bindingInfo.ImageLayout);
+                CheckSampledState(*bindingInfo.ImageView->GetImage(), bindingInfo.ImageLayout,
+                                  stages);
+#endif
+                continue;
+            }
+            if (!bindingInfo.ImageView
+                && (!bindingInfo.Buffer || bindingInfo.Buffer->IsExplicitState()))
+                continue;
+            reflect();
+
+            if (bindingInfo.ImageView)
+            {
+                VkAccessFlags access = bindingInfo.ImageAccess;
+                if (access & reflected)
+                    access &= reflected;
+                VkPipelineStageFlags stages = bindingInfo.ImageStages;
+                if (stages & reflectedStages)
+                    stages &= reflectedStages;
+                tracker.TransitionImage(cmdBuffer, bindingInfo.ImageView->GetImage().get(),
+                                        bindingInfo.ImageView->GetResourceRange(), access, stages,
+                                        bindingInfo.ImageLayout);
+            }
+            else
             {
-                if (arrayIter.second.ImageView)
-                {
-                    tracker.TransitionImage(cmdBuffer, arrayIter.second.ImageView->GetImage().get(),
-                                            arrayIter.second.ImageView->GetResourceRange(),
-                                            arrayIter.second.ImageAccess,
-                                            arrayIter.second.ImageStages,
-                                            arrayIter.second.ImageLayout);
-                }
+                VkAccessFlags access = bindingInfo.BufferAccess;
+                if (access & reflected)
+                    access &= reflected;
+                VkPipelineStageFlags stages = bindingInfo.BufferStages;
+                if (stages & reflectedStages)
+                    stages &= reflectedStages;
+                tracker.TransitionBuffer(cmdBuffer, bindingInfo.Buffer, bindingInfo.Offset,
+                                         bindingInfo.Range, access, stages);
             }
         }
-        return;
     }
+}
+
+void CDescriptorSetVk::WriteUpdates()
+{
+    // Whoever gets here first writes, the others find the set clean
+    std::lock_guard<tc::FSpinLock> lk(Lock);
+    if (!ResourceBindings.IsDirty())
+        return;
 
     ResourceBindings.ClearDirtyBit();
 
@@ -147,11 +249,6 @@ void CDescriptorSetVk::WriteUpdates(CAccessTracker& tracker, VkCommandBuffer cmd
                 info.imageView = bindingInfo.ImageView->GetVkImageView();
                 info.imageLayout = bindingInfo.ImageLayout;
 
-                tracker.TransitionImage(cmdBuffer, bindingInfo.ImageView->GetImage().get(),
-                                        bindingInfo.ImageView->GetResourceRange(),
-                                        bindingInfo.ImageAccess, bindingInfo.ImageStages,
-                                        bindingInfo.ImageLayout);
-
                 imageInfos.push_back(info);
                 w.pImageInfo = reinterpret_cast<const VkDescriptorImageInfo*>(imageInfos.size());
             }
@@ -2,10 +2,13 @@
 #include "AccessTracker.h"
 #include "DescriptorSetLayoutVk.h"
 #include "ResourceBindingsVk.h"
+#include <SpinLock.h>
 
 namespace RHI
 {
 
+class CPipelineVk;
+
 class CDescriptorSetVk : public CDescriptorSet
 {
 public:
@@ -23,11 +26,18 @@ public:
     void SetDynamicOffset(size_t offset, uint32_t binding, uint32_t index) override;
 
     // Internal API
+    // NOTE: The deferred streams of a list are translated on several workers at once, so these
+    //   may be called for the same set from different threads. They take Lock
     VkDescriptorSet GetHandle();
-    bool IsContentDirty() const { return ResourceBindings.IsDirty(); }
-    void DiscardAndRecreate(); // Similar to the DX11 MapDiscard semantics
-    void WriteUpdates(CAccessTracker& tracker, VkCommandBuffer cmdBuffer);
-    void SetUsed() { bIsUsed = true; }
+    bool IsContentDirty();
+    void DiscardAndRecreate(); // Similar to the DX11 MapDiscard semantics, needs Lock
+    void WriteUpdates();
+    // Records the accesses of a draw or dispatch with pipeline, which has this bound at set
+    void TrackAccess(CAccessTracker& tracker, VkCommandBuffer cmdBuffer,
+                     const CPipelineVk& pipeline, uint32_t set);
+    // A storage buffer or image was bound at some point, a draw may write through the set
+    bool HasWritableBindings() const { return bHasWritableBindings; }
+    void SetUsed();
 
 private:
     // Holds the layout alive
@@ -37,8 +47,11 @@ private:
     CResourceBindings ResourceBindings;
     VkDescriptorSet Handle = VK_NULL_HANDLE;
 
+    // Guards the handle, the dirty bits and bIsUsed while recording
+    tc::FSpinLock Lock;
     // If used, we can't freely update this anymore
     bool bIsUsed = false;
+    bool bHasWritableBindings = false;
 };
 
 }
@@ -9,7 +9,9 @@
 #include "ShaderModuleVk.h"
 #include "SwapChainVk.h"
 #include "VkHelpers.h"
+#include "WorkerPool.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <vector>
@@ -51,6 +53,8 @@ static void initDebugCallback(VkInstance instance, VkDebugReportCallbackEXT* pCa
 
 static VkInstance Instance;
 static VkDebugReportCallbackEXT DebugRptCallback;
+// Needed to query the features of device extensions
+static bool bHasPhysicalDeviceProperties2 = false;
 
 void InitRHIInstance()
 {
@@ -90,6 +94,12 @@ void InitRHIInstance()
 #endif
     };
 
+    for (const auto& extProp : extensionProps)
+        if (strcmp(extProp.extensionName, "VK_KHR_get_physical_device_properties2") == 0)
+            bHasPhysicalDeviceProperties2 = true;
+    if (bHasPhysicalDeviceProperties2)
+        requiredExtensions.push_back("VK_KHR_get_physical_device_properties2");
+
     const std::vector<const char*> validationLayers = { "VK_LAYER_LUNARG_standard_validation" };
 
 #if defined(NDEBUG)
@@ -205,10 +215,27 @@ CDeviceVk::CDeviceVk(EDeviceCreateHints hints)
             QueueFamilies[static_cast<int>(EQueueType::Copy)] = i;
             break;
         }
+    }
+    // Async compute wants a family of its own, look past the graphics one as well
+    for (uint32_t i = 0; i < queueFamilyCount; i++)
+    {
+        VkQueueFlags flags = queueFamilyProperites[i].queueFlags;
         if ((flags & VK_QUEUE_COMPUTE_BIT) != 0 && (flags & VK_QUEUE_GRAPHICS_BIT) == 0)
+        {
             QueueFamilies[static_cast<int>(EQueueType::Compute)] = i;
-        if ((flags & VK_QUEUE_TRANSFER_BIT) != 0 && (flags & VK_QUEUE_GRAPHICS_BIT) == 0)
+            break;
+        }
+    }
+    // Same for uploads, a transfer-only family usually means a DMA engine
+    for (uint32_t i = 0; i < queueFamilyCount; i++)
+    {
+        VkQueueFlags flags = queueFamilyProperites[i].queueFlags;
+        if ((flags & VK_QUEUE_TRANSFER_BIT) != 0
+            && (flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) == 0)
+        {
             QueueFamilies[static_cast<int>(EQueueType::Copy)] = i;
+            break;
+        }
     }
 
     // Enable all features
@@ -268,6 +295,36 @@ CDeviceVk::CDeviceVk(EDeviceCreateHints hints)
     // Logical Device
     VkDeviceCreateInfo deviceInfo = {};
     deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+#ifdef VK_KHR_synchronization2
+    // Per-barrier stage masks if the driver has them, plain vkCmdPipelineBarrier otherwise
+    VkPhysicalDeviceSynchronization2FeaturesKHR sync2Features = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR
+    };
+    uint32_t deviceExtensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(PhysicalDevice, nullptr, &deviceExtensionCount, nullptr);
+    std::vector<VkExtensionProperties> deviceExtensions(deviceExtensionCount);
+    vkEnumerateDeviceExtensionProperties(PhysicalDevice, nullptr, &deviceExtensionCount,
+                                         deviceExtensions.data());
+    bool hasSync2Extension = std::any_of(
+        deviceExtensions.begin(), deviceExtensions.end(), [](const VkExtensionProperties& prop) {
+            return strcmp(prop.extensionName, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME) == 0;
+        });
+    if (hasSync2Extension && bHasPhysicalDeviceProperties2)
+    {
+        auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(
+            Instance, "vkGetPhysicalDeviceFeatures2KHR");
+        VkPhysicalDeviceFeatures2KHR features2 = {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR
+        };
+        features2.pNext = &sync2Features;
+        getFeatures2(PhysicalDevice, &features2);
+    }
+    if (sync2Features.synchronization2)
+    {
+        extensionNames.push_back(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+        deviceInfo.pNext = &sync2Features;
+    }
+#endif
     deviceInfo.queueCreateInfoCount = (uint32_t)queueInfos.size();
     deviceInfo.pQueueCreateInfos = queueInfos.data();
     deviceInfo.enabledExtensionCount = (uint32_t)extensionNames.size();
@@ -276,6 +333,16 @@ CDeviceVk::CDeviceVk(EDeviceCreateHints hints)
 
     vkCreateDevice(PhysicalDevice, &deviceInfo, nullptr, &Device);
 
+#ifdef VK_KHR_synchronization2
+    if (sync2Features.synchronization2)
+    {
+        auto pipelineBarrier2 = (PFN_vkCmdPipelineBarrier2KHR)vkGetDeviceProcAddr(
+            Device, "vkCmdPipelineBarrier2KHR");
+        CBarrierBatchVk::SetPipelineBarrier2(pipelineBarrier2);
+        bIsSynchronization2Enabled = pipelineBarrier2 != nullptr;
+    }
+#endif
+
     for (int type = 0; type < static_cast<int>(EQueueType::Count); type++)
     {
         int queueCount = queueFamilyProperites.at(QueueFamilies[type]).queueCount;
@@ -298,27 +365,72 @@ CDeviceVk::CDeviceVk(EDeviceCreateHints hints)
     HugeConstantBuffer = std::make_unique<CPersistentMappedRingBuffer>(
         *this, 33554432, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT); // 32M
 
-    DefaultRenderQueue =
-        std::static_pointer_cast<CCommandQueueVk>(CreateCommandQueue(EQueueType::Render));
-    if (!IsTransferQueueSeparate())
+    DefaultRenderQueue = std::make_shared<CCommandQueueVk>(*this, EQueueType::Render,
+                                                           GetVkQueue(EQueueType::Render));
+    if (IsTransferQueueSeparate())
+        DefaultCopyQueue = std::make_shared<CCommandQueueVk>(*this, EQueueType::Copy,
+                                                             GetVkQueue(EQueueType::Copy));
+    else
         DefaultCopyQueue = DefaultRenderQueue;
+    if (IsComputeQueueSeparate())
+        DefaultComputeQueue = std::make_shared<CCommandQueueVk>(*this, EQueueType::Compute,
+                                                                GetVkQueue(EQueueType::Compute));
+    else
+        DefaultComputeQueue = DefaultRenderQueue;
+}
+
+uint32_t CDeviceVk::GetSharingFamilies(bool isUploaded, uint32_t (&families)[2]) const
+{
+    uint32_t count = 0;
+    families[count++] = GetQueueFamily(EQueueType::Render);
+    if (IsComputeQueueSeparate() && !(isUploaded && IsTransferQueueSeparate()))
+        families[count++] = GetQueueFamily(EQueueType::Compute);
+    return count;
 }
 
 CDeviceVk::~CDeviceVk()
 {
+    Workers.reset();
     DefaultCopyQueue.reset();
+    DefaultComputeQueue.reset();
     DefaultRenderQueue.reset();
     HugeConstantBuffer.reset();
+#ifdef VK_KHR_synchronization2
+    CBarrierBatchVk::SetPipelineBarrier2(nullptr);
+#endif
     vkDestroyPipelineCache(Device, PipelineCache, nullptr);
     vmaDestroyAllocator(Allocator);
     vkDestroyDevice(Device, nullptr);
 }
 
+void CDeviceVk::RunOnWorkers(size_t count, const std::function<void(size_t)>& fn)
+{
+    // Not worth waking anyone up for
+    if (count == 1)
+    {
+        fn(0);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lk(WorkerMutex);
+    if (!Workers)
+    {
+        unsigned hwThreads = std::thread::hardware_concurrency();
+        Workers = std::make_unique<CWorkerPool>(hwThreads > 1 ? hwThreads - 1 : 0);
+    }
+    Workers->Run(count, fn);
+}
+
 CImage::Ref CDeviceVk::InternalCreateImage(VkImageType type, EFormat format, EImageUsageFlags usage,
                                            uint32_t width, uint32_t height, uint32_t depth,
                                            uint32_t mipLevels, uint32_t arrayLayers,
                                            uint32_t sampleCount, const void* initialData)
 {
+    // Render passes track their attachments themselves
+    if (Any(usage, EImageUsageFlags::ExplicitState)
+        && Any(usage, EImageUsageFlags::RenderTarget | EImageUsageFlags::DepthStencil))
+        throw CRHIRuntimeError("Attachments can't have explicit state");
+
     VkImageCreateInfo imageInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
     imageInfo.imageType = type;
     imageInfo.format = static_cast<VkFormat>(format);
@@ -330,11 +442,17 @@ CImage::Ref CDeviceVk::InternalCreateImage(VkImageType type, EFormat format, EIm
     imageInfo.samples = static_cast<VkSampleCountFlagBits>(sampleCount);
     imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL; // BELOW
     imageInfo.usage = 0; // BELOW
-    if (IsTransferQueueSeparate())
+    // Initial data goes through the copy queue unless the blits for the mips need graphics. Those
+    //   images are exclusive and change owners, everything else is shared by render and compute
+    bool isUploaded = initialData && !Any(usage, EImageUsageFlags::GenMIPMaps);
+    auto uploadQueue = isUploaded ? DefaultCopyQueue : DefaultRenderQueue;
+    uint32_t sharingFamilies[2];
+    uint32_t sharingFamilyCount = GetSharingFamilies(isUploaded, sharingFamilies);
+    if (sharingFamilyCount > 1)
     {
         imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
-        imageInfo.queueFamilyIndexCount = 3;
-        imageInfo.pQueueFamilyIndices = QueueFamilies;
+        imageInfo.queueFamilyIndexCount = sharingFamilyCount;
+        imageInfo.pQueueFamilyIndices = sharingFamilies;
     }
     imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 
@@ -370,6 +488,8 @@ CImage::Ref CDeviceVk::InternalCreateImage(VkImageType type, EFormat format, EIm
         imageInfo.usage |= VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
         defaultState = EResourceState::DepthWrite;
     }
+    if (Any(usage, EImageUsageFlags::InputAttachment))
+        imageInfo.usage |= VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
     if (Any(usage, EImageUsageFlags::Staging))
     {
         imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
@@ -391,7 +511,7 @@ CImage::Ref CDeviceVk::InternalCreateImage(VkImageType type, EFormat format, EIm
     auto image =
         std::make_shared<CMemoryImageVk>(*this, handle, allocation, imageInfo, usage, defaultState);
 
-    auto cmdList = DefaultCopyQueue->CreateCommandList();
+    auto cmdList = uploadQueue->CreateCommandList();
     cmdList->Enqueue();
     auto ctx = std::static_pointer_cast<CCommandContextVk>(cmdList->CreateCopyContext());
     auto cmdBuffer = ctx->GetCmdBuffer();
@@ -467,13 +587,17 @@ CImage::Ref CDeviceVk::InternalCreateImage(VkImageType type, EFormat format, EIm
         PostFrameCleanup.emplace_back(
             [=](CDeviceVk& p) { vmaDestroyBuffer(p.GetAllocator(), stagingBuffer, stagingAlloc); });
     }
-    ctx->TransitionImage(*image, defaultState);
+    if (isUploaded)
+        ctx->ReleaseImage(*image, defaultState, *DefaultRenderQueue);
+    else
+        ctx->TransitionImage(*image, defaultState);
     ctx->FinishRecording();
     cmdList->Commit();
-    DefaultCopyQueue->Flush();
+    uploadQueue->Flush();
 
-    if (usage == EImageUsageFlags::Sampled)
-        image->SetTrackingDisabled(true);
+    // Images that are only ever sampled stay in their default state, nothing to track there
+    if (Any(usage, EImageUsageFlags::ExplicitState) || usage == EImageUsageFlags::Sampled)
+        image->DeclareState(defaultState);
 
     return std::move(image);
 }
@@ -573,7 +697,16 @@ CCommandQueue::Ref CDeviceVk::CreateCommandQueue() { return DefaultRenderQueue;
 
 CCommandQueue::Ref CDeviceVk::CreateCommandQueue(EQueueType queueType)
 {
-    return std::make_shared<CCommandQueueVk>(*this, queueType, GetVkQueue(queueType));
+    // One CCommandQueueVk per VkQueue, they all share the same submission order
+    switch (queueType)
+    {
+    case EQueueType::Copy:
+        return DefaultCopyQueue;
+    case EQueueType::Compute:
+        return DefaultComputeQueue;
+    default:
+        return DefaultRenderQueue;
+    }
 }
 
 CSwapChain::Ref CDeviceVk::CreateSwapChain(const CPresentationSurfaceDesc& info, EFormat format)
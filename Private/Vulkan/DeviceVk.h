@@ -13,6 +13,8 @@
 namespace RHI
 {
 
+class CWorkerPool;
+
 class CDeviceVk : public CDevice
 {
 public:
@@ -76,6 +78,13 @@ public:
     {
         return GetQueueFamily(EQueueType::Compute) != GetQueueFamily(EQueueType::Render);
     }
+    // The families a resource is shared by: render, and compute when it is separate. More than
+    //   one means VK_SHARING_MODE_CONCURRENT. Uploads on a separate copy queue are exclusive, the
+    //   copy queue releases them to the render queue and CCommandList::TransferOwnership hands
+    //   them on from there
+    uint32_t GetSharingFamilies(bool isUploaded, uint32_t (&families)[2]) const;
+    // Barriers go out through vkCmdPipelineBarrier2KHR, see CBarrierBatchVk
+    bool IsSynchronization2Enabled() const { return bIsSynchronization2Enabled; }
 
     // Getters for global objects
     uint32_t GetQueueFamily(EQueueType t) const { return QueueFamilies[static_cast<int>(t)]; }
@@ -87,8 +96,14 @@ public:
 
     CCommandQueueVk::Ref GetDefaultRenderQueue() const { return DefaultRenderQueue; }
     CCommandQueueVk::Ref GetDefaultCopyQueue() const { return DefaultCopyQueue; }
+    // The render queue, unless the device has a separate compute family
+    CCommandQueueVk::Ref GetDefaultComputeQueue() const { return DefaultComputeQueue; }
 
     void AddPostFrameCleanup(std::function<void(CDeviceVk&)> callback);
+    // Guards what the images and buffers remember between submissions, see CCommandQueueVk::Submit
+    std::mutex& GetResourceStateMutex() { return ResourceStateMutex; }
+    // Runs fn(0) to fn(count - 1) on the device's worker threads and the calling one
+    void RunOnWorkers(size_t count, const std::function<void(size_t)>& fn);
 
 private:
     VkDevice Device;
@@ -97,6 +112,7 @@ private:
     //   it's best to stick to one queue per family for current GPUs
     VkPhysicalDevice PhysicalDevice;
     VkPhysicalDeviceProperties Properties;
+    bool bIsSynchronization2Enabled = false;
 
     // Global objects
     uint32_t QueueFamilies[static_cast<int>(EQueueType::Count)];
@@ -106,10 +122,16 @@ private:
     VkPipelineCache PipelineCache;
     CCommandQueueVk::Ref DefaultRenderQueue;
     CCommandQueueVk::Ref DefaultCopyQueue;
+    CCommandQueueVk::Ref DefaultComputeQueue;
 
     friend class CCommandQueueVk; // Allow queues to grab cleanup functors
     std::mutex DeviceMutex;
     std::vector<std::function<void(CDeviceVk&)>> PostFrameCleanup;
+    std::mutex ResourceStateMutex;
+
+    // Translates deferred command streams. One batch at a time, created on first use
+    std::mutex WorkerMutex;
+    std::unique_ptr<CWorkerPool> Workers;
 };
 
 } /* namespace RHI */
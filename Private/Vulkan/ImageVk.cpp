@@ -9,151 +9,98 @@ namespace RHI
 void CImageVk::InitializeAccess(VkAccessFlags access, VkPipelineStageFlags stages,
                                 VkImageLayout layout)
 {
-    LastAccess.clear();
-    CImageSubresourceRange entireImage;
-    entireImage.BaseArrayLayer = 0;
-    entireImage.BaseMipLevel = 0;
-    entireImage.LayerCount = GetArrayLayers();
-    entireImage.LevelCount = GetMipLevels();
     CAccessRecord record { access, stages, layout };
-    LastAccess.emplace(entireImage, record);
+    LastAccess.Reset(GetMipLevels(), GetArrayLayers(), record);
+    AccessGeneration++;
 }
 
 void CImageVk::TransitionAccess(VkCommandBuffer cmdBuffer, const CImageSubresourceRange& range,
-                                const CAccessRecord& accessRecord)
+                                const CAccessRecord& accessRecord, bool isComputeQueue,
+                                const CSplitBarrierVk* split, CBarrierBatchVk* batch)
 {
-    if (LastAccess.empty())
+    if (LastAccess.IsEmpty())
         throw "CImageVk Access tracking is not initialized";
 
-    for (const auto& pair : LastAccess)
-    {
-        uint32_t top, bottom, left, right;
-        if (CAccessTracker::CalcOverlap(pair.first, range, top, bottom, left, right))
-        {
-            CImageSubresourceRange overlapRange;
-            overlapRange.BaseMipLevel = top;
-            overlapRange.LevelCount = bottom - top + 1;
-            overlapRange.BaseArrayLayer = left;
-            overlapRange.LayerCount = right - left + 1;
-            CAccessTracker::InsertImageBarrier(cmdBuffer, this, overlapRange, pair.second,
-                                               accessRecord);
-        }
-    }
+    LastAccess.ForEachRun(range, [&](const CImageSubresourceRange& overlapRange,
+                                     const CAccessRecord& record) {
+        CAccessRecord lastAccess =
+            isComputeQueue ? CAccessTracker::ForComputeQueue(record) : record;
+        CAccessTracker::InsertImageBarrier(cmdBuffer, this, overlapRange, lastAccess, accessRecord,
+                                           split, batch);
+    });
+}
+
+VkPipelineStageFlags CImageVk::GetLastAccessStages(const CImageSubresourceRange& range) const
+{
+    VkPipelineStageFlags stages = 0;
+    LastAccess.ForEachRun(range, [&](const CImageSubresourceRange&, const CAccessRecord& record) {
+        stages |= record.Stages;
+    });
+    return stages;
 }
 
 void CImageVk::UpdateAccess(const CImageSubresourceRange& range, const CAccessRecord& accessRecord)
 {
-    if (LastAccess.empty())
+    if (LastAccess.IsEmpty())
         throw "CImageVk Access tracking is not initialized";
+    LastAccess.Assign(range, accessRecord);
+    AccessGeneration++;
+}
 
-    // This function is largely identical to CAccessTracker::HandleImageLastAccess
-    // Except we don't insert any actual barrier here
-    auto iter = LastAccess.begin();
-
-    while (iter != LastAccess.end())
+void CImageVk::ReleaseAccess(VkCommandBuffer cmdBuffer, const CImageSubresourceRange& range,
+                             uint32_t srcFamily, uint32_t dstFamily, COwnershipAcquireVk& acquire,
+                             CBarrierBatchVk* batch)
+{
+    CBarrierBatchVk immediate;
+    if (!batch)
+        batch = &immediate;
+
+    std::vector<std::pair<CImageSubresourceRange, CAccessRecord>> released;
+    auto release = [&](const CImageSubresourceRange& overlapRange, const CAccessRecord& record) {
+        // Undefined content doesn't have to be kept, the new owner may simply discard it
+        if (record.ImageLayout == VK_IMAGE_LAYOUT_UNDEFINED)
+            return;
+        VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+        barrier.srcAccessMask = record.AccessType;
+        barrier.dstAccessMask = 0;
+        barrier.oldLayout = record.ImageLayout;
+        barrier.newLayout = record.ImageLayout;
+        barrier.srcQueueFamilyIndex = srcFamily;
+        barrier.dstQueueFamilyIndex = dstFamily;
+        barrier.image = GetVkImage();
+        barrier.subresourceRange.aspectMask = GetImageAspectFlags(GetVkFormat());
+        barrier.subresourceRange.baseArrayLayer = overlapRange.BaseArrayLayer;
+        barrier.subresourceRange.baseMipLevel = overlapRange.BaseMipLevel;
+        barrier.subresourceRange.layerCount = overlapRange.LayerCount;
+        barrier.subresourceRange.levelCount = overlapRange.LevelCount;
+        batch->Add(cmdBuffer, record.Stages, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, &barrier);
+
+        // The acquire makes everything visible, the new owner's barriers only order against it
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+        acquire.ImageBarriers.push_back(barrier);
+        released.emplace_back(overlapRange, record);
+    };
+
+    if (IsExplicitState())
     {
-        uint32_t top, bottom, left, right;
-        if (!CAccessTracker::CalcOverlap(iter->first, range, top, bottom, left, right))
-        {
-            iter++;
-            continue;
-        }
-
-        // Split the old region into 4 and remove the overlapping one from the store
-        // NOTE: my* is actually iter
-        uint32_t iterTop = iter->first.BaseMipLevel;
-        uint32_t iterLeft = iter->first.BaseArrayLayer;
-        uint32_t iterBottom = iterTop + iter->first.LevelCount - 1;
-        uint32_t iterRight = iterLeft + iter->first.LayerCount - 1;
-
-        // Erase the region right now, we are gonna add the non-overlapping quadrants back in
-        CAccessRecord iterAccess = iter->second;
-        LastAccess.erase(iter++);
-
-        // No need to continue if completely overlap
-        if (top == iterTop && bottom == iterBottom && left == iterLeft && right == iterRight)
-            continue;
-
-        /*
-         2 | 1
-        -------
-         3 | 4
-        */
-        uint32_t overlappingQuadrant;
-        uint32_t midVertical, midHorizontal;
-        if (top == iterTop)
-        {
-            midVertical = bottom;
-            if (left == iterLeft)
-            {
-                midHorizontal = right;
-                overlappingQuadrant = 2;
-            }
-            else
-            {
-                midHorizontal = left - 1;
-                overlappingQuadrant = 1;
-            }
-        }
-        else
-        {
-            midVertical = top - 1;
-            if (left == iterLeft)
-            {
-                midHorizontal = right;
-                overlappingQuadrant = 3;
-            }
-            else
-            {
-                midHorizontal = left - 1;
-                overlappingQuadrant = 4;
-            }
-        }
-
-        // Add the non-overlapping regions back in
-        if (overlappingQuadrant != 2)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = iterTop;
-            quadRange.LevelCount = midVertical - iterTop + 1;
-            quadRange.BaseArrayLayer = iterLeft;
-            quadRange.LayerCount = midHorizontal - iterLeft + 1;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                LastAccess.emplace(quadRange, iterAccess);
-        }
-        if (overlappingQuadrant != 1)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = iterTop;
-            quadRange.LevelCount = midVertical - iterTop + 1;
-            quadRange.BaseArrayLayer = midHorizontal + 1;
-            quadRange.LayerCount = iterRight - midHorizontal;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                LastAccess.emplace(quadRange, iterAccess);
-        }
-        if (overlappingQuadrant != 3)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = midVertical + 1;
-            quadRange.LevelCount = iterBottom - midVertical;
-            quadRange.BaseArrayLayer = iterLeft;
-            quadRange.LayerCount = midHorizontal - iterLeft + 1;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                LastAccess.emplace(quadRange, iterAccess);
-        }
-        if (overlappingQuadrant != 4)
-        {
-            CImageSubresourceRange quadRange;
-            quadRange.BaseMipLevel = midVertical + 1;
-            quadRange.LevelCount = iterBottom - midVertical;
-            quadRange.BaseArrayLayer = midHorizontal + 1;
-            quadRange.LayerCount = iterRight - midHorizontal;
-            if (quadRange.LevelCount > 0 && quadRange.LayerCount > 0)
-                LastAccess.emplace(quadRange, iterAccess);
-        }
+        auto state = GetDeclaredState();
+        release(range, { StateToAccessMask(state), StateToShaderStageMask(state, true),
+                         StateToImageLayout(state) });
     }
-    // We insert the whole range if we've found no overlapping
-    LastAccess.emplace(range, accessRecord);
+    else
+        LastAccess.ForEachRun(range, release);
+    immediate.Flush(cmdBuffer);
+    if (released.empty())
+        return;
+
+    acquire.DstStages |= VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    acquire.Images.push_back(shared_from_this());
+    if (IsExplicitState())
+        return;
+    for (const auto& iter : released)
+        UpdateAccess(iter.first,
+                     { 0, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, iter.second.ImageLayout });
 }
 
 CSwapChainImageVk::CSwapChainImageVk(CDeviceVk& p, CSwapChain::WeakRef swapChain)
@@ -226,7 +173,10 @@ EImageUsageFlags CMemoryImageVk::GetUsageFlags() const { return UsageFlags; }
 
 VkImage CMemoryImageVk::GetVkImage() const { return Image; }
 
-bool CMemoryImageVk::IsConcurrentAccess() const { return CreateInfo.sharingMode; }
+bool CMemoryImageVk::IsConcurrentAccess() const
+{
+    return CreateInfo.sharingMode == VK_SHARING_MODE_CONCURRENT;
+}
 
 VkImageCreateInfo CMemoryImageVk::GetCreateInfo() const { return CreateInfo; }
 
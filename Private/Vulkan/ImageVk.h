@@ -23,19 +23,41 @@ public:
     void InitializeAccess(VkAccessFlags access, VkPipelineStageFlags stages, VkImageLayout layout);
     /// Transition a subset of this image to new access record. Inserts the barriers into cmdBuffer
     void TransitionAccess(VkCommandBuffer cmdBuffer, const CImageSubresourceRange& range,
-                          const CAccessRecord& accessRecord);
-    /// Doesn't do any transition, but updates the LastAccess map
+                          const CAccessRecord& accessRecord, bool isComputeQueue = false,
+                          const CSplitBarrierVk* split = nullptr,
+                          CBarrierBatchVk* batch = nullptr);
+    /// Stages of every access still in flight on the range, what a split barrier has to wait for
+    VkPipelineStageFlags GetLastAccessStages(const CImageSubresourceRange& range) const;
+    /// Doesn't do any transition, but updates the LastAccess table
     void UpdateAccess(const CImageSubresourceRange& range, const CAccessRecord& accessRecord);
-
-    bool IsTrackingDisabled() const { return bIsTrackingDisabled; }
-    void SetTrackingDisabled(bool value) { bIsTrackingDisabled = value; }
+    /// Hands a subset of an exclusive image over to dstFamily. The release barriers go into
+    ///   cmdBuffer, the acquire halves into acquire. The layout stays as it is
+    void ReleaseAccess(VkCommandBuffer cmdBuffer, const CImageSubresourceRange& range,
+                       uint32_t srcFamily, uint32_t dstFamily, COwnershipAcquireVk& acquire,
+                       CBarrierBatchVk* batch = nullptr);
+    /// What the submissions so far left the image in
+    const CImageAccessMap& GetLastAccess() const { return LastAccess; }
+    /// Goes up with every change to the LastAccess table
+    uint64_t GetAccessGeneration() const { return AccessGeneration; }
+
+    // Explicit-state images skip the tracking, they are in whatever state was declared last
+    bool IsExplicitState() const { return bIsExplicitState; }
+    EResourceState GetDeclaredState() const { return DeclaredState; }
+    void DeclareState(EResourceState state)
+    {
+        bIsExplicitState = true;
+        DeclaredState = state;
+    }
 
 protected:
     CImageVk() = default;
 
 private:
-    std::map<CImageSubresourceRange, CAccessRecord> LastAccess;
-    bool bIsTrackingDisabled = false;
+    // Only touched on submission, with the device's resource state lock held
+    CImageAccessMap LastAccess;
+    uint64_t AccessGeneration = 0;
+    bool bIsExplicitState = false;
+    EResourceState DeclaredState = EResourceState::Undefined;
 };
 
 class CSwapChainImageVk : public CImageVk
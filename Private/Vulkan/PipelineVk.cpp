@@ -311,6 +311,22 @@ CPipelineVk::~CPipelineVk()
 
 VkPipelineLayout CPipelineVk::GetPipelineLayout() const { return PipelineLayout->GetHandle(); }
 
+VkAccessFlags CPipelineVk::GetResourceAccess(uint32_t set, uint32_t binding) const
+{
+    auto iter = ResourceAccess.find(std::make_pair(set, binding));
+    if (iter == ResourceAccess.end())
+        return 0;
+    return iter->second;
+}
+
+VkPipelineStageFlags CPipelineVk::GetResourceStages(uint32_t set, uint32_t binding) const
+{
+    auto iter = ResourceStages.find(std::make_pair(set, binding));
+    if (iter == ResourceStages.end())
+        return 0;
+    return iter->second;
+}
+
 void CPipelineVk::AddShaderModule(const CShaderModule::Ref& shaderModule,
                                   VkShaderStageFlagBits stage)
 {
@@ -321,6 +337,17 @@ void CPipelineVk::AddShaderModule(const CShaderModule::Ref& shaderModule,
 
     EntryPoints.push_back(smImpl->GetEntryPoint());
 
+    for (const auto& resource : smImpl->GetShaderResources())
+    {
+        if (resource.ResourceType == EPipelineResourceType::StageInput
+            || resource.ResourceType == EPipelineResourceType::StageOutput
+            || resource.ResourceType == EPipelineResourceType::PushConstantBuffer)
+            continue;
+        ResourceAccess[std::make_pair(resource.Set, resource.Binding)] |= resource.Access;
+        ResourceStages[std::make_pair(resource.Set, resource.Binding)] |=
+            ShaderToPipelineStages(stage);
+    }
+
     VkPipelineShaderStageCreateInfo stageInfo = {
         VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO
     };
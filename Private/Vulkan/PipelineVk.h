@@ -3,6 +3,7 @@
 #include "Pipeline.h"
 #include "ShaderModuleVk.h"
 #include "VkCommon.h"
+#include <map>
 #include <set>
 
 namespace RHI
@@ -20,6 +21,10 @@ public:
     VkPipeline GetHandle() const { return PipelineHandle; }
 
     VkPipelineLayout GetPipelineLayout() const;
+    // What the shaders declare for a binding, zero if it isn't used or there is no reflection
+    VkAccessFlags GetResourceAccess(uint32_t set, uint32_t binding) const;
+    // The shader stages that reference a binding, zero likewise
+    VkPipelineStageFlags GetResourceStages(uint32_t set, uint32_t binding) const;
 
 private:
     void AddShaderModule(const CShaderModule::Ref& shaderModule, VkShaderStageFlagBits stage);
@@ -29,6 +34,10 @@ private:
     std::vector<VkPipelineShaderStageCreateInfo> StageInfos;
     std::vector<std::string> EntryPoints;
 
+    // Reflected access of every (set, binding), ORed over the stages
+    std::map<std::pair<uint32_t, uint32_t>, VkAccessFlags> ResourceAccess;
+    std::map<std::pair<uint32_t, uint32_t>, VkPipelineStageFlags> ResourceStages;
+
     CPipelineLayoutVk::Ref PipelineLayout;
     VkPipeline PipelineHandle = VK_NULL_HANDLE;
 };
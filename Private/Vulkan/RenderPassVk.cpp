@@ -58,6 +58,18 @@ CRenderPassVk::CRenderPassVk(CDeviceVk& p, const CRenderPassDesc& desc)
     std::vector<VkAttachmentReference> allDepthStencilAttachments;
     std::vector<uint32_t> allPreserveAttachments;
 
+    // The descriptions point into these, nothing may reallocate once the first one is made
+    size_t inputCount = 0;
+    size_t colorCount = 0;
+    for (const auto& subpass : desc.Subpasses)
+    {
+        inputCount += subpass.InputAttachments.size();
+        colorCount += subpass.ColorAttachments.size();
+    }
+    allInputAttachments.reserve(inputCount);
+    allColorAttachments.reserve(colorCount);
+    allDepthStencilAttachments.reserve(desc.Subpasses.size());
+
     for (const auto& subpass : desc.Subpasses)
     {
         VkSubpassDescription subpassDescription = {};
@@ -65,7 +77,11 @@ CRenderPassVk::CRenderPassVk(CDeviceVk& p, const CRenderPassDesc& desc)
 
         for (uint32_t inputIdx : subpass.InputAttachments)
         {
-            allInputAttachments.push_back({ inputIdx, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL });
+            // A depth buffer read back by a later subpass stays in a depth layout
+            VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            if (GetImageAspectFlags(AttachmentsVk[inputIdx].format) & VK_IMAGE_ASPECT_DEPTH_BIT)
+                layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+            allInputAttachments.push_back({ inputIdx, layout });
             subpassDescription.inputAttachmentCount++;
         }
         subpassDescription.pInputAttachments = allInputAttachments.data()
@@ -90,9 +106,9 @@ CRenderPassVk::CRenderPassVk(CDeviceVk& p, const CRenderPassDesc& desc)
 
         subpassDescriptions.push_back(subpassDescription);
     }
-    ColorAttachmentCount = subpassDescriptions[0].colorAttachmentCount;
+    for (const auto& subpassDescription : subpassDescriptions)
+        ColorAttachmentCounts.push_back(subpassDescription.colorAttachmentCount);
 
-    // Let's only handle the situation where there is only one subpass
     std::vector<VkSubpassDependency> dependency(1);
     dependency[0].dependencyFlags = 0;
     dependency[0].srcSubpass = VK_SUBPASS_EXTERNAL;
@@ -102,6 +118,29 @@ CRenderPassVk::CRenderPassVk(CDeviceVk& p, const CRenderPassDesc& desc)
     dependency[0].srcAccessMask = 0;
     dependency[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 
+    // Each subpass may read what the one before it rendered, at the same pixel only
+    for (uint32_t i = 1; i < subpassDescriptions.size(); i++)
+    {
+        VkSubpassDependency chain;
+        chain.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+        chain.srcSubpass = i - 1;
+        chain.dstSubpass = i;
+        chain.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+            | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+            | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        chain.dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+            | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+            | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+            | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        chain.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+            | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        chain.dstAccessMask = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT
+            | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+            | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+            | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependency.push_back(chain);
+    }
+
     passInfo.attachmentCount = static_cast<uint32_t>(AttachmentsVk.size());
     passInfo.pAttachments = AttachmentsVk.data();
     passInfo.subpassCount = static_cast<uint32_t>(subpassDescriptions.size());
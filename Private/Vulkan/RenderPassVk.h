@@ -21,9 +21,8 @@ public:
     const std::vector<CImageView::Ref>& GetAttachmentViews() const { return AttachmentViews; }
     VkRect2D GetArea() const { return Area; }
 
-    // TODO: support multiple subpasses
-    uint32_t GetSubpassCount() const { return 1; }
-    uint32_t SubpassColorAttachmentCount(uint32_t subpass) { return ColorAttachmentCount; }
+    uint32_t GetSubpassCount() const { return static_cast<uint32_t>(ColorAttachmentCounts.size()); }
+    uint32_t SubpassColorAttachmentCount(uint32_t subpass) { return ColorAttachmentCounts[subpass]; }
 
     VkFramebuffer MakeFramebuffer(std::vector<VkSemaphore>& outWaitSemaphores, std::vector<VkSemaphore>& outSignalSemaphores);
     void UpdateImageInitialAccess(CAccessTracker& tracker);
@@ -33,7 +32,7 @@ private:
     CDeviceVk& Parent;
     VkRenderPass RenderPass;
 
-    uint32_t ColorAttachmentCount = 0;
+    std::vector<uint32_t> ColorAttachmentCounts; // Indexed by subpass
     std::vector<VkAttachmentDescription> AttachmentsVk;
     std::vector<CImageView::Ref> AttachmentViews; // Sole purpose is to hold images alive
     VkRect2D Area;
@@ -12,9 +12,12 @@ void CResourceBindings::Reset()
 }
 
 void CResourceBindings::BindBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range,
-                                   uint32_t set, uint32_t binding, uint32_t arrayElement)
+                                   uint32_t set, uint32_t binding, uint32_t arrayElement,
+                                   CBufferVk* pBuffer, VkAccessFlags access,
+                                   VkPipelineStageFlags stages)
 {
-    Bind(set, binding, arrayElement, BindingInfo { buffer, offset, range });
+    Bind(set, binding, arrayElement,
+         BindingInfo { buffer, offset, range, pBuffer, access, stages });
 }
 
 void CResourceBindings::BindImageView(CImageViewVk* pImageView, VkAccessFlags access,
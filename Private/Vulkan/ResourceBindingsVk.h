@@ -34,6 +34,9 @@ struct BindingInfo
     VkDeviceSize Offset;
     VkDeviceSize Range;
     VkBuffer BufferHandle = VK_NULL_HANDLE;
+    CBufferVk* Buffer = nullptr; // Only set for buffers we track access of
+    VkAccessFlags BufferAccess;
+    VkPipelineStageFlags BufferStages;
 
     CImageViewVk* ImageView = nullptr;
     VkAccessFlags ImageAccess;
@@ -44,10 +47,14 @@ struct BindingInfo
 
     BindingInfo() = default;
 
-    BindingInfo(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
+    BindingInfo(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range, CBufferVk* pBuffer,
+                VkAccessFlags access, VkPipelineStageFlags stages)
         : BufferHandle(buffer)
         , Offset(offset)
         , Range(range)
+        , Buffer(pBuffer)
+        , BufferAccess(access)
+        , BufferStages(stages)
     {
     }
 
@@ -88,7 +95,8 @@ public:
     void Reset();
 
     void BindBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range, uint32_t set,
-                    uint32_t binding, uint32_t arrayElement);
+                    uint32_t binding, uint32_t arrayElement, CBufferVk* pBuffer = nullptr,
+                    VkAccessFlags access = 0, VkPipelineStageFlags stages = 0);
     void BindImageView(CImageViewVk* pImageView, VkAccessFlags access, VkPipelineStageFlags stages,
                        VkImageLayout layout, uint32_t set, uint32_t binding, uint32_t arrayElement);
     void BindSampler(VkSampler sampler, uint32_t set, uint32_t binding, uint32_t arrayElement);
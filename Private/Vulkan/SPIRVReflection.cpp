@@ -144,11 +144,18 @@ bool SPIRVReflectResources(spirv_cross::CompilerGLSL& compiler, VkShaderStageFla
     {
         const auto& spirType = compiler.get_type_from_variable(resource.id);
 
+        // Read-write unless the whole block is declared otherwise
+        auto blockFlags = compiler.get_buffer_block_flags(resource.id);
+        VkAccessFlags access = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        if (blockFlags.get(spv::DecorationNonWritable))
+            access = VK_ACCESS_SHADER_READ_BIT;
+        else if (blockFlags.get(spv::DecorationNonReadable))
+            access = VK_ACCESS_SHADER_WRITE_BIT;
+
         CPipelineResource pipelineResource = {};
         pipelineResource.Stages = static_cast<EShaderStageFlags>(stage);
         pipelineResource.ResourceType = EPipelineResourceType::StorageBuffer;
-        pipelineResource.Access =
-            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; // TODO: assume the worst
+        pipelineResource.Access = access;
         pipelineResource.Set = compiler.get_decoration(resource.id, spv::DecorationDescriptorSet);
         pipelineResource.Binding = compiler.get_decoration(resource.id, spv::DecorationBinding);
         pipelineResource.ArraySize = (spirType.array.size() == 0) ? 1 : spirType.array[0];
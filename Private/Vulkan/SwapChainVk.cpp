@@ -238,6 +238,11 @@ bool CSwapChainVk::AcquireNextImage()
 
 void CSwapChainVk::Present(const CSwapChainPresentInfo& info)
 {
+    // Copy and compute go first, the render queue may be waiting on them
+    if (Parent.IsTransferQueueSeparate())
+        Parent.GetDefaultCopyQueue()->SubmitFrame();
+    if (Parent.IsComputeQueueSeparate())
+        Parent.GetDefaultComputeQueue()->SubmitFrame();
     Parent.GetDefaultRenderQueue()->SubmitFrame();
 
     auto& imageInfo = AcquiredImages.front();
@@ -258,6 +263,7 @@ void CSwapChainVk::Present(const CSwapChainPresentInfo& info)
     });
     AcquiredImages.pop();
 
+    std::lock_guard<std::mutex> lk(Parent.GetResourceStateMutex());
     std::static_pointer_cast<CSwapChainImageVk>(ProxyImage)
         ->InitializeAccess(0, 0, VK_IMAGE_LAYOUT_UNDEFINED);
 }
@@ -393,6 +393,8 @@ inline VkImageLayout StateToImageLayout(EResourceState state)
         return VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
     case EResourceState::ShaderResource:
     case EResourceState::PixelShaderResource:
+    case EResourceState::VertexShaderResource:
+    case EResourceState::ComputeShaderResource:
         return VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
     case EResourceState::CopyDest:
         return VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
@@ -413,7 +415,7 @@ inline VkAccessFlags StateToAccessMask(EResourceState state)
     case EResourceState::PreInitialized:
         return 0;
     case EResourceState::General:
-        return 0; // TODO
+        return VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
     case EResourceState::IndirectArg:
         return VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
     case EResourceState::IndexBuffer:
@@ -433,6 +435,8 @@ inline VkAccessFlags StateToAccessMask(EResourceState state)
             | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
     case EResourceState::ShaderResource:
     case EResourceState::PixelShaderResource:
+    case EResourceState::VertexShaderResource:
+    case EResourceState::ComputeShaderResource:
         return VK_ACCESS_SHADER_READ_BIT;
     case EResourceState::CopyDest:
         return VK_ACCESS_TRANSFER_WRITE_BIT;
@@ -467,6 +471,10 @@ inline VkPipelineStageFlags StateToShaderStageMask(EResourceState state, bool sr
             | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
     case EResourceState::PixelShaderResource:
         return VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    case EResourceState::VertexShaderResource:
+        return VK_PIPELINE_STAGE_VERTEX_SHADER_BIT;
+    case EResourceState::ComputeShaderResource:
+        return VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
     case EResourceState::RenderTarget:
         return VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
     case EResourceState::DepthRead:
@@ -483,4 +491,36 @@ inline VkPipelineStageFlags StateToShaderStageMask(EResourceState state, bool sr
     }
 }
 
+inline VkPipelineStageFlags ShaderToPipelineStages(VkShaderStageFlags shaderStages)
+{
+    static const VkPipelineStageFlags shaderStageMap[] = {
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+        VK_PIPELINE_STAGE_TESSELLATION_CONTROL_SHADER_BIT,
+        VK_PIPELINE_STAGE_TESSELLATION_EVALUATION_SHADER_BIT,
+        VK_PIPELINE_STAGE_GEOMETRY_SHADER_BIT,
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+    };
+
+    VkPipelineStageFlags pipelineStages = 0;
+    for (uint32_t i = 0; i < 6; i++)
+        if (shaderStages & (1 << i))
+            pipelineStages |= shaderStageMap[i];
+    return pipelineStages;
+}
+
+// The narrowest read-only state of a resource sampled in those shader stages
+inline EResourceState ShaderStagesToReadState(VkPipelineStageFlags stages)
+{
+    if (stages == VK_PIPELINE_STAGE_VERTEX_SHADER_BIT)
+        return EResourceState::VertexShaderResource;
+    if (stages == VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT)
+        return EResourceState::ComputeShaderResource;
+    const VkPipelineStageFlags pixelStages =
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    if (stages && !(stages & ~pixelStages))
+        return EResourceState::PixelShaderResource;
+    return EResourceState::ShaderResource;
+}
+
 }
@@ -0,0 +1,110 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace RHI
+{
+
+// Persistent threads that help the calling thread chew through a batch of indexed jobs
+class CWorkerPool
+{
+public:
+    explicit CWorkerPool(size_t threadCount)
+    {
+        for (size_t i = 0; i < threadCount; i++)
+            Threads.emplace_back([this]() { WorkerMain(); });
+    }
+
+    ~CWorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(Mutex);
+            bQuit = true;
+        }
+        WakeCV.notify_all();
+        for (auto& thread : Threads)
+            thread.join();
+    }
+
+    size_t GetThreadCount() const { return Threads.size(); }
+
+    // Runs fn(0) to fn(count - 1) and returns once all of them are done
+    void Run(size_t count, const std::function<void(size_t)>& fn)
+    {
+        {
+            std::lock_guard<std::mutex> lk(Mutex);
+            Job = &fn;
+            JobCount = count;
+            NextIndex = 0;
+            BusyCount = Threads.size();
+            Error = nullptr;
+            Generation++;
+        }
+        WakeCV.notify_all();
+        Drain();
+
+        std::unique_lock<std::mutex> lk(Mutex);
+        DoneCV.wait(lk, [this]() { return BusyCount == 0; });
+        Job = nullptr;
+        if (Error)
+            std::rethrow_exception(Error);
+    }
+
+private:
+    void WorkerMain()
+    {
+        uint64_t seenGeneration = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lk(Mutex);
+                WakeCV.wait(lk, [&]() { return bQuit || Generation != seenGeneration; });
+                if (bQuit)
+                    return;
+                seenGeneration = Generation;
+            }
+            Drain();
+            {
+                std::lock_guard<std::mutex> lk(Mutex);
+                BusyCount--;
+            }
+            DoneCV.notify_one();
+        }
+    }
+
+    void Drain()
+    {
+        for (size_t i = NextIndex++; i < JobCount; i = NextIndex++)
+        {
+            try
+            {
+                (*Job)(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lk(Mutex);
+                if (!Error)
+                    Error = std::current_exception();
+            }
+        }
+    }
+
+    std::vector<std::thread> Threads;
+    std::mutex Mutex;
+    std::condition_variable WakeCV;
+    std::condition_variable DoneCV;
+    const std::function<void(size_t)>* Job = nullptr;
+    size_t JobCount = 0;
+    std::atomic<size_t> NextIndex { 0 };
+    size_t BusyCount = 0;
+    uint64_t Generation = 0;
+    bool bQuit = false;
+    std::exception_ptr Error;
+};
+
+}
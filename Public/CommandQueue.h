@@ -26,9 +26,23 @@ public:
 
     virtual void Enqueue() = 0;
     virtual void Commit() = 0;
+    // Hold off the GPU work of this list until signaler finished on its own queue.
+    //   Both lists have to be uncommitted, and signaler has to be submitted first
+    virtual void WaitForCommandList(CCommandList& signaler) = 0;
+    // Start the barrier for view as soon as this list is done with it, and only finish it right
+    //   before waiter touches it. Both lists have to be uncommitted and on the same queue
+    virtual void SplitBarrier(CCommandList& waiter, const CImageView::Ref& view) = 0;
+    // Hand the resource over to receiver's queue once this list is done with it. Only does
+    //   something for resources owned by one queue family, when the other queue is of another.
+    //   Both lists have to be uncommitted, and this one has to be submitted first
+    virtual void TransferOwnership(CCommandList& receiver, const CImageView::Ref& view) = 0;
+    virtual void TransferOwnership(CCommandList& receiver, const CBuffer::Ref& buffer) = 0;
 
     virtual ICopyContext::Ref CreateCopyContext() = 0;
     virtual IComputeContext::Ref CreateComputeContext() = 0;
+    // Records from any thread without calling into the driver. The commands are translated on
+    //   worker threads when the list is committed, and take their place in creation order
+    virtual IComputeContext::Ref CreateDeferredComputeContext() = 0;
     virtual IParallelRenderContext::Ref CreateParallelRenderContext(CRenderPass::Ref renderPass,
                                                                     const std::vector<CClearValue>& clearValues) = 0;
 };
@@ -96,6 +96,10 @@ public:
 
     virtual ~ICopyContext() = default;
 
+    // Explicit-state resources get their barrier right here, tracked ones just take note
+    virtual void TransitionImage(CImage& image, EResourceState newState) = 0;
+    virtual void TransitionBuffer(CBuffer& buffer, EResourceState newState) = 0;
+
     virtual void ClearImage(CImage& image, const CClearValue& clearValue,
                             const CImageSubresourceRange& range) = 0;
 
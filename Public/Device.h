@@ -63,6 +63,7 @@ public:
 
     // Command submission
     CCommandQueue::Ref CreateCommandQueue();
+    CCommandQueue::Ref CreateCommandQueue(EQueueType queueType);
 
     // Windowing system interface
     CSwapChain::Ref CreateSwapChain(const CPresentationSurfaceDesc& info, EFormat format);
@@ -0,0 +1,78 @@
+#pragma once
+#include "RenderContext.h"
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace RHI
+{
+
+// Everything one draw binds. Descriptor sets and vertex buffers are bound from slot 0 up to the
+//   first null one. Without an index buffer it is a plain Draw
+struct CDrawPacket
+{
+    static constexpr uint32_t kMaxDescriptorSets = 4;
+    static constexpr uint32_t kMaxVertexBuffers = 4;
+
+    CPipeline* Pipeline = nullptr;
+    std::array<CDescriptorSet*, kMaxDescriptorSets> DescriptorSets {};
+    std::array<CBuffer*, kMaxVertexBuffers> VertexBuffers {};
+    std::array<size_t, kMaxVertexBuffers> VertexOffsets {};
+    CBuffer* IndexBuffer = nullptr;
+    size_t IndexOffset = 0;
+    EFormat IndexFormat = EFormat::R16_UINT;
+
+    uint32_t Count = 0; // Vertices or indices
+    uint32_t InstanceCount = 1;
+    uint32_t First = 0;
+    int32_t VertexOffset = 0;
+    uint32_t FirstInstance = 0;
+};
+
+// Collects draws from anywhere in the frame and records them sorted by a 64-bit key, so that
+//   draws sharing a pipeline and material end up next to each other
+class CDrawQueue
+{
+public:
+    struct CStats
+    {
+        size_t Draws = 0;
+        size_t PipelineBinds = 0;
+        size_t DescriptorSetBinds = 0;
+        size_t VertexBufferBinds = 0;
+        size_t IndexBufferBinds = 0;
+    };
+
+    // Pipeline in the top 16 bits, material in the next 24, then depth in [0, 1] quantized to the
+    //   low 24 (front to back)
+    static uint64_t MakeSortKey(uint16_t pipelineId, uint32_t materialId, float depth);
+
+    void Push(uint64_t sortKey, const CDrawPacket& packet);
+    size_t GetSize() const { return Packets.size(); }
+
+    // Records everything into ctx in key order, equal keys keep their push order. Binds that
+    //   match what the previous draw left behind are skipped. The queue is empty afterwards
+    void Flush(IRenderContext& ctx);
+    void Clear();
+
+    // Summed over all flushes so far
+    const CStats& GetStats() const { return Stats; }
+    void ResetStats() { Stats = CStats(); }
+
+private:
+    // LSD radix sort of Keys, 8 bits per pass, leaves the packet order in Order
+    void SortKeys();
+
+    std::vector<uint64_t> Keys;
+    std::vector<CDrawPacket> Packets;
+
+    // Scratch for the sort, kept around between frames
+    std::vector<uint64_t> SortedKeys;
+    std::vector<uint64_t> KeyScratch;
+    std::vector<uint32_t> Order; // Packet indices in key order after SortKeys
+    std::vector<uint32_t> OrderScratch;
+
+    CStats Stats;
+};
+
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 
 namespace RHI
 {
@@ -197,4 +198,38 @@ enum class EFormat
     ASTC_12x12_SRGB_BLOCK = 184,
 };
 
+// Size in bytes of a single texel. Returns 0 for block compressed formats
+inline uint32_t GetFormatTexelSize(EFormat format)
+{
+    auto f = static_cast<uint32_t>(format);
+    if (f == 0 || f > static_cast<uint32_t>(EFormat::D32_SFLOAT_S8_UINT))
+        return 0;
+    if (f == 1 || (f >= 9 && f <= 15) || f == 127)
+        return 1;
+    if ((f >= 2 && f <= 8) || (f >= 16 && f <= 22) || (f >= 70 && f <= 76) || f == 124)
+        return 2;
+    if (f >= 23 && f <= 36)
+        return 3;
+    if ((f >= 37 && f <= 69) || (f >= 77 && f <= 83) || (f >= 98 && f <= 100)
+        || (f >= 122 && f <= 126) || f == 128 || f == 129)
+        return 4;
+    if (f >= 84 && f <= 90)
+        return 6;
+    if ((f >= 91 && f <= 97) || (f >= 101 && f <= 103) || (f >= 110 && f <= 112) || f == 130)
+        return 8;
+    if (f >= 104 && f <= 106)
+        return 12;
+    if ((f >= 107 && f <= 109) || (f >= 113 && f <= 115))
+        return 16;
+    if (f >= 116 && f <= 118)
+        return 24;
+    return 32;
+}
+
+inline bool HasStencilComponent(EFormat format)
+{
+    return format == EFormat::S8_UINT || format == EFormat::D16_UNORM_S8_UINT
+        || format == EFormat::D24_UNORM_S8_UINT || format == EFormat::D32_SFLOAT_S8_UINT;
+}
+
 } /* namespace RHI */
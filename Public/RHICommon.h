@@ -103,7 +103,10 @@ enum class EResourceState : uint32_t
     PixelShaderResource,
     CopyDest,
     CopySource,
-    Present
+    Present,
+    // Sampled in only one stage
+    VertexShaderResource,
+    ComputeShaderResource
 };
 
 } /* namespace RHI */
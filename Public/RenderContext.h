@@ -37,6 +37,9 @@ public:
     typedef std::shared_ptr<IParallelRenderContext> Ref;
     virtual ~IParallelRenderContext() = default;
     virtual IRenderContext::Ref CreateRenderContext(uint32_t subpass) = 0;
+    // Same, but only recorded into a command stream. It is translated on worker threads when this
+    //   context finishes recording
+    virtual IRenderContext::Ref CreateDeferredRenderContext(uint32_t subpass) = 0;
     virtual void FinishRecording() = 0;
 };
 
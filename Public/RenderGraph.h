@@ -1,12 +1,15 @@
 #pragma once
+#include "CommandQueue.h"
 #include "Format.h"
 #include "RHICommon.h"
+#include "RenderPass.h"
 #include "Resources.h"
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <deque>
+#include <functional>
 #include <iostream>
-#include <list>
 #include <map>
 #include <memory>
 #include <set>
@@ -19,6 +22,8 @@ namespace RHI
 {
 
 class CRenderGraph;
+class CRenderResource;
+class CWorkerPool;
 
 enum ERenderNodeType : uint32_t
 {
@@ -29,15 +34,18 @@ enum ERenderNodeType : uint32_t
 class CRenderNode
 {
 public:
-    CRenderNode(CRenderGraph& g, std::string name, ERenderNodeType t)
-        : Graph(g)
-        , Name(std::move(name))
+    CRenderNode(CRenderGraph& g, uint32_t id, uint32_t nameId, ERenderNodeType t)
+        : Graph(&g)
+        , Id(id)
+        , NameId(nameId)
         , Type(t)
     {
     }
 
-    CRenderGraph& GetGraph() const { return Graph; }
-    const std::string& GetName() const { return Name; }
+    CRenderGraph& GetGraph() const { return *Graph; }
+    const std::string& GetName() const;
+    uint32_t GetId() const { return Id; }
+    uint32_t GetNameId() const { return NameId; }
     ERenderNodeType GetType() const { return Type; }
 
     // Temporary, for traversal use
@@ -45,8 +53,9 @@ public:
     size_t _PassOrder;
 
 private:
-    CRenderGraph& Graph;
-    std::string Name;
+    CRenderGraph* Graph;
+    uint32_t Id;
+    uint32_t NameId;
     ERenderNodeType Type;
 };
 
@@ -54,43 +63,146 @@ private:
 class CGraphRenderPass : public CRenderNode
 {
 public:
-    CGraphRenderPass(CRenderGraph& g, std::string name)
-        : CRenderNode(g, std::move(name), ERenderNodeType::RenderPass)
+    CGraphRenderPass(CRenderGraph& g, uint32_t id, uint32_t nameId)
+        : CRenderNode(g, id, nameId, ERenderNodeType::RenderPass)
     {
     }
 
     // Could be read-write dependency
     void AddColorAttachment(const std::string& resource, uint32_t index, bool read = true,
                             bool write = true);
+    void AddColorAttachment(const CRenderResource& resource, uint32_t index, bool read = true,
+                            bool write = true);
     // Could be read-write dependency
     void AddDepthStencilAttachment(const std::string& resource, bool read = true,
                                    bool write = true);
-    // A read-only dependency. Sampled image in a shader (fragment shader assumed)
+    void AddDepthStencilAttachment(const CRenderResource& resource, bool read = true,
+                                   bool write = true);
+    // A read-only dependency. Sampled image or structured buffer in a shader
     void AddShaderResource(const std::string& resource);
+    void AddShaderResource(const CRenderResource& resource);
+    // Draw or dispatch arguments read from a buffer
+    void AddIndirectArgument(const std::string& resource);
+    void AddIndirectArgument(const CRenderResource& resource);
+    // Reads only the pixel being shaded, lets Bake merge the pass with the one producing resource
+    void AddInputAttachment(const std::string& resource, uint32_t index);
+    void AddInputAttachment(const CRenderResource& resource, uint32_t index);
+    // Storage image or storage buffer access from a shader, what compute passes write through
+    void AddUnorderedAccess(const std::string& resource, bool read = true, bool write = true);
+    void AddUnorderedAccess(const CRenderResource& resource, bool read = true, bool write = true);
+
+    // Records the pass into a command list of its own. Called from a worker thread by Execute
+    void SetExecuteFunc(std::function<void(CCommandList&)> fn) { ExecuteFunc = std::move(fn); }
+    const std::function<void(CCommandList&)>& GetExecuteFunc() const { return ExecuteFunc; }
+    // Records the pass as its subpass of the render pass group it was merged into. Passes that
+    //   Bake merges have to record this way. Called from a worker thread by Execute
+    void SetRenderFunc(std::function<void(IRenderContext&)> fn) { RenderFunc = std::move(fn); }
+    const std::function<void(IRenderContext&)>& GetRenderFunc() const { return RenderFunc; }
+
+    // Compute means the pass may run on the async compute queue, if the graph has one
+    void SetQueueAffinity(EQueueType value) { QueueAffinity = value; }
+    EQueueType GetQueueAffinity() const { return QueueAffinity; }
+
+private:
+    std::function<void(CCommandList&)> ExecuteFunc;
+    std::function<void(IRenderContext&)> RenderFunc;
+    EQueueType QueueAffinity = EQueueType::Render;
 };
 
 class CRenderResource : public CRenderNode
 {
 public:
-    CRenderResource(CRenderGraph& g, std::string name, EFormat format)
-        : CRenderNode(g, std::move(name), ERenderNodeType::RenderResource)
+    CRenderResource(CRenderGraph& g, uint32_t id, uint32_t nameId, EFormat format)
+        : CRenderNode(g, id, nameId, ERenderNodeType::RenderResource)
         , Format(format)
     {
     }
+    CRenderResource(CRenderGraph& g, uint32_t id, uint32_t nameId, size_t bufferSize)
+        : CRenderNode(g, id, nameId, ERenderNodeType::RenderResource)
+        , Format(EFormat::UNDEFINED)
+        , bIsBuffer(true)
+        , BufferSize(bufferSize)
+    {
+    }
 
+    bool IsBuffer() const { return bIsBuffer; }
+    size_t GetBufferSize() const { return BufferSize; }
     EFormat GetFormat() const { return Format; }
+    uint32_t GetWidth() const { return Width; }
+    uint32_t GetHeight() const { return Height; }
+    uint32_t GetDepth() const { return Depth; }
+    uint32_t GetMipLevels() const { return MipLevels; }
+    uint32_t GetArrayLayers() const { return ArrayLayers; }
 
-    CImageView::Ref GetImageView() const;
+    CRenderResource& SetExtent(uint32_t width, uint32_t height, uint32_t depth = 1)
+    {
+        Width = width;
+        Height = height;
+        Depth = depth;
+        return *this;
+    }
+    CRenderResource& SetMipLevels(uint32_t value)
+    {
+        MipLevels = value;
+        return *this;
+    }
+    CRenderResource& SetArrayLayers(uint32_t value)
+    {
+        ArrayLayers = value;
+        return *this;
+    }
+
+    // Estimated memory footprint, zero if the extent is not known
+    size_t GetMemorySize() const;
+
+    // The physical image behind the resource, what MakeRenderPassDesc attaches
+    CImageView::Ref GetImageView() const { return ImageView; }
+    CRenderResource& SetImageView(CImageView::Ref value)
+    {
+        ImageView = std::move(value);
+        return *this;
+    }
+    CBuffer::Ref GetBuffer() const { return Buffer; }
+    CRenderResource& SetBuffer(CBuffer::Ref value)
+    {
+        Buffer = std::move(value);
+        return *this;
+    }
 
 private:
     EFormat Format;
+    uint32_t Width = 0;
+    uint32_t Height = 0;
+    uint32_t Depth = 1;
+    uint32_t MipLevels = 1;
+    uint32_t ArrayLayers = 1;
+    bool bIsBuffer = false;
+    size_t BufferSize = 0;
+    CImageView::Ref ImageView;
+    CBuffer::Ref Buffer;
 };
 
 enum EResourceUsageType : uint32_t
 {
     ColorAttachment,
     DepthStencilAttachment,
-    ShaderResource
+    ShaderResource,
+    UnorderedAccess,
+    InputAttachment,
+    IndirectArgument
+};
+
+// Why a pass did or did not become a subpass of the render pass before it
+enum class EPassMergeResult : uint32_t
+{
+    Merged,
+    FirstPass, // Nothing scheduled before it
+    NotRaster, // Either pass has no attachments
+    ExtentMismatch, // The attachments differ in size, or the size is not known
+    NoSharedAttachment, // Nothing to keep on chip between the two
+    NonLocalAccess, // Samples or stores to an attachment of the render pass
+    SyncPoint, // Another queue has to wait or be waited for in between
+    AliasedMemory // Two attachments of the render pass overlap in the transient layout
 };
 
 // This class represents an edge
@@ -105,44 +217,295 @@ struct CResourceUsage
 
 class CRenderGraph
 {
+    friend class CRenderNode;
     friend class CGraphRenderPass;
 
 public:
+    static constexpr uint32_t kInvalidId = ~0U;
+
     struct CTransition
     {
         size_t NodeId;
         EResourceState StateDuring;
         EResourceState StateAfter;
+        // The state stays, but what the pass wrote has to be made visible to the next user
+        bool bMemoryBarrier;
+        // Time step of the next user, the barrier has to be done by then
+        size_t NextStep;
+        // Signaled right after this step and waited on at NextStep, so the passes in between
+        //   overlap with the barrier
+        bool bSplit;
 
         bool IsUnneeded() const;
     };
 
+    // The pass at WaitStep may not start before the pass at SignalStep on another queue is done
+    struct CSyncPoint
+    {
+        size_t SignalStep;
+        size_t WaitStep;
+    };
+
+    // A resource changing queues between two of its users. SIZE_MAX stands for the render queue
+    //   before or after the graph, where resources stay between frames
+    struct CQueueHandoff
+    {
+        size_t NodeId;
+        size_t GiveStep;
+        size_t TakeStep;
+    };
+
+    // Where a transient resource should live inside a shared heap. The graph only plans the
+    //   layout and allocates nothing: the aliasing happens if the application creates the
+    //   resources at these offsets inside one heap of GetTransientHeapSize bytes
+    struct CTransientPlacement
+    {
+        size_t NodeId;
+        size_t Offset;
+        size_t Size;
+        size_t FirstUse; // Time step of the first pass using the resource
+        size_t LastUse; // Time step of the last pass using the resource
+    };
+
+    // Consecutive time steps recorded as the subpasses of one render pass
+    struct CRenderPassGroup
+    {
+        size_t FirstStep;
+        size_t StepCount;
+        size_t FirstAttachment; // Into GetRenderPassAttachments
+        size_t AttachmentCount;
+    };
+
+    // An attachment of a render pass group, with its load and store ops worked out from the uses
+    //   of the resource before and after the group
+    struct CRenderPassAttachment
+    {
+        size_t NodeId;
+        EAttachmentLoadOp LoadOp;
+        EAttachmentStoreOp StoreOp;
+    };
+
+    // What aliasing saves: the heap against every placement side by side
+    struct CTransientStats
+    {
+        size_t UnaliasedSize = 0; // Sum of the placement sizes
+        size_t HeapSize = 0; // Smallest heap that holds every placement
+    };
+
+    // Transitions that end up as barriers between command lists. Those inside a render pass group
+    //   are subpass dependencies, and resources without an image view or buffer aren't counted
+    struct CBarrierStats
+    {
+        size_t FullBarriers = 0;
+        size_t SplitBarriers = 0;
+    };
+
+    // Placement granularity inside the transient heap, conservative for render targets
+    static constexpr size_t kTransientAlignment = 65536;
+    // Compiled plans kept around for graphs that alternate between a few topologies
+    static constexpr size_t kMaxCachedPlans = 16;
+
     CRenderGraph();
+    ~CRenderGraph();
 
     CRenderResource& AddTransientResource(const std::string& name, EFormat format);
+    CRenderResource& AddTransientBuffer(const std::string& name, size_t size);
+    // Passes writing the same resource take turns in the order they are added
     CGraphRenderPass& AddRenderPass(const std::string& name);
     void RemoveRenderPass(const std::string& name);
     void SetGoal(const std::string& name);
+    // Drops every node and edge, but keeps the interned names and all storage for the next build
+    void Clear();
 
+    // Print the traversal and the baked plan to stdout
+    void SetVerbose(bool value) { bVerbose = value; }
+    // Let Bake move passes with compute affinity over to the compute queue
+    void SetAsyncCompute(bool value) { bAsyncCompute = value; }
+
+    // Both reuse the plan compiled for a graph with the same structure, if there is one
     bool Validate() const;
     void Bake() const;
 
+    // Records every scheduled pass on the worker pool and commits the lists in pass order. A render
+    //   pass group with render funcs goes into one list, as one render pass. If a pass throws, the
+    //   lists are still committed with what was recorded before the exception is rethrown
+    void Execute(CCommandQueue& queue) const;
+    // Same, but passes scheduled for the compute queue go to computeQueue
+    void Execute(CCommandQueue& renderQueue, CCommandQueue& computeQueue) const;
+    // Threads that help the calling thread record in Execute, 0 records everything inline
+    void SetWorkerCount(size_t count);
+    // Creates the render passes Execute records the render funcs into
+    void SetDevice(CDevice& device) { Device = &device; }
+
+    // A hit means Validate found a compiled plan and Bake had nothing to do
+    size_t GetPlanCacheHits() const { return PlanCacheHits; }
+    size_t GetPlanCacheMisses() const { return PlanCacheMisses; }
+
+    const std::vector<size_t>& GetPassOrder() const { return PassOrder; }
+    // Passes left out of the plan because nothing they write reaches the goal
+    size_t GetCulledPassCount() const;
+    const std::vector<std::vector<CTransition>>& GetTransitions() const { return Transitions; }
+    const std::vector<EQueueType>& GetPassQueues() const { return PassQueues; }
+    const std::vector<CSyncPoint>& GetSyncPoints() const { return SyncPoints; }
+    const std::vector<CQueueHandoff>& GetQueueHandoffs() const { return QueueHandoffs; }
+    const std::vector<CTransientPlacement>& GetTransientPlacements() const
+    {
+        return TransientPlacements;
+    }
+    // Smallest heap that holds every placement
+    size_t GetTransientHeapSize() const { return TransientStats.HeapSize; }
+    const CTransientStats& GetTransientStats() const { return TransientStats; }
+    const std::vector<CRenderPassGroup>& GetRenderPassGroups() const { return RenderPassGroups; }
+    // Counted by the last Execute, one frame worth of barriers
+    const CBarrierStats& GetBarrierStats() const { return BarrierStats; }
+    const std::vector<CRenderPassAttachment>& GetRenderPassAttachments() const
+    {
+        return RenderPassAttachments;
+    }
+    // A subpass per pass of the group, every resource needs an image view by now
+    CRenderPassDesc MakeRenderPassDesc(size_t group) const;
+    // Indexed by time step, the merge report
+    const std::vector<EPassMergeResult>& GetMergeResults() const { return MergeResults; }
+    static const char* GetMergeResultName(EPassMergeResult result);
+
 private:
-    void ValidateDFSRenderPass(size_t nodeId) const;
-    void ValidateDFSResource(size_t nodeId) const;
-    std::shared_ptr<CResourceUsage> AddEdge(size_t src, size_t dst);
+    struct CEdge
+    {
+        uint32_t PassId;
+        uint32_t ResourceId;
+        CResourceUsage Usage;
+    };
+
+    struct CDFSFrame
+    {
+        uint32_t NodeId;
+        uint32_t Cursor; // Next entry in PassDeps to look at
+    };
+
+    // Where the pass at Step binds one of the attachments of its render pass group. Kept with the
+    //   plan, so render pass descriptions don't need the adjacency of the graph it came from
+    struct CSubpassAttachmentRef
+    {
+        size_t Step;
+        uint32_t Attachment; // Counted from the FirstAttachment of the group
+        EResourceUsageType Type;
+        uint32_t Location; // Of color and input attachments
+    };
+
+    struct CCompiledPlan
+    {
+        std::vector<uint64_t> TopologyKey; // What the hash was computed from, checked on a hit
+        bool bValid;
+        std::vector<size_t> PassOrder;
+        std::vector<std::vector<CTransition>> Transitions;
+        std::vector<EQueueType> PassQueues;
+        std::vector<CSyncPoint> SyncPoints;
+        std::vector<CQueueHandoff> QueueHandoffs;
+        std::vector<CTransientPlacement> TransientPlacements;
+        CTransientStats TransientStats;
+        std::vector<CRenderPassGroup> RenderPassGroups;
+        std::vector<CRenderPassAttachment> RenderPassAttachments;
+        std::vector<CSubpassAttachmentRef> SubpassAttachmentRefs;
+        std::vector<EPassMergeResult> MergeResults;
+    };
+
+    uint32_t InternName(const std::string& name);
+    CRenderResource& AddResourceNode(CRenderResource&& resource);
+    uint32_t FindNode(const std::string& name) const;
+    CResourceUsage& AddEdge(uint32_t pass, uint32_t resource);
+    void BuildAdjacency() const;
+    void BuildVersions() const;
+    uint32_t CullPasses() const;
+    void BuildPassDependencies() const;
+    // Flattens the graph structure into TopologyKeyScratch and returns its hash
+    size_t BuildTopologyKey() const;
+    void ValidateDFS(uint32_t rootId) const;
+    bool VisitDFS(uint32_t nodeId) const;
+    void BakePlan() const;
+    void PlanTransitions() const;
+    void PlanQueues() const;
+    void PlanDependencies() const;
+    void PlanQueueHandoffs() const;
+    void PlanTransientLayout() const;
+    void PlanSyncPoints() const;
+    void PlanRenderPasses() const;
+    EPassMergeResult CanMergeWithGroup(size_t step, size_t groupStart) const;
+    void PlanAttachments() const;
+    void PlanSplitBarriers() const;
 
-    std::list<size_t> FreeNodeIds;
+    // Interned names outlive Clear, so rebuilding the same graph every frame doesn't allocate
+    std::vector<std::string> Names;
+    std::unordered_map<std::string, uint32_t> NameIds;
+    std::vector<uint32_t> NameToNodeId; // Indexed by name id
 
-    std::vector<std::shared_ptr<CRenderNode>> Nodes;
-    std::vector<std::map<size_t, std::shared_ptr<CResourceUsage>>> AdjLists;
-    std::unordered_map<std::string, size_t> NameToNodeId;
+    // Node storage is recycled across Clear, deques keep the handed out references stable
+    std::deque<CGraphRenderPass> PassPool;
+    std::deque<CRenderResource> ResourcePool;
+    size_t PassCount = 0;
+    size_t ResourceCount = 0;
+    std::vector<CRenderNode*> Nodes; // Indexed by node id, null once removed
+    std::vector<CEdge> Edges;
+
+    // Compressed sparse rows over Edges, each edge is listed under both of its end points
+    mutable std::vector<uint32_t> AdjOffsets;
+    mutable std::vector<uint32_t> AdjEdges;
+    mutable std::vector<uint32_t> AdjCursors;
+    mutable bool bAdjacencyDirty = true;
+
+    // Resource versions are named by the id of the edge writing them, kInvalidId for none
+    mutable std::vector<uint32_t> EdgeReadVersions; // The version an edge reads
+    mutable std::vector<uint32_t> EdgeWriteVersions; // The version an edge writes
+    mutable std::vector<uint32_t> PassRefCounts; // Indexed by node id, zero once culled
+    mutable std::vector<uint32_t> VersionRefCounts; // Indexed by edge id
+    mutable std::vector<uint32_t> CullStack;
+    // Passes each pass has to be scheduled after, in compressed sparse rows
+    mutable std::vector<uint32_t> PassDepOffsets;
+    mutable std::vector<uint32_t> PassDeps;
+    // (pass id << 32 | edge id, pass it depends on), the edge being the one that causes it
+    mutable std::vector<std::pair<uint64_t, uint32_t>> DependencyScratch;
+    mutable std::vector<std::pair<uint32_t, uint32_t>> ReaderScratch; // (version, reader pass)
 
     size_t GoalNode;
-    mutable bool ValidateSuccess;
-    mutable uint32_t DFSDepth;
+    bool bVerbose = false;
+    bool bAsyncCompute = false;
+    mutable bool ValidateSuccess = false;
+    mutable std::vector<CDFSFrame> DFSStack;
     mutable std::vector<size_t> PassOrder; // The pass at each time step
     mutable std::vector<std::vector<CTransition>> Transitions; // Transitions at each time step
+    mutable std::vector<std::pair<size_t, CTransition>> TransitionScratch;
+    mutable std::vector<EQueueType> PassQueues; // The queue of the pass at each time step
+    mutable std::vector<CSyncPoint> SyncPoints; // Sorted by WaitStep
+    mutable std::vector<CQueueHandoff> QueueHandoffs;
+    mutable std::vector<size_t> HandoffScratch;
+    // Cross-queue dependencies as (wait step, signal step)
+    mutable std::vector<std::pair<size_t, size_t>> Dependencies;
+    // First step on another queue that is known to wait for the pass at each step
+    mutable std::vector<size_t> JoinSteps;
+    mutable std::vector<CTransientPlacement> TransientPlacements;
+    mutable CTransientStats TransientStats;
+    mutable std::vector<CRenderPassGroup> RenderPassGroups;
+    mutable std::vector<CRenderPassAttachment> RenderPassAttachments;
+    mutable std::vector<CSubpassAttachmentRef> SubpassAttachmentRefs; // Sorted by step
+    mutable std::vector<EPassMergeResult> MergeResults;
+
+    // Plans keyed by the structural hash of the graph they were compiled from
+    mutable std::unordered_map<size_t, CCompiledPlan> PlanCache;
+    mutable size_t TopologyHash = 0; // Hash of the graph seen by the last Validate
+    mutable std::vector<uint64_t> TopologyKey; // The graph seen by the last Validate
+    mutable std::vector<uint64_t> TopologyKeyScratch;
+    mutable bool bPlanBaked = false; // The plan above belongs to TopologyHash and is complete
+    mutable size_t PlanCacheHits = 0;
+    mutable size_t PlanCacheMisses = 0;
+
+    size_t WorkerCount;
+    CDevice* Device = nullptr;
+    mutable std::unique_ptr<CWorkerPool> Workers; // Created on the first Execute
+    mutable std::vector<size_t> StepLists; // The list each time step is recorded into
+    mutable std::vector<size_t> ListFirstSteps;
+    mutable std::vector<CCommandList::Ref> ExecuteLists;
+    // Per list, null unless the list records a render pass group
+    mutable std::vector<IParallelRenderContext::Ref> ExecuteRenderPasses;
+    mutable CBarrierStats BarrierStats;
 };
 
 } /* namespace RHI */
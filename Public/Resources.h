@@ -25,7 +25,11 @@ enum class EBufferUsageFlags : uint32_t
     // Accessibility flags
     Dynamic = 1 << 16,
     Upload = 1 << 17,
-    Readback = 1 << 18
+    Readback = 1 << 18,
+
+    // Tracking flags
+    // The state is only what TransitionBuffer declared, no access tracking at all
+    ExplicitState = 1 << 24
 };
 
 DEFINE_ENUM_CLASS_BITWISE_OPERATORS(EBufferUsageFlags)
@@ -77,6 +81,10 @@ enum class EImageUsageFlags
     GenMIPMaps = 1 << 4,
     Staging = 1 << 5,
     Storage = 1 << 6,
+    InputAttachment = 1 << 7,
+    // The state is only what TransitionImage declared, no access tracking at all. Not for
+    //   attachments
+    ExplicitState = 1 << 8,
 };
 
 DEFINE_ENUM_CLASS_BITWISE_OPERATORS(EImageUsageFlags)
@@ -0,0 +1,735 @@
+// Drives CAccessTracker with random transitions over random mip and layer ranges and checks the
+//   access maps and the barriers that come out against a per-subresource model. Buffer ranges get
+//   the same against a per-byte model. Everything runs once with vkCmdPipelineBarrier and once
+//   with synchronization2. Barrier calls go to a recorder instead of the driver, no device is
+//   needed
+//
+//   AccessTrackerTest [seed] [runs]
+#include "AccessTracker.h"
+#include "ImageVk.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace RHI;
+
+namespace
+{
+
+struct CRecordedCall
+{
+    VkPipelineStageFlags SrcStages;
+    VkPipelineStageFlags DstStages;
+    std::vector<VkImageMemoryBarrier> ImageBarriers;
+    std::vector<VkBufferMemoryBarrier> BufferBarriers;
+    VkEvent Event = VK_NULL_HANDLE; // Set for event waits
+    bool bHasOwnStages = false; // One barrier out of a synchronization2 call
+    size_t Submission = 0; // Barriers out of one synchronization2 call share it
+};
+
+class CMockRecorder : public CBarrierRecorderVk
+{
+public:
+    void PipelineBarrier(VkCommandBuffer, VkPipelineStageFlags srcStages,
+                         VkPipelineStageFlags dstStages, uint32_t bufferBarrierCount,
+                         const VkBufferMemoryBarrier* bufferBarriers, uint32_t imageBarrierCount,
+                         const VkImageMemoryBarrier* imageBarriers) override
+    {
+        LegacyCalls++;
+        auto& call = Record(srcStages, dstStages);
+        call.ImageBarriers.assign(imageBarriers, imageBarriers + imageBarrierCount);
+        call.BufferBarriers.assign(bufferBarriers, bufferBarriers + bufferBarrierCount);
+    }
+
+#ifdef VK_KHR_synchronization2
+    // Every barrier has stages of its own, so each one is kept as a call by itself. The masks are
+    //   turned back into the legacy types, which they have to fit
+    void PipelineBarrier2(VkCommandBuffer, const VkDependencyInfoKHR& dependencyInfo) override
+    {
+        Sync2Calls++;
+        for (uint32_t i = 0; i < dependencyInfo.memoryBarrierCount; i++)
+        {
+            const auto& barrier = dependencyInfo.pMemoryBarriers[i];
+            Record(barrier.srcStageMask, barrier.dstStageMask, true);
+        }
+        for (uint32_t i = 0; i < dependencyInfo.bufferMemoryBarrierCount; i++)
+        {
+            const auto& barrier = dependencyInfo.pBufferMemoryBarriers[i];
+            VkBufferMemoryBarrier legacy = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+            legacy.srcAccessMask = Narrow(barrier.srcAccessMask);
+            legacy.dstAccessMask = Narrow(barrier.dstAccessMask);
+            legacy.srcQueueFamilyIndex = barrier.srcQueueFamilyIndex;
+            legacy.dstQueueFamilyIndex = barrier.dstQueueFamilyIndex;
+            legacy.buffer = barrier.buffer;
+            legacy.offset = barrier.offset;
+            legacy.size = barrier.size;
+            auto& call = Record(barrier.srcStageMask, barrier.dstStageMask, true);
+            call.BufferBarriers.push_back(legacy);
+        }
+        for (uint32_t i = 0; i < dependencyInfo.imageMemoryBarrierCount; i++)
+        {
+            const auto& barrier = dependencyInfo.pImageMemoryBarriers[i];
+            VkImageMemoryBarrier legacy = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+            legacy.srcAccessMask = Narrow(barrier.srcAccessMask);
+            legacy.dstAccessMask = Narrow(barrier.dstAccessMask);
+            legacy.oldLayout = barrier.oldLayout;
+            legacy.newLayout = barrier.newLayout;
+            legacy.srcQueueFamilyIndex = barrier.srcQueueFamilyIndex;
+            legacy.dstQueueFamilyIndex = barrier.dstQueueFamilyIndex;
+            legacy.image = barrier.image;
+            legacy.subresourceRange = barrier.subresourceRange;
+            auto& call = Record(barrier.srcStageMask, barrier.dstStageMask, true);
+            call.ImageBarriers.push_back(legacy);
+        }
+        Submissions++;
+    }
+#endif
+
+    void WaitEvent(VkCommandBuffer, VkEvent event, VkPipelineStageFlags srcStages,
+                   VkPipelineStageFlags dstStages,
+                   const VkImageMemoryBarrier* imageBarrier) override
+    {
+        auto& call = Record(srcStages, dstStages);
+        call.Event = event;
+        if (imageBarrier)
+            call.ImageBarriers.push_back(*imageBarrier);
+    }
+
+    std::vector<CRecordedCall> Calls;
+    size_t LegacyCalls = 0;
+    size_t Sync2Calls = 0;
+    size_t WideMasks = 0; // Masks with bits the legacy types can't hold
+
+private:
+    CRecordedCall& Record(uint64_t srcStages, uint64_t dstStages, bool hasOwnStages = false)
+    {
+        Calls.push_back({ Narrow(srcStages), Narrow(dstStages) });
+        Calls.back().bHasOwnStages = hasOwnStages;
+        Calls.back().Submission = hasOwnStages ? Submissions : Submissions++;
+        return Calls.back();
+    }
+
+    uint32_t Narrow(uint64_t mask)
+    {
+        WideMasks += (mask >> 32) != 0;
+        return static_cast<uint32_t>(mask);
+    }
+
+    size_t Submissions = 0;
+};
+
+#ifdef VK_KHR_synchronization2
+// Never called, the recorder takes the barriers before they would get here
+void VKAPI_CALL NoPipelineBarrier2(VkCommandBuffer, const VkDependencyInfoKHR*) {}
+#endif
+
+class CMockImage : public CImageVk
+{
+public:
+    CMockImage(uint32_t id, uint32_t mipLevels, uint32_t arrayLayers)
+        : Handle((VkImage)(uintptr_t)id)
+        , MipLevels(mipLevels)
+        , ArrayLayers(arrayLayers)
+    {
+        InitializeAccess(0, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, VK_IMAGE_LAYOUT_UNDEFINED);
+    }
+
+    // CImage interface
+    EFormat GetFormat() const override { return EFormat::R8G8B8A8_UNORM; }
+    EImageUsageFlags GetUsageFlags() const override { return EImageUsageFlags::Sampled; }
+    uint32_t GetWidth() const override { return 1u << MipLevels; }
+    uint32_t GetHeight() const override { return 1u << MipLevels; }
+    uint32_t GetDepth() const override { return 1; }
+    uint32_t GetMipLevels() const override { return MipLevels; }
+    uint32_t GetArrayLayers() const override { return ArrayLayers; }
+    uint32_t GetSampleCount() const override { return 1; }
+
+    // CImageVk interface
+    VkImage GetVkImage() const override { return Handle; }
+    VkFormat GetVkFormat() const override { return VK_FORMAT_R8G8B8A8_UNORM; }
+    bool IsConcurrentAccess() const override { return false; }
+    bool IsSwapChainProxy() const override { return false; }
+
+private:
+    VkImage Handle;
+    uint32_t MipLevels;
+    uint32_t ArrayLayers;
+};
+
+const CAccessRecord kAccesses[] = {
+    { VK_ACCESS_SHADER_READ_BIT,
+      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+    { VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL },
+    { VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL },
+    { VK_ACCESS_TRANSFER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL },
+    { VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_IMAGE_LAYOUT_GENERAL },
+    { VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_IMAGE_LAYOUT_GENERAL },
+};
+
+enum class EExpectedBarrier
+{
+    None,
+    Execution, // Write after read in the same layout
+    Image,
+};
+
+EExpectedBarrier Classify(const CAccessRecord& oldAccess, const CAccessRecord& newAccess)
+{
+    if (oldAccess.IsUntracked())
+        return EExpectedBarrier::None;
+    bool sameLayout = oldAccess.ImageLayout == newAccess.ImageLayout;
+    if (sameLayout && !oldAccess.IsWrite() && !newAccess.IsWrite())
+        return EExpectedBarrier::None;
+    if (sameLayout && !oldAccess.IsWrite())
+        return EExpectedBarrier::Execution;
+    return EExpectedBarrier::Image;
+}
+
+// The reference model, one record per subresource
+struct CModelImage
+{
+    std::shared_ptr<CMockImage> Image;
+    uint32_t MipLevels;
+    uint32_t ArrayLayers;
+    std::vector<CAccessRecord> First; // What the tracker has seen
+    std::vector<CAccessRecord> Last;
+    std::vector<CAccessRecord> Current; // What the image itself is in
+
+    size_t Index(uint32_t mip, uint32_t layer) const { return mip * ArrayLayers + layer; }
+};
+
+struct CContext
+{
+    unsigned Seed;
+    int Run;
+    int Step;
+    const char* Phase;
+};
+
+bool Check(bool condition, const CContext& ctx, const char* what)
+{
+    if (!condition)
+        printf("FAILED seed %u run %d step %d (%s): %s\n", ctx.Seed, ctx.Run, ctx.Step, ctx.Phase,
+               what);
+    return condition;
+}
+
+CImageSubresourceRange WholeRange(const CModelImage& model)
+{
+    CImageSubresourceRange range;
+    range.Set(0, model.MipLevels, 0, model.ArrayLayers);
+    return range;
+}
+
+// Runs of an access map spread out into one record per subresource. Runs must not overlap
+bool Flatten(const CImageAccessMap& map, const CModelImage& model,
+             std::vector<CAccessRecord>& grid, size_t& runCount)
+{
+    grid.assign(model.MipLevels * model.ArrayLayers, CAccessRecord::Untracked());
+    runCount = 0;
+    bool disjoint = true;
+    map.ForEachRun(WholeRange(model),
+                   [&](const CImageSubresourceRange& range, const CAccessRecord& record) {
+                       runCount++;
+                       for (uint32_t mip = range.BaseMipLevel;
+                            mip < range.BaseMipLevel + range.LevelCount; mip++)
+                           for (uint32_t layer = range.BaseArrayLayer;
+                                layer < range.BaseArrayLayer + range.LayerCount; layer++)
+                           {
+                               auto& entry = grid[model.Index(mip, layer)];
+                               disjoint &= entry.IsUntracked();
+                               entry = record;
+                           }
+                   });
+    return disjoint;
+}
+
+bool CheckMap(const CImageAccessMap* map, const CModelImage& model,
+              const std::vector<CAccessRecord>& expected, const CContext& ctx, const char* what)
+{
+    std::vector<CAccessRecord> grid;
+    size_t runCount = 0;
+    if (!map)
+    {
+        for (const auto& record : expected)
+            if (!Check(record.IsUntracked(), ctx, what))
+                return false;
+        return true;
+    }
+    if (!Check(Flatten(*map, model, grid, runCount), ctx, "access map runs overlap"))
+        return false;
+    return Check(grid == expected, ctx, what);
+}
+
+// A synchronization2 barrier has exactly the stages of its own transition, a legacy call those of
+//   everything in it
+bool StagesCover(const CRecordedCall& call, VkPipelineStageFlags srcStages,
+                 VkPipelineStageFlags dstStages)
+{
+    if (call.bHasOwnStages)
+        return call.SrcStages == srcStages && call.DstStages == dstStages;
+    return (call.SrcStages & srcStages) == srcStages && (call.DstStages & dstStages) == dstStages;
+}
+
+// Checks the barriers recorded for moving each subresource in range from oldAccess to newAccess.
+//   Unless the calls are all about this one image, other images may add calls of their own
+bool CheckBarriers(const std::vector<CRecordedCall>& calls, const CModelImage& model,
+                   const CImageSubresourceRange& range,
+                   const std::vector<CAccessRecord>& oldAccess,
+                   const std::vector<CAccessRecord>& newAccess, bool isOnlyImage,
+                   const CContext& ctx)
+{
+    std::vector<int> coverage(model.MipLevels * model.ArrayLayers, 0);
+    for (const auto& call : calls)
+        for (const auto& barrier : call.ImageBarriers)
+        {
+            if (barrier.image != model.Image->GetVkImage())
+                continue;
+            const auto& sub = barrier.subresourceRange;
+            if (!Check(sub.aspectMask == VK_IMAGE_ASPECT_COLOR_BIT, ctx, "wrong aspect mask")
+                || !Check(barrier.srcQueueFamilyIndex == VK_QUEUE_FAMILY_IGNORED
+                              && barrier.dstQueueFamilyIndex == VK_QUEUE_FAMILY_IGNORED,
+                          ctx, "unexpected ownership transfer"))
+                return false;
+            for (uint32_t mip = sub.baseMipLevel; mip < sub.baseMipLevel + sub.levelCount; mip++)
+                for (uint32_t layer = sub.baseArrayLayer;
+                     layer < sub.baseArrayLayer + sub.layerCount; layer++)
+                {
+                    size_t i = model.Index(mip, layer);
+                    const auto& from = oldAccess[i];
+                    const auto& to = newAccess[i];
+                    coverage[i]++;
+                    if (!Check(barrier.srcAccessMask == from.AccessType
+                                   && barrier.dstAccessMask == to.AccessType,
+                               ctx, "image barrier access masks")
+                        || !Check(barrier.oldLayout == from.ImageLayout
+                                      && barrier.newLayout == to.ImageLayout,
+                                  ctx, "image barrier layouts")
+                        || !Check(StagesCover(call, from.Stages, to.Stages), ctx,
+                                  "image barrier stages"))
+                        return false;
+                }
+        }
+
+    bool anyExpected = false;
+    for (uint32_t mip = range.BaseMipLevel; mip < range.BaseMipLevel + range.LevelCount; mip++)
+        for (uint32_t layer = range.BaseArrayLayer;
+             layer < range.BaseArrayLayer + range.LayerCount; layer++)
+        {
+            size_t i = model.Index(mip, layer);
+            auto expected = Classify(oldAccess[i], newAccess[i]);
+            anyExpected |= expected != EExpectedBarrier::None;
+            int wanted = expected == EExpectedBarrier::Image ? 1 : 0;
+            if (!Check(coverage[i] == wanted, ctx,
+                       wanted ? "subresource missing its image barrier"
+                              : "image barrier on a subresource that needs none"))
+                return false;
+            coverage[i] = 0;
+            if (expected != EExpectedBarrier::Execution)
+                continue;
+            bool covered = false;
+            for (const auto& call : calls)
+                covered |= (call.SrcStages & oldAccess[i].Stages) == oldAccess[i].Stages
+                    && (call.DstStages & newAccess[i].Stages) == newAccess[i].Stages;
+            if (!Check(covered, ctx, "write after read without an execution barrier"))
+                return false;
+        }
+    for (int count : coverage)
+        if (!Check(count == 0, ctx, "image barrier outside the transitioned range"))
+            return false;
+    return anyExpected || !isOnlyImage
+        || Check(calls.empty(), ctx, "barrier recorded when none was needed");
+}
+
+CImageSubresourceRange RandomRange(std::mt19937& rng, const CModelImage& model)
+{
+    CImageSubresourceRange range = WholeRange(model);
+    // Whole-image transitions keep the uniform path busy too
+    if (rng() % 4 == 0)
+        return range;
+    range.BaseMipLevel = rng() % model.MipLevels;
+    range.LevelCount = 1 + rng() % (model.MipLevels - range.BaseMipLevel);
+    range.BaseArrayLayer = rng() % model.ArrayLayers;
+    range.LayerCount = 1 + rng() % (model.ArrayLayers - range.BaseArrayLayer);
+    return range;
+}
+
+template <typename TFn> void ForEachSubresource(const CImageSubresourceRange& range, TFn&& fn)
+{
+    for (uint32_t mip = range.BaseMipLevel; mip < range.BaseMipLevel + range.LevelCount; mip++)
+        for (uint32_t layer = range.BaseArrayLayer;
+             layer < range.BaseArrayLayer + range.LayerCount; layer++)
+            fn(mip, layer);
+}
+
+// A split barrier stands in for the full barrier once, and only while the image is still in the
+//   access the event was set after
+bool CheckSplitBarriers(CMockRecorder& recorder, VkCommandBuffer cmdBuffer)
+{
+    CContext ctx { 0, 0, 0, "split barriers" };
+    auto image = std::make_shared<CMockImage>(100, 2, 2);
+    CImageSubresourceRange whole;
+    whole.Set(0, 2, 0, 2);
+    const CAccessRecord& read = kAccesses[0];
+    const CAccessRecord& write = kAccesses[2];
+    image->UpdateAccess(whole, write);
+
+    auto makeSplit = [&]() {
+        auto split = std::make_shared<CSplitBarrierVk>();
+        split->Event = (VkEvent)(uintptr_t)1;
+        split->Image = image.get();
+        split->Range = whole;
+        split->Stages = image->GetLastAccessStages(whole);
+        split->Generation = image->GetAccessGeneration();
+        return split;
+    };
+    // Returns how many of the calls were event waits, -1 if the tracker says otherwise
+    auto deploy = [&](const std::shared_ptr<CSplitBarrierVk>& split, const CAccessRecord& record) {
+        CAccessTracker tracker;
+        tracker.TransitionImage(cmdBuffer, image.get(), whole, record.AccessType, record.Stages,
+                                record.ImageLayout);
+        recorder.Calls.clear();
+        bool waitedOnEvent = tracker.DeployAllBarriers(cmdBuffer, false, { split });
+        int eventWaits = 0;
+        for (const auto& call : recorder.Calls)
+            eventWaits += call.Event != VK_NULL_HANDLE;
+        return waitedOnEvent == (eventWaits != 0) ? eventWaits : -1;
+    };
+
+    auto split = makeSplit();
+    ctx.Step = 0;
+    if (!Check(deploy(split, read) > 0, ctx, "split barrier not used for the access it covers"))
+        return false;
+    ctx.Step = 1;
+    if (!Check(deploy(split, write) == 0 && !recorder.Calls.empty(), ctx,
+               "split barrier used a second time"))
+        return false;
+
+    // Some other list got to the image between the signal and the wait
+    split = makeSplit();
+    CImageSubresourceRange mip1;
+    mip1.Set(1, 1, 0, 2);
+    image->UpdateAccess(mip1, write);
+    ctx.Step = 2;
+    return Check(deploy(split, read) == 0 && !recorder.Calls.empty(), ctx,
+                 "split barrier used after the image moved on");
+}
+
+const CAccessRecord kBufferAccesses[] = {
+    { VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_IMAGE_LAYOUT_UNDEFINED },
+    { VK_ACCESS_TRANSFER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_IMAGE_LAYOUT_UNDEFINED },
+    { VK_ACCESS_SHADER_READ_BIT,
+      VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_IMAGE_LAYOUT_UNDEFINED },
+    { VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_IMAGE_LAYOUT_UNDEFINED },
+    { VK_ACCESS_INDEX_READ_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_IMAGE_LAYOUT_UNDEFINED },
+    { VK_ACCESS_INDIRECT_COMMAND_READ_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+      VK_IMAGE_LAYOUT_UNDEFINED },
+};
+
+// Random range transitions of one buffer through the tracker's CBufferAccessMap, checked against a
+//   per-byte model. Each step queues two of them into one batch the way the tracker does, a buffer
+//   barrier from every tracked range the transition overlaps. Where the two overlap, the second
+//   barrier has to go out in a later call than the first
+bool CheckBufferBarriers(CMockRecorder& recorder, VkCommandBuffer cmdBuffer, unsigned seed,
+                         bool isSync2)
+{
+    CContext ctx { seed, 0, 0, isSync2 ? "buffer, synchronization2" : "buffer" };
+    // Only a key in the maps, never dereferenced
+    auto* buffer = reinterpret_cast<CBufferVk*>(static_cast<uintptr_t>(64));
+    auto handle = (VkBuffer)(uintptr_t)1;
+    const size_t size = 256;
+    const int steps = 2000;
+    std::mt19937 rng(seed);
+
+    struct CExpected
+    {
+        VkAccessFlags SrcAccess;
+        VkAccessFlags DstAccess;
+        VkPipelineStageFlags SrcStages;
+        VkPipelineStageFlags DstStages;
+    };
+    std::vector<CAccessRecord> first(size, CAccessRecord::Untracked());
+    std::vector<CAccessRecord> last(size, CAccessRecord::Untracked());
+    CBufferAccessMap firstMap;
+    CBufferAccessMap lastMap;
+    for (int step = 0; step < steps; step++)
+    {
+        ctx.Step = step;
+        std::vector<std::vector<CExpected>> expected(size);
+        CBarrierBatchVk batch;
+        recorder.Calls.clear();
+        for (int i = 0; i < 2; i++)
+        {
+            size_t offset = rng() % size;
+            CBufferRange range { buffer, offset, 1 + rng() % (size - offset) };
+            const auto& record = kBufferAccesses[rng() % std::size(kBufferAccesses)];
+            lastMap.ForEachOverlap(range, [&](const CBufferRange& overlap,
+                                              const CAccessRecord& oldAccess) {
+                VkBufferMemoryBarrier barrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+                barrier.srcAccessMask = oldAccess.AccessType;
+                barrier.dstAccessMask = record.AccessType;
+                barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                barrier.buffer = handle;
+                barrier.offset = overlap.Offset;
+                barrier.size = overlap.Size;
+                batch.Add(cmdBuffer, oldAccess.Stages, record.Stages, barrier);
+            });
+            firstMap.AssignUntracked(range, record);
+            lastMap.Assign(range, record);
+
+            for (size_t byte = range.Offset; byte < range.Offset + range.Size; byte++)
+            {
+                if (!last[byte].IsUntracked())
+                    expected[byte].push_back({ last[byte].AccessType, record.AccessType,
+                                               last[byte].Stages, record.Stages });
+                if (first[byte].IsUntracked())
+                    first[byte] = record;
+                last[byte] = record;
+            }
+        }
+        batch.Flush(cmdBuffer);
+
+        // Which call each byte's barriers came in, in order
+        std::vector<std::vector<size_t>> submissions(size);
+        std::vector<size_t> seen(size, 0);
+        for (const auto& call : recorder.Calls)
+            for (const auto& barrier : call.BufferBarriers)
+            {
+                if (!Check(barrier.buffer == handle && barrier.size > 0
+                               && barrier.offset + barrier.size <= size,
+                           ctx, "buffer barrier outside the buffer")
+                    || !Check(barrier.srcQueueFamilyIndex == VK_QUEUE_FAMILY_IGNORED
+                                  && barrier.dstQueueFamilyIndex == VK_QUEUE_FAMILY_IGNORED,
+                              ctx, "unexpected ownership transfer"))
+                    return false;
+                for (size_t byte = barrier.offset; byte < barrier.offset + barrier.size; byte++)
+                {
+                    size_t index = seen[byte]++;
+                    if (!Check(index < expected[byte].size(), ctx,
+                               "buffer barrier on a byte that needs none"))
+                        return false;
+                    const auto& want = expected[byte][index];
+                    if (!Check(barrier.srcAccessMask == want.SrcAccess
+                                   && barrier.dstAccessMask == want.DstAccess,
+                               ctx, "buffer barrier access masks")
+                        || !Check(StagesCover(call, want.SrcStages, want.DstStages), ctx,
+                                  "buffer barrier stages")
+                        || !Check(submissions[byte].empty()
+                                      || submissions[byte].back() < call.Submission,
+                                  ctx, "overlapping buffer barriers in one call"))
+                        return false;
+                    submissions[byte].push_back(call.Submission);
+                }
+            }
+        for (size_t byte = 0; byte < size; byte++)
+            if (!Check(seen[byte] == expected[byte].size(), ctx, "byte missing its buffer barrier"))
+                return false;
+
+        // Tracked ranges are disjoint, and neighbours with the same access are merged
+        const CBufferAccessMap* maps[] = { &firstMap, &lastMap };
+        const std::vector<CAccessRecord>* models[] = { &first, &last };
+        for (int i = 0; i < 2; i++)
+        {
+            std::vector<CAccessRecord> grid(size, CAccessRecord::Untracked());
+            size_t end = 0;
+            const CAccessRecord* previous = nullptr;
+            bool isCanonical = true;
+            maps[i]->ForEach([&](const CBufferRange& range, const CAccessRecord& record) {
+                isCanonical &= range.Buffer == buffer && range.Size > 0 && range.Offset >= end
+                    && !(previous && range.Offset == end && *previous == record);
+                for (size_t byte = range.Offset; byte < range.Offset + range.Size; byte++)
+                    grid[byte] = record;
+                end = range.Offset + range.Size;
+                previous = &record;
+            });
+            if (!Check(isCanonical, ctx, "buffer ranges overlap or aren't merged")
+                || !Check(grid == *models[i], ctx,
+                          i == 0 ? "buffer first access map" : "buffer last access map"))
+                return false;
+        }
+    }
+    return true;
+}
+
+// The random image transitions, with a fresh tracker for each run that is then deployed like a
+//   submission would
+bool RunRandomTransitions(CMockRecorder& recorder, VkCommandBuffer cmdBuffer, unsigned seed,
+                          int runs, bool isSync2)
+{
+    const int imagesPerRun = 3;
+    const int stepsPerRun = 200;
+    std::mt19937 rng(seed);
+    size_t transitions = 0;
+    std::chrono::nanoseconds trackerTime(0);
+    size_t fragmentSamples = 0;
+    size_t fragmentSum = 0;
+    size_t fragmentMax = 0;
+
+    for (int run = 0; run < runs; run++)
+    {
+        CContext ctx { seed, run, 0, "setup" };
+        std::vector<CModelImage> models;
+        for (int i = 0; i < imagesPerRun; i++)
+        {
+            CModelImage model;
+            model.MipLevels = 1 + rng() % 8;
+            model.ArrayLayers = 1 + rng() % 12;
+            model.Image = std::make_shared<CMockImage>(i + 1, model.MipLevels, model.ArrayLayers);
+            size_t count = model.MipLevels * model.ArrayLayers;
+            model.First.assign(count, CAccessRecord::Untracked());
+            model.Last.assign(count, CAccessRecord::Untracked());
+            model.Current.assign(count, { 0, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                          VK_IMAGE_LAYOUT_UNDEFINED });
+            // Whatever earlier submissions left behind
+            for (uint32_t j = rng() % 4; j > 0; j--)
+            {
+                auto range = RandomRange(rng, model);
+                const auto& record = kAccesses[rng() % std::size(kAccesses)];
+                model.Image->UpdateAccess(range, record);
+                ForEachSubresource(range, [&](uint32_t mip, uint32_t layer) {
+                    model.Current[model.Index(mip, layer)] = record;
+                });
+            }
+            models.push_back(std::move(model));
+        }
+
+        CAccessTracker tracker;
+        ctx.Phase = "transition";
+        for (int step = 0; step < stepsPerRun; step++)
+        {
+            ctx.Step = step;
+            auto& model = models[rng() % models.size()];
+            auto range = RandomRange(rng, model);
+            const auto& record = kAccesses[rng() % std::size(kAccesses)];
+
+            recorder.Calls.clear();
+            auto start = std::chrono::steady_clock::now();
+            tracker.TransitionImage(cmdBuffer, model.Image.get(), range, record.AccessType,
+                                    record.Stages, record.ImageLayout);
+            tracker.FlushBarriers(cmdBuffer);
+            trackerTime += std::chrono::steady_clock::now() - start;
+            transitions++;
+
+            std::vector<CAccessRecord> newAccess = model.Last;
+            ForEachSubresource(range, [&](uint32_t mip, uint32_t layer) {
+                size_t i = model.Index(mip, layer);
+                newAccess[i] = record;
+                if (model.First[i].IsUntracked())
+                    model.First[i] = record;
+            });
+            if (!CheckBarriers(recorder.Calls, model, range, model.Last, newAccess, true,
+                               ctx))
+                return false;
+            model.Last = std::move(newAccess);
+
+            if (!CheckMap(tracker.GetFirstAccess(model.Image.get()), model, model.First, ctx,
+                          "first access map")
+                || !CheckMap(tracker.GetLastAccess(model.Image.get()), model, model.Last, ctx,
+                             "last access map"))
+                return false;
+        }
+
+        for (const auto& model : models)
+        {
+            const CImageAccessMap* maps[] = { tracker.GetFirstAccess(model.Image.get()),
+                                              tracker.GetLastAccess(model.Image.get()) };
+            for (const auto* map : maps)
+            {
+                if (!map)
+                    continue;
+                std::vector<CAccessRecord> grid;
+                size_t runCount = 0;
+                Flatten(*map, model, grid, runCount);
+                fragmentSamples++;
+                fragmentSum += runCount;
+                fragmentMax = std::max(fragmentMax, runCount);
+            }
+        }
+
+        // Submission brings each image from where it is to the first access, then takes on the
+        //   last access
+        ctx.Phase = "deploy";
+        recorder.Calls.clear();
+        tracker.DeployAllBarriers(cmdBuffer);
+        for (auto& model : models)
+        {
+            std::vector<CAccessRecord> from = model.Current;
+            std::vector<CAccessRecord> to = model.Current;
+            for (size_t i = 0; i < from.size(); i++)
+            {
+                const auto& first = model.First[i];
+                if (first.IsUntracked() || first.ImageLayout == VK_IMAGE_LAYOUT_UNDEFINED
+                    || first.ImageLayout == VK_IMAGE_LAYOUT_PREINITIALIZED)
+                    from[i] = CAccessRecord::Untracked();
+                else
+                    to[i] = first;
+            }
+            if (!CheckBarriers(recorder.Calls, model, WholeRange(model), from, to, false,
+                               ctx))
+                return false;
+
+            for (size_t i = 0; i < model.Current.size(); i++)
+                if (!model.Last[i].IsUntracked())
+                    model.Current[i] = model.Last[i];
+            if (!CheckMap(&model.Image->GetLastAccess(), model, model.Current, ctx,
+                          "image state after submission"))
+                return false;
+        }
+    }
+
+    printf("%-16s: %d runs, %zu transitions: %.1f ns/transition, %.2f fragments/image (max %zu)\n",
+           isSync2 ? "synchronization2" : "legacy", runs, transitions,
+           static_cast<double>(trackerTime.count()) / transitions,
+           static_cast<double>(fragmentSum) / std::max<size_t>(fragmentSamples, 1), fragmentMax);
+    return true;
+}
+
+// Runs every check, with the barriers going out either way
+bool RunChecks(CMockRecorder& recorder, VkCommandBuffer cmdBuffer, unsigned seed, int runs,
+               bool isSync2)
+{
+    recorder.LegacyCalls = 0;
+    recorder.Sync2Calls = 0;
+    if (!CheckBufferBarriers(recorder, cmdBuffer, seed, isSync2)
+        || !RunRandomTransitions(recorder, cmdBuffer, seed, runs, isSync2))
+        return false;
+    CContext ctx { seed, 0, 0, isSync2 ? "synchronization2" : "legacy" };
+    return Check(isSync2 ? recorder.LegacyCalls == 0 : recorder.Sync2Calls == 0, ctx,
+                 "barriers took the other path")
+        && Check(recorder.WideMasks == 0, ctx, "mask with more than the legacy bits");
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    unsigned seed = argc > 1 ? static_cast<unsigned>(strtoul(argv[1], nullptr, 10)) : 1;
+    int runs = argc > 2 ? atoi(argv[2]) : 200;
+
+    CMockRecorder recorder;
+    CBarrierBatchVk::SetRecorder(&recorder);
+    auto cmdBuffer = (VkCommandBuffer)(uintptr_t)1;
+    bool passed = CheckSplitBarriers(recorder, cmdBuffer)
+        && RunChecks(recorder, cmdBuffer, seed, runs, false);
+#ifdef VK_KHR_synchronization2
+    // The same once more, with each barrier keeping its own stages
+    CBarrierBatchVk::SetPipelineBarrier2(NoPipelineBarrier2);
+    passed = passed && RunChecks(recorder, cmdBuffer, seed, runs, true);
+    CBarrierBatchVk::SetPipelineBarrier2(nullptr);
+#endif
+    CBarrierBatchVk::SetRecorder(nullptr);
+    return passed ? 0 : 1;
+}